@@ -0,0 +1,347 @@
+/********************************************************************
+*
+* ILI9341_T4 library example: benchmark.
+*
+* Runs a fixed set of synthetic workloads and prints the results in CSV
+* format on the serial port (one line per configuration) so that the
+* performance of different versions of the library can be compared.
+*
+* The following parameters are swept (edit the arrays below to change
+* the sweep, a full run with the default values, i.e. 1280 configurations
+* of BENCH_WARMUP + BENCH_FRAMES frames each, takes about an hour):
+*
+* - the workload (static, small sprite, scroll, full noise, camera-like
+*   noise with a compare mask)
+* - the screen orientation (all four rotations)
+* - the diff buffer type (DiffBuff or DiffBuffRect)
+* - the buffering mode (double or triple buffering)
+* - the SPI clock
+* - the diff gap
+* - the diff buffer size
+* - vsync (off or on)
+*
+* Before the sweep, the diffs of each workload are replayed to check that
+* their writes only move down the screen (see checkWriteOrder()).
+*
+* For each configuration, a few frames are drawn first (not measured)
+* then the statistics are reset and BENCH_FRAMES frames are drawn.
+*
+* Columns of the CSV:
+*
+* lib          : library version (BENCH_LIB_VERSION below)
+* diff         : type of diff buffer
+* workload     : name of the workload
+* rotation     : screen orientation
+* buffering    : 2 = double buffering, 3 = triple buffering
+* spi_hz       : SPI clock
+* gap          : diff gap
+* diff_size    : size of each diff buffer (bytes)
+* vsync        : vsync spacing (0 = vsync off)
+* frames       : number of frames measured
+* fps          : statsFramerate()
+* speedup      : statsDiffSpeedUp()
+* teared       : statsRatioTeared() (1 when vsync is off)
+* upload_us    : average upload time per frame
+* cpu_us       : average cpu time per frame (used by the driver)
+* pixels       : average number of pixels uploaded per frame
+* transactions : average number of transactions per frame
+* diff_overflow: ratio of diffs that overflowed (both diff buffers)
+* diff_used    : average size of the diffs (bytes for DiffBuff, number
+*                of rectangles for DiffBuffRect)
+* diff_us      : average time to compute a diff
+*
+********************************************************************/
+
+#include <Arduino.h>
+#include <ILI9341_T4.h>
+
+
+// DEFAULT WIRING USING SPI 0 ON TEENSY 4/4.1
+// Recall that DC must be on a valid cs pin !!!
+#define PIN_SCK     13      // mandatory
+#define PIN_MISO    12      // mandatory
+#define PIN_MOSI    11      // mandatory
+#define PIN_DC      10      // mandatory
+#define PIN_CS      9       // mandatory (but can be any digital pin)
+#define PIN_RESET   6       // could be omitted (set to 255) yet it is better to use (any) digital pin whenever possible.
+#define PIN_BACKLIGHT 255   // optional. Set this only if the screen LED pin is connected directly to the Teensy
+#define PIN_TOUCH_IRQ 255   // optional. Set this only if touch is connected on the same spi bus (otherwise, set it to 255)
+#define PIN_TOUCH_CS  255   // optional. Set this only if touch is connected on the same spi bus (otherwise, set it to 255)
+
+
+// ALTERNATE WIRING USING SPI 1 ON TEENSY 4/4.1
+// Recall that DC must be on a valid cs pin !!!
+
+//#define PIN_SCK     27      // mandatory
+//#define PIN_MISO    1       // mandatory
+//#define PIN_MOSI    26      // mandatory
+//#define PIN_DC      0       // mandatory
+//#define PIN_CS      30      // mandatory (but can be any digital pin)
+//#define PIN_RESET   29      // could be omitted (set to 255) yet it is better to use (any) digital pin whenever possible.
+//#define PIN_BACKLIGHT 255   // optional. Set this only if the screen LED pin is connected directly to the Teensy
+//#define PIN_TOUCH_IRQ 255   // optional. Set this only if touch is connected on the same spi bus (otherwise, set it to 255)
+//#define PIN_TOUCH_CS  255   // optional. Set this only if touch is connected on the same spi bus (otherwise, set it to 255)
+
+
+
+#define BENCH_LIB_VERSION   "0.1"   // version of the library (reported in the CSV)
+#define BENCH_FRAMES        120     // number of frames measured for each configuration
+#define BENCH_WARMUP        10      // number of frames drawn before the measure starts
+#define BENCH_REFRESH_RATE  120     // display refresh rate (Hz)
+
+
+// the parameters to sweep
+const uint32_t SPI_CLOCKS[] = { 30000000, 50000000 };   // reduce the max value if the screen does not support it.
+const int GAPS[]            = { 4, 10 };
+const int DIFF_SIZES[]      = { 4000, 20000 };          // (each value must not exceed DIFF_MAX_SIZE)
+const int BUFFERINGS[]      = { 2, 3 };
+const int VSYNCS[]          = { 0, 2 };
+
+#define DIFF_MAX_SIZE 20000
+
+#define NB_ELEM(T) ((int)(sizeof(T)/sizeof(T[0])))
+
+
+// the screen driver object
+ILI9341_T4::ILI9341Driver tft(PIN_CS, PIN_DC, PIN_SCK, PIN_MOSI, PIN_MISO, PIN_RESET, PIN_TOUCH_CS, PIN_TOUCH_IRQ);
+
+
+// memory for the diff buffers (shared by all the diff objects since only one pair is used at a time)
+uint8_t diffmem1[DIFF_MAX_SIZE];
+uint8_t diffmem2[DIFF_MAX_SIZE];
+
+ILI9341_T4::DiffBuff* diffs1[NB_ELEM(DIFF_SIZES)];
+ILI9341_T4::DiffBuff* diffs2[NB_ELEM(DIFF_SIZES)];
+ILI9341_T4::DiffBuffRect* rdiffs1[NB_ELEM(DIFF_SIZES)];
+ILI9341_T4::DiffBuffRect* rdiffs2[NB_ELEM(DIFF_SIZES)];
+
+
+// framebuffers
+DMAMEM uint16_t internal_fb1[240 * 320];   // used by the library for double buffering
+DMAMEM uint16_t internal_fb2[240 * 320];   // used by the library for triple buffering
+uint16_t fb[240 * 320];                    // the framebuffer we draw onto.
+
+
+
+/********************************************************************
+* Workloads
+********************************************************************/
+
+enum { WL_STATIC, WL_SPRITE, WL_SCROLL, WL_NOISE, WL_CAMERA, NB_WORKLOADS };
+
+const char* WORKLOAD_NAMES[NB_WORKLOADS] = { "static", "sprite", "scroll", "noise", "camera" };
+
+
+uint32_t rng_state = 1;
+
+/** fast deterministic pseudo random generator (xorshift) */
+inline uint32_t rnd()
+    {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+    }
+
+
+/** background pattern: checkerboard with a gradient */
+inline uint16_t pattern(int x, int y)
+    {
+    const uint16_t g = (uint16_t)(((x + y) >> 3) & 31);
+    return ((((x >> 4) ^ (y >> 4)) & 1) ? (g << 11) : g) | 0x0400;
+    }
+
+
+/** draw frame number 'frame' of a workload in a framebuffer of size lx x ly */
+void drawFrame(int workload, int frame, uint16_t * fb, int lx, int ly)
+    {
+    switch (workload)
+        {
+        case WL_STATIC:
+            {
+            for (int j = 0; j < ly; j++) for (int i = 0; i < lx; i++) fb[i + lx * j] = pattern(i, j);
+            return;
+            }
+        case WL_SPRITE:
+            { // 32x32 square bouncing on the static background
+            for (int j = 0; j < ly; j++) for (int i = 0; i < lx; i++) fb[i + lx * j] = pattern(i, j);
+            const int S = 32;
+            int px = (frame * 3) % (2 * (lx - S)); if (px >= lx - S) px = 2 * (lx - S) - px;
+            int py = (frame * 2) % (2 * (ly - S)); if (py >= ly - S) py = 2 * (ly - S) - py;
+            for (int j = 0; j < S; j++) for (int i = 0; i < S; i++) fb[(px + i) + lx * (py + j)] = (((i - 16) * (i - 16) + (j - 16) * (j - 16)) < 256) ? 0xFFE0 : 0xF800;
+            return;
+            }
+        case WL_SCROLL:
+            { // background scrolling vertically by 2 lines per frame
+            const int off = 2 * frame;
+            for (int j = 0; j < ly; j++) for (int i = 0; i < lx; i++) fb[i + lx * j] = pattern(i, (j + off) % (4 * ly));
+            return;
+            }
+        case WL_NOISE:
+            { // every pixel changes
+            for (int k = 0; k < lx * ly; k++) fb[k] = (uint16_t)rnd();
+            return;
+            }
+        case WL_CAMERA:
+            { // slowly moving gradient with noise on the lowest bits (to be used with a compare mask)
+            for (int j = 0; j < ly; j++) for (int i = 0; i < lx; i++)
+                {
+                const int v = ((i + j + frame) >> 2) & 31;
+                fb[i + lx * j] = (uint16_t)(((v << 11) | (v << 6) | v) ^ (rnd() & 0x0841));
+                }
+            return;
+            }
+        }
+    }
+
+
+
+/********************************************************************
+* Benchmark
+********************************************************************/
+
+
+/**
+* Check that the writes of a diff only move down the screen (required to chase the 
+* scanline without tearing): compute the diffs of a few frames of each workload and 
+* count the instructions that start above, or end above, the previous one.
+**/
+int checkWriteOrder(ILI9341_T4::DiffBuffBase* diff)
+    {
+    int nbback = 0;
+    for (int w = 0; w < NB_WORKLOADS; w++)
+        {
+        rng_state = 1;
+        memset(internal_fb2, 0, sizeof(internal_fb2));
+        for (int frame = 0; frame < 20; frame++)
+            {
+            drawFrame(w, frame, fb, 240, 320);
+            diff->computeDiff(internal_fb2, fb, 0, GAPS[0], true, 0);
+            diff->initRead();
+            int prev_y = 0, prev_last = 0;
+            int x, y, ww, len;
+            while (diff->readDiffRect(x, y, ww, len, 2 * 320) == 0)
+                {
+                const int last = y + ((len > ww) ? ((len - 1) / ww) : ((x + len - 1) / 240)); // last line written
+                if ((y < prev_y) || (last < prev_last)) nbback++;
+                prev_y = y;
+                if (last > prev_last) prev_last = last;
+                }
+            }
+        }
+    return nbback;
+    }
+
+
+/** run a configuration and print the corresponding line of the CSV */
+void runBench(bool rect, int workload, int rotation, int buffering, uint32_t spi, int gap, int sizeindex, int vsync)
+    {
+    ILI9341_T4::DiffBuffBase * d1 = (rect ? (ILI9341_T4::DiffBuffBase*)rdiffs1[sizeindex] : (ILI9341_T4::DiffBuffBase*)diffs1[sizeindex]);
+    ILI9341_T4::DiffBuffBase * d2 = (rect ? (ILI9341_T4::DiffBuffBase*)rdiffs2[sizeindex] : (ILI9341_T4::DiffBuffBase*)diffs2[sizeindex]);
+
+    tft.setRotation(rotation);
+    const int lx = tft.width();
+    const int ly = tft.height();
+    tft.setSpiClock(spi);
+    tft.setFramebuffers(internal_fb1, (buffering == 3) ? internal_fb2 : nullptr);
+    tft.setDiffBuffers(d1, d2);
+    tft.setDiffGap(gap);
+    tft.setRefreshRate(BENCH_REFRESH_RATE);
+    tft.setVSyncSpacing(vsync);
+    if (workload == WL_CAMERA) tft.setDiffCompareMask(2, 3, 2); else tft.setDiffCompareMask(0);
+
+    rng_state = 1; // same content for every configuration
+    int frame = 0;
+    for (; frame < BENCH_WARMUP; frame++) { drawFrame(workload, frame, fb, lx, ly); tft.update(fb); }
+    tft.waitUpdateAsyncComplete();
+
+    tft.statsReset();
+    if (rect) { rdiffs1[sizeindex]->statsReset(); rdiffs2[sizeindex]->statsReset(); }
+    else { diffs1[sizeindex]->statsReset(); diffs2[sizeindex]->statsReset(); }
+
+    for (int k = 0; k < BENCH_FRAMES; k++, frame++) { drawFrame(workload, frame, fb, lx, ly); tft.update(fb); }
+    tft.waitUpdateAsyncComplete();
+
+    // diff buffer stats (both buffers combined)
+    uint32_t nbc, nbo;
+    float used, dt;
+    if (rect)
+        {
+        ILI9341_T4::DiffBuffRect* a = rdiffs1[sizeindex];
+        ILI9341_T4::DiffBuffRect* b = rdiffs2[sizeindex];
+        nbc = a->statsNbComputed() + b->statsNbComputed();
+        nbo = a->statsNbOverflow() + b->statsNbOverflow();
+        used = (nbc == 0) ? 0.0f : ((a->statsSize().avg() * a->statsNbComputed() + b->statsSize().avg() * b->statsNbComputed()) / nbc);
+        dt = (nbc == 0) ? 0.0f : ((a->statsTime().avg() * a->statsNbComputed() + b->statsTime().avg() * b->statsNbComputed()) / nbc);
+        }
+    else
+        {
+        ILI9341_T4::DiffBuff* a = diffs1[sizeindex];
+        ILI9341_T4::DiffBuff* b = diffs2[sizeindex];
+        nbc = a->statsNbComputed() + b->statsNbComputed();
+        nbo = a->statsNbOverflow() + b->statsNbOverflow();
+        used = (nbc == 0) ? 0.0f : ((a->statsSize().avg() * a->statsNbComputed() + b->statsSize().avg() * b->statsNbComputed()) / nbc);
+        dt = (nbc == 0) ? 0.0f : ((a->statsTime().avg() * a->statsNbComputed() + b->statsTime().avg() * b->statsNbComputed()) / nbc);
+        }
+
+    Serial.printf("%s,%s,%s,%d,%d,%u,%d,%d,%d,%u,", BENCH_LIB_VERSION, (rect ? "DiffBuffRect" : "DiffBuff"), WORKLOAD_NAMES[workload], rotation, buffering, spi, gap, DIFF_SIZES[sizeindex], vsync, tft.statsNbFrames());
+    Serial.printf("%.2f,%.3f,%.3f,", tft.statsFramerate(), tft.statsDiffSpeedUp(), tft.statsRatioTeared());
+    Serial.printf("%.1f,%.1f,%.1f,%.1f,", tft.statsUploadtimePerFrame().avg(), tft.statsCPUtimePerFrame().avg(), tft.statsPixelsPerFrame().avg(), tft.statsTransactionsPerFrame().avg());
+    Serial.printf("%.3f,%.1f,%.1f\n", ((nbc == 0) ? 0.0f : ((float)nbo) / nbc), used, dt);
+    }
+
+
+
+void setup()
+    {
+    Serial.begin(9600);
+    while (!Serial) {}
+
+    while (!tft.begin(SPI_CLOCKS[0]))
+        {
+        Serial.println("Initialization error...");
+        delay(1000);
+        }
+
+    if (PIN_BACKLIGHT != 255)
+        { // make sure backlight is on
+        pinMode(PIN_BACKLIGHT, OUTPUT);
+        digitalWrite(PIN_BACKLIGHT, HIGH);
+        }
+
+    for (int i = 0; i < NB_ELEM(DIFF_SIZES); i++)
+        {
+        diffs1[i] = new ILI9341_T4::DiffBuff(diffmem1, DIFF_SIZES[i]);
+        diffs2[i] = new ILI9341_T4::DiffBuff(diffmem2, DIFF_SIZES[i]);
+        rdiffs1[i] = new ILI9341_T4::DiffBuffRect(diffmem1, DIFF_SIZES[i]);
+        rdiffs2[i] = new ILI9341_T4::DiffBuffRect(diffmem2, DIFF_SIZES[i]);
+        }
+
+    const int n1 = checkWriteOrder(diffs1[NB_ELEM(DIFF_SIZES) - 1]);
+    const int n2 = checkWriteOrder(rdiffs1[NB_ELEM(DIFF_SIZES) - 1]);
+    Serial.printf("# write order check: %d (DiffBuff) and %d (DiffBuffRect) writes going back up the screen (should be 0)\n", n1, n2);
+
+    Serial.println("lib,diff,workload,rotation,buffering,spi_hz,gap,diff_size,vsync,frames,fps,speedup,teared,upload_us,cpu_us,pixels,transactions,diff_overflow,diff_used,diff_us");
+    elapsedMillis em;
+    for (int rect = 0; rect < 2; rect++)
+        for (int w = 0; w < NB_WORKLOADS; w++)
+            for (int rot = 0; rot < 4; rot++)
+                for (int b = 0; b < NB_ELEM(BUFFERINGS); b++)
+                    for (int s = 0; s < NB_ELEM(SPI_CLOCKS); s++)
+                        for (int g = 0; g < NB_ELEM(GAPS); g++)
+                            for (int d = 0; d < NB_ELEM(DIFF_SIZES); d++)
+                                for (int v = 0; v < NB_ELEM(VSYNCS); v++)
+                                    {
+                                    runBench(rect, w, rot, BUFFERINGS[b], SPI_CLOCKS[s], GAPS[g], d, VSYNCS[v]);
+                                    }
+    Serial.printf("# done in %u seconds\n", ((uint32_t)em) / 1000);
+    }
+
+
+
+void loop()
+    {
+    }
+
+
+/** end of file */
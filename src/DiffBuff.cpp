@@ -1,4 +1,5 @@
 #include "DiffBuff.h"
+#include "DirtyMap.h"
 
 
 
@@ -37,6 +38,17 @@ namespace ILI9341_T4
             }
 
 
+        void DiffBuffBase::computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask, const DirtyMap* dirtymap, LineSignatures* linesigs)
+            {
+            computeDiff(fb_old, fb_new, fb_new_orientation, gap, copy_new_over_old, compare_mask);
+            if (linesigs)
+                { // no signatures computed
+                linesigs->discard();
+                if (copy_new_over_old) linesigs->invalidate();
+                }
+            }
+
+
         void DiffBuffBase::copyfb(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation)
             {
             switch (fb_new_orientation)
@@ -59,6 +71,67 @@ namespace ILI9341_T4
             }
 
 
+        void DiffBuffBase::copyfb(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, const DirtyMap* dirtymap)
+            {
+            if (dirtymap == nullptr)
+                {
+                copyfb(fb_old, fb_new, fb_new_orientation);
+                return;
+                }
+            for (int ty = 0; ty < DirtyMap::NY; ty++)
+                {
+                uint32_t mask = dirtymap->rowMask(ty);
+                while (mask)
+                    { // copy each run of consecutive dirty tiles
+                    const int tx1 = __builtin_ctz(mask);
+                    const int tx2 = tx1 + __builtin_ctz(~(mask >> tx1)); // one past the end of the run
+                    mask &= ~(((tx2 == 32) ? 0xFFFFFFFF : ((1u << tx2) - 1)));
+                    const int x1 = tx1 * DirtyMap::TILE;
+                    const int w = (tx2 - tx1) * DirtyMap::TILE;
+                    for (int y = ty * DirtyMap::TILE; y < (ty + 1) * DirtyMap::TILE; y++)
+                        {
+                        int m, mdelta;
+                        _orientedIndex(fb_new_orientation, x1, y, m, mdelta);
+                        uint16_t* p = fb_old + x1 + DiffBuffBase::LX * y;
+                        for (int k = 0; k < w; k++) { p[k] = fb_new[m]; m += mdelta; }
+                        }
+                    }
+                }
+            }
+
+
+        void DiffBuffBase::copyfbDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, DiffBuffBase* diff)
+            {
+            if (diff == nullptr)
+                {
+                copyfb(fb_old, fb_new, fb_new_orientation);
+                return;
+                }
+            const int N = DiffBuffBase::LX * DiffBuffBase::LY;
+            diff->initRaw();
+            int pos = 0;
+            while (pos < N)
+                {
+                int nbwrite = 0, nbskip = 0;
+                diff->readRaw(nbwrite, nbskip);
+                if (nbwrite > N - pos) nbwrite = N - pos;
+                const int end = pos + nbwrite;
+                while (pos < end)
+                    { // copy the run line by line
+                    const int x = pos % DiffBuffBase::LX;
+                    const int y = pos / DiffBuffBase::LX;
+                    const int w = ((end - pos) < (DiffBuffBase::LX - x)) ? (end - pos) : (DiffBuffBase::LX - x);
+                    int m, mdelta;
+                    _orientedIndex(fb_new_orientation, x, y, m, mdelta);
+                    uint16_t* p = fb_old + pos;
+                    for (int k = 0; k < w; k++) { p[k] = fb_new[m]; m += mdelta; }
+                    pos += w;
+                    }
+                pos += nbskip;
+                }
+            }
+
+
         void DiffBuffBase::copyfb(uint16_t* fb_old, const uint16_t* fb_new, int xmin, int xmax, int ymin, int ymax, int src_stride, int fb_new_orientation)
             {
             int x1, x2, y1, y2;
@@ -86,6 +159,70 @@ namespace ILI9341_T4
 
 
     
+        void DiffBuffBase::scrollfb(uint16_t* fb, int shift)
+            {
+            shift %= DiffBuffBase::LY;
+            if (shift < 0) shift += DiffBuffBase::LY;
+            if ((fb == nullptr) || (shift == 0)) return;
+            // rotate the lines by following the permutation cycles so that each line is moved only once. 
+            int g = DiffBuffBase::LY, b = shift;
+            while (b != 0) { const int t = g % b; g = b; b = t; } // g = number of cycles. 
+            uint16_t tmp[DiffBuffBase::LX];
+            for (int c = 0; c < g; c++)
+                {
+                memcpy(tmp, fb + DiffBuffBase::LX * c, sizeof(tmp));
+                int j = c;
+                while (1)
+                    {
+                    int k = j + shift; 
+                    if (k >= DiffBuffBase::LY) k -= DiffBuffBase::LY;
+                    if (k == c) break;
+                    memcpy(fb + DiffBuffBase::LX * j, fb + DiffBuffBase::LX * k, sizeof(tmp));
+                    j = k;
+                    }
+                memcpy(fb + DiffBuffBase::LX * j, tmp, sizeof(tmp));
+                }
+            }
+
+
+        void DiffBuffBase::halfLine(uint16_t* dst, const uint16_t* fb_half, int fb_half_orientation, int y)
+            {
+            int m, mdelta;
+            _orientedIndexHalf(fb_half_orientation, 0, y >> 1, m, mdelta);
+            for (int i = 0; i < DiffBuffBase::HX; i++, m += mdelta)
+                {
+                const uint16_t v = fb_half[m];
+                dst[2 * i] = v;
+                dst[2 * i + 1] = v;
+                }
+            }
+
+
+        void DiffBuffBase::copyfbHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation)
+            {
+            for (int y = 0; y < DiffBuffBase::LY; y += 2)
+                {
+                uint16_t* p = fb_old + DiffBuffBase::LX * y;
+                halfLine(p, fb_half, fb_half_orientation, y);
+                memcpy(p + DiffBuffBase::LX, p, sizeof(uint16_t) * DiffBuffBase::LX); // same odd line
+                }
+            }
+
+
+        void DiffBuffBase::paletteLine(uint16_t* dst, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int y)
+            {
+            int m, mdelta;
+            _orientedIndex(fb8_orientation, 0, y, m, mdelta);
+            for (int i = 0; i < DiffBuffBase::LX; i++, m += mdelta) dst[i] = palette[fb8[m]];
+            }
+
+
+        void DiffBuffBase::copyfbPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation)
+            {
+            for (int y = 0; y < DiffBuffBase::LY; y++) paletteLine(fb_old + DiffBuffBase::LX * y, fb8, palette, fb8_orientation, y);
+            }
+
+
         void DiffBuffBase::_copy_rotate_0(uint16_t* fb_dest, const uint16_t* fb_src)
             {
             memcpy(fb_dest, fb_src, sizeof(uint16_t) * DiffBuffBase::LX * DiffBuffBase::LY);
@@ -94,18 +231,7 @@ namespace ILI9341_T4
 
         void DiffBuffBase::_copy_rotate_90(uint16_t* fb_dest, const uint16_t* fb_src)
             {
-            uint16_t* p = fb_dest;
-            for (int i = 0; i < DiffBuffBase::LY; i++)
-                {
-                int j = DiffBuffBase::LX - 1;
-                while (j >= 0)
-                    {
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j--)];
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j--)];
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j--)];
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j--)];
-                    }
-                }
+            _copy_rotate_90(fb_dest, fb_src, 0, DiffBuffBase::LX - 1, 0, DiffBuffBase::LY - 1, DiffBuffBase::LX, DiffBuffBase::LY, DiffBuffBase::LY);
             }
 
 
@@ -129,18 +255,7 @@ namespace ILI9341_T4
 
         void DiffBuffBase::_copy_rotate_270(uint16_t* fb_dest, const uint16_t* fb_src)
             {
-            uint16_t* p = fb_dest;
-            for (int i = DiffBuffBase::LY - 1; i >= 0; i--)
-                {
-                int j = 0;
-                while (j < DiffBuffBase::LX)
-                    {
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j++)];
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j++)];
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j++)];
-                    *(p++) = fb_src[i + DiffBuffBase::LY * (j++)];
-                    }
-                }
+            _copy_rotate_270(fb_dest, fb_src, 0, DiffBuffBase::LX - 1, 0, DiffBuffBase::LY - 1, DiffBuffBase::LX, DiffBuffBase::LY, DiffBuffBase::LY);
             }
 
 
@@ -159,15 +274,23 @@ namespace ILI9341_T4
 
 
         void DiffBuffBase::_copy_rotate_90(uint16_t* fb_dest, const uint16_t* fb_src, int x1, int x2, int y1, int y2, int w, int h, int src_stride)
-            {
+            { 
+            // pixel (x1 + i, y1 + j) of fb_dest is fb_src[j + src_stride*(w - 1 - i)]. We proceed by blocks so that 
+            // the source is read along its lines and the destination lines of the block stay in cache. 
             uint16_t* p = fb_dest + x1 + (DiffBuffBase::LX*y1);
-            for (int j = 0; j < h; j++)
-                {   
-                for (int i = w-1; i >= 0 ; i--)                    
+            for (int jb = 0; jb < h; jb += ROTATION_TILE)
+                {
+                const int je = (jb + ROTATION_TILE < h) ? (jb + ROTATION_TILE) : h;
+                for (int ib = 0; ib < w; ib += ROTATION_TILE)
                     {
-                    *(p++) = fb_src[j + (src_stride * i)];
+                    const int ie = (ib + ROTATION_TILE < w) ? (ib + ROTATION_TILE) : w;
+                    for (int i = ib; i < ie; i++)
+                        {
+                        const uint16_t* s = fb_src + (src_stride * (w - 1 - i));
+                        uint16_t* d = p + i;
+                        for (int j = jb; j < je; j++) d[DiffBuffBase::LX * j] = s[j];
+                        }
                     }
-                p += (DiffBuffBase::LX - w);
                 }
             }
         
@@ -188,14 +311,21 @@ namespace ILI9341_T4
 
         void DiffBuffBase::_copy_rotate_270(uint16_t* fb_dest, const uint16_t* fb_src, int x1, int x2, int y1, int y2, int w, int h, int src_stride)
             {
+            // pixel (x1 + i, y1 + j) of fb_dest is fb_src[(h - 1 - j) + src_stride*i]. Same block traversal as for _copy_rotate_90().
             uint16_t* p = fb_dest + x1 + (DiffBuffBase::LX*y1);
-            for (int j = h - 1; j >= 0; j--)
-                {   
-                for (int i = 0; i < w ; i++)   
+            for (int jb = 0; jb < h; jb += ROTATION_TILE)
+                {
+                const int je = (jb + ROTATION_TILE < h) ? (jb + ROTATION_TILE) : h;
+                for (int ib = 0; ib < w; ib += ROTATION_TILE)
                     {
-                    *(p++) = fb_src[j + (src_stride * i)];
+                    const int ie = (ib + ROTATION_TILE < w) ? (ib + ROTATION_TILE) : w;
+                    for (int i = ib; i < ie; i++)
+                        {
+                        const uint16_t* s = fb_src + (src_stride * i) + (h - 1);
+                        uint16_t* d = p + i;
+                        for (int j = jb; j < je; j++) d[DiffBuffBase::LX * j] = s[-j];
+                        }
                     }
-                p += (DiffBuffBase::LX - w);
                 }
             }
 
@@ -238,7 +368,7 @@ namespace ILI9341_T4
 
 #define COMPUTE_DIFF_LOOP_MASK(INDEX)    {                                                       \
                                          const int ind = (INDEX);                                \
-                                         if (((fb_old[n]) ^ (fb_new[ind])) & compare_mask)       \
+                                         if (_pixelDiffer(fb_old[n], fb_new[ind], compare_mask, lossy)) \
                                              COMPUTE_DIFF_LOOP_SUB                               \
                                          else { cgap++; }                                        \
                                          n++;                                                    \
@@ -267,6 +397,36 @@ namespace ILI9341_T4
                                     }
 
 
+// Fast path: compare 4 pixels at once using two 32-bit words (WNEW0, WNEW1 hold the new pixels packed
+// in the same layout as fb_old[n..n+3]). If the 4 pixels are identical (up to the mask), they are simply 
+// added to the current gap. Otherwise, we fall through to the per-pixel code which handles the run boundary.
+#define COMPUTE_DIFF_PACKED(WNEW0, WNEW1, ADVANCE)  {                                                             \
+                                                    const uint32_t d = (_load32(fb_old + n) ^ (WNEW0))            \
+                                                                     | (_load32(fb_old + n + 2) ^ (WNEW1));       \
+                                                    if (((USE_MASK) ? (d & mask32) : d) == 0)                     \
+                                                        {                                                         \
+                                                        cgap += 4;                                                \
+                                                        n += 4;                                                   \
+                                                        ADVANCE;                                                  \
+                                                        continue;                                                 \
+                                                        }                                                         \
+                                                    }
+
+
+// Streaming: publish the instructions computed so far each time a new band of fb_old is reached. 
+#define COMPUTE_DIFF_STREAM     { if (n >= _stream_next) _streamPublish(fb_old, pos, n); }
+
+
+// EXTMEM: ask the cache to load the next line of both framebuffers while the current one is compared
+// (OLDNEXT and NEWNEXT point to the first pixel of the next line in memory order).
+#define COMPUTE_DIFF_PREFETCH(OLDNEXT, NEWNEXT)   { if ((prefetch) && (n + DiffBuffBase::LX < DiffBuffBase::LX * DiffBuffBase::LY))   \
+                                                      {                                                                                 \
+                                                      _prefetch((OLDNEXT), 2 * DiffBuffBase::LX);                                       \
+                                                      if (NEWNEXT) _prefetch((NEWNEXT), 2 * DiffBuffBase::LX);                          \
+                                                      }                                                                                 \
+                                                  }
+
+
 #define COMPUTE_DIFF_END    { const int cpos = DiffBuffBase::LX * DiffBuffBase::LY;                   \
                               if (cpos - pos - cgap != 0)                 \
                                   {                                       \
@@ -284,25 +444,54 @@ namespace ILI9341_T4
             int pos = 0;    // number of pixel written in diffbuf
             int n = 0;      // current offset  
             int m = 0; 
-            while(m < DiffBuffBase::LX*DiffBuffBase::LY)
+            const uint32_t mask32 = _pack32(compare_mask, compare_mask);
+            const bool packed = _aligned32(fb_old) && _aligned32(fb_new);
+            const bool prefetch = _extmem(fb_old) || _extmem(fb_new);
+            for (int i = 0; i < DiffBuffBase::LY; i++)
                 {
-                COMPUTE_DIFF_LOOP((m++)) 
+                COMPUTE_DIFF_STREAM
+                const uint32_t lossy = _lossyLine(i);
+                COMPUTE_DIFF_PREFETCH(fb_old + n + DiffBuffBase::LX, fb_new + m + DiffBuffBase::LX)
+                const int mend = m + DiffBuffBase::LX;
+                while (m < mend)
+                    {
+                    if (packed) COMPUTE_DIFF_PACKED(_load32(fb_new + m), _load32(fb_new + m + 2), m += 4)
+                    COMPUTE_DIFF_LOOP((m++)) 
+                    COMPUTE_DIFF_LOOP((m++)) 
+                    }
                 }
             COMPUTE_DIFF_END
             }
 
         template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
-        void DiffBuff::_computeDiff1(uint16_t* fb_old, const uint16_t* fb_new, int gap, uint16_t compare_mask)
+        void DiffBuff::_computeDiff1(uint16_t* fb_old, const uint16_t* fb_src, int gap, uint16_t compare_mask)
             {
+            // the source is first rotated by bands of lines in a small buffer (reading it column-wise, as 
+            // required by the rotation, is very slow because of cache misses) and the diff is computed 
+            // from the buffer exactly as in orientation 0. 
+            uint16_t fb_new[ROTATION_BAND * DiffBuffBase::LX] __attribute__((aligned(4)));
             int cgap = 0;   // current gap size;
             int pos = 0;    // number of pixel written in diffbuf
             int n = 0;      // current offset  
-            for (int i = 0; i < DiffBuffBase::LY; i++)
+            const uint32_t mask32 = _pack32(compare_mask, compare_mask);
+            const bool packed = _aligned32(fb_old);
+            const bool prefetch = _extmem(fb_old);
+            for (int ib = 0; ib < DiffBuffBase::LY; ib += ROTATION_BAND)
                 {
-                int j = DiffBuffBase::LX - 1;
-                while (j >= 0)
+                _rotateBand(fb_new, fb_src, LANDSCAPE_320x240, ib, ROTATION_BAND);
+                int m = 0;
+                for (int i = 0; i < ROTATION_BAND; i++)
                     {
-                    COMPUTE_DIFF_LOOP((i + DiffBuffBase::LY * (j--)))
+                    COMPUTE_DIFF_STREAM
+                    const uint32_t lossy = _lossyLine(ib + i);
+                    COMPUTE_DIFF_PREFETCH(fb_old + n + DiffBuffBase::LX, (const uint16_t*)nullptr) // the rotated band is in internal RAM
+                    const int mend = m + DiffBuffBase::LX;
+                    while (m < mend)
+                        {
+                        if (packed) COMPUTE_DIFF_PACKED(_load32(fb_new + m), _load32(fb_new + m + 2), m += 4)
+                        COMPUTE_DIFF_LOOP((m++))
+                        COMPUTE_DIFF_LOOP((m++))
+                        }
                     }
                 }
             COMPUTE_DIFF_END
@@ -315,13 +504,99 @@ namespace ILI9341_T4
             int cgap = 0;   // current gap size;
             int pos = 0;    // number of pixel written in diffbuf
             int n = 0;      // current offset  
-            for (int j = DiffBuffBase::LY - 1; j >= 0; j--)
+            int m = DiffBuffBase::LX * DiffBuffBase::LY - 1; // pixels are read backward
+            const uint32_t mask32 = _pack32(compare_mask, compare_mask);
+            const bool packed = _aligned32(fb_old) && _aligned32(fb_new);
+            const bool prefetch = _extmem(fb_old) || _extmem(fb_new);
+            for (int i = 0; i < DiffBuffBase::LY; i++)
                 {
-                int i = DiffBuffBase::LX - 1;
-                while (i >= 0)
+                COMPUTE_DIFF_STREAM
+                const uint32_t lossy = _lossyLine(i);
+                COMPUTE_DIFF_PREFETCH(fb_old + n + DiffBuffBase::LX, fb_new + m + 1 - 2 * DiffBuffBase::LX)
+                const int mend = m - DiffBuffBase::LX;
+                while (m > mend)
                     {
-                    const int oo = DiffBuffBase::LX * j;
-                    COMPUTE_DIFF_LOOP(((i--) + oo))
+                    if (packed) COMPUTE_DIFF_PACKED(_swap16(_load32(fb_new + m - 1)), _swap16(_load32(fb_new + m - 3)), m -= 4)
+                    COMPUTE_DIFF_LOOP((m--))
+                    COMPUTE_DIFF_LOOP((m--))
+                    }
+                }
+            COMPUTE_DIFF_END
+            }
+
+
+        template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
+        void DiffBuff::_computeDiff3(uint16_t* fb_old, const uint16_t* fb_src, int gap, uint16_t compare_mask)
+            {
+            // same as _computeDiff1() (the source is rotated by bands of lines first).
+            uint16_t fb_new[ROTATION_BAND * DiffBuffBase::LX] __attribute__((aligned(4)));
+            int cgap = 0;   // current gap size;
+            int pos = 0;    // number of pixel written in diffbuf
+            int n = 0;      // current offset  
+            const uint32_t mask32 = _pack32(compare_mask, compare_mask);
+            const bool packed = _aligned32(fb_old);
+            const bool prefetch = _extmem(fb_old);
+            for (int ib = 0; ib < DiffBuffBase::LY; ib += ROTATION_BAND)
+                {
+                _rotateBand(fb_new, fb_src, LANDSCAPE_320x240_FLIPPED, ib, ROTATION_BAND);
+                int m = 0;
+                for (int i = 0; i < ROTATION_BAND; i++)
+                    {
+                    COMPUTE_DIFF_STREAM
+                    const uint32_t lossy = _lossyLine(ib + i);
+                    COMPUTE_DIFF_PREFETCH(fb_old + n + DiffBuffBase::LX, (const uint16_t*)nullptr) // the rotated band is in internal RAM
+                    const int mend = m + DiffBuffBase::LX;
+                    while (m < mend)
+                        {
+                        if (packed) COMPUTE_DIFF_PACKED(_load32(fb_new + m), _load32(fb_new + m + 2), m += 4)
+                        COMPUTE_DIFF_LOOP((m++))
+                        COMPUTE_DIFF_LOOP((m++))
+                        }
+                    }
+                }
+            COMPUTE_DIFF_END
+            }
+
+
+        template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
+        void DiffBuff::_computeDiffDirty(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, uint16_t compare_mask, const DirtyMap* dirtymap)
+            {
+            int cgap = 0;   // current gap size;
+            int pos = 0;    // number of pixel written in diffbuf
+            int n = 0;      // current offset  
+            for (int ty = 0; ty < DirtyMap::NY; ty++)
+                {
+                COMPUTE_DIFF_STREAM
+                const uint32_t mask = dirtymap->rowMask(ty);
+                if (mask == 0)
+                    { // whole line of tiles is clean: just extend the gap
+                    cgap += DirtyMap::TILE * DiffBuffBase::LX;
+                    n += DirtyMap::TILE * DiffBuffBase::LX;
+                    continue;
+                    }
+                for (int y = ty * DirtyMap::TILE; y < (ty + 1) * DirtyMap::TILE; y++)
+                    {
+                    COMPUTE_DIFF_STREAM
+                    const uint32_t lossy = _lossyLine(y);
+                    int m, mdelta;
+                    _orientedIndex(fb_new_orientation, 0, y, m, mdelta);
+                    for (int tx = 0; tx < DirtyMap::NX; tx++)
+                        {
+                        if ((mask >> tx) & 1)
+                            {
+                            for (int k = 0; k < DirtyMap::TILE; k++)
+                                {
+                                if (USE_MASK) COMPUTE_DIFF_LOOP_MASK(m) else COMPUTE_DIFF_LOOP_NOMASK(m)
+                                m += mdelta;
+                                }
+                            }
+                        else
+                            { // clean tile
+                            cgap += DirtyMap::TILE;
+                            n += DirtyMap::TILE;
+                            m += DirtyMap::TILE * mdelta;
+                            }
+                        }
                     }
                 }
             COMPUTE_DIFF_END
@@ -329,17 +604,119 @@ namespace ILI9341_T4
 
 
         template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
-        void DiffBuff::_computeDiff3(uint16_t* fb_old, const uint16_t* fb_new, int gap, uint16_t compare_mask)
+        void DiffBuff::_computeDiffSig0(uint16_t* fb_old, const uint16_t* fb_new, int gap, uint16_t compare_mask, LineSignatures* linesigs)
             {
             int cgap = 0;   // current gap size;
             int pos = 0;    // number of pixel written in diffbuf
             int n = 0;      // current offset  
-            for (int i = DiffBuffBase::LY - 1; i >= 0; i--)
+            const uint32_t mask32 = _pack32(compare_mask, compare_mask);
+            const bool packed = _aligned32(fb_old) && _aligned32(fb_new);
+            const uint32_t sigmask32 = (USE_MASK) ? mask32 : 0xFFFFFFFF;
+            const bool usesig = linesigs->valid(compare_mask); 
+            const uint32_t lossy = 0; // (perceptual diffs never use the line signatures)
+            const uint32_t* cursig = linesigs->_sig[linesigs->_cur];
+            uint32_t* nextsig = linesigs->_sig[linesigs->_cur ^ 1];
+            for (int i = 0; i < DiffBuffBase::LY; i++)
                 {
-                int j = 0;
-                while (j < DiffBuffBase::LX)
+                COMPUTE_DIFF_STREAM
+                int m = DiffBuffBase::LX * i;
+                const uint32_t sig = _lineSignature(fb_new + m, sigmask32, packed);
+                nextsig[i] = sig;
+                if ((usesig) && (cursig[i] == sig))
+                    { // same line: skip it without touching fb_old
+                    cgap += DiffBuffBase::LX;
+                    n += DiffBuffBase::LX;
+                    continue;
+                    }
+                const int mend = m + DiffBuffBase::LX;
+                while (m < mend)
                     {
-                    COMPUTE_DIFF_LOOP((i + DiffBuffBase::LY * (j++)))
+                    if (packed) COMPUTE_DIFF_PACKED(_load32(fb_new + m), _load32(fb_new + m + 2), m += 4)
+                    COMPUTE_DIFF_LOOP((m++))
+                    COMPUTE_DIFF_LOOP((m++))
+                    }
+                }
+            COMPUTE_DIFF_END
+            // we only get here if the diff did not overflow: the next signatures are valid. 
+            linesigs->_valid[linesigs->_cur ^ 1] = true;
+            linesigs->_mask[linesigs->_cur ^ 1] = LineSignatures::_normmask(compare_mask);
+            }
+
+
+        void DiffBuff::_computeDiffHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
+            {
+            // each pixel of fb_half covers 2x2 pixels of fb_old which are all equal: only the top left one
+            // is compared and the odd line replays the runs found on the even line above it. 
+            uint32_t changed[(DiffBuffBase::HX + 31) / 32];
+            int cgap = 0;   // current gap size;
+            int pos = 0;    // number of pixel written in diffbuf
+            int n = 0;      // current offset  
+            for (int k = 0; k < DiffBuffBase::HY; k++)
+                {
+                memset(changed, 0, sizeof(changed));
+                int m, mdelta;
+                _orientedIndexHalf(fb_half_orientation, 0, k, m, mdelta);
+                for (int i = 0; i < DiffBuffBase::HX; i++, m += mdelta)
+                    { // even line
+                    const uint16_t v = fb_half[m];
+                    if ((fb_old[n] ^ v) & compare_mask)
+                        {
+                        changed[i >> 5] |= (1u << (i & 31));
+                        if (copy_new_over_old) { fb_old[n] = v; fb_old[n + 1] = v; }
+                        if (cgap >= gap)
+                            {
+                            if (!_write_chunk(n - pos - cgap, cgap)) return;
+                            pos = n;
+                            }
+                        cgap = 0;
+                        }
+                    else { cgap += 2; }
+                    n += 2;
+                    }
+                for (int i = 0; i < DiffBuffBase::HX; i++)
+                    { // odd line
+                    if ((changed[i >> 5] >> (i & 31)) & 1)
+                        {
+                        if (copy_new_over_old) { fb_old[n] = fb_old[n - DiffBuffBase::LX]; fb_old[n + 1] = fb_old[n - DiffBuffBase::LX]; }
+                        if (cgap >= gap)
+                            {
+                            if (!_write_chunk(n - pos - cgap, cgap)) return;
+                            pos = n;
+                            }
+                        cgap = 0;
+                        }
+                    else { cgap += 2; }
+                    n += 2;
+                    }
+                }
+            COMPUTE_DIFF_END
+            }
+
+
+        void DiffBuff::_computeDiffPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
+            {
+            int cgap = 0;   // current gap size;
+            int pos = 0;    // number of pixel written in diffbuf
+            int n = 0;      // current offset  
+            for (int y = 0; y < DiffBuffBase::LY; y++)
+                {
+                int m, mdelta;
+                _orientedIndex(fb8_orientation, 0, y, m, mdelta);
+                for (int i = 0; i < DiffBuffBase::LX; i++, m += mdelta)
+                    {
+                    const uint16_t v = palette[fb8[m]];
+                    if ((fb_old[n] ^ v) & compare_mask)
+                        {
+                        if (copy_new_over_old) { fb_old[n] = v; }
+                        if (cgap >= gap)
+                            {
+                            if (!_write_chunk(n - pos - cgap, cgap)) return;
+                            pos = n;
+                            }
+                        cgap = 0;
+                        }
+                    else { cgap++; }
+                    n++;
                     }
                 }
             COMPUTE_DIFF_END
@@ -350,23 +727,112 @@ namespace ILI9341_T4
 #undef COMPUTE_DIFF_LOOP_MASK
 #undef COMPUTE_DIFF_LOOP_NOMASK
 #undef COMPUTE_DIFF_LOOP
+#undef COMPUTE_DIFF_PACKED
+#undef COMPUTE_DIFF_STREAM
+#undef COMPUTE_DIFF_PREFETCH
 #undef COMPUTE_DIFF_END
 
 
+        void DiffBuff::_streamPublish(const uint16_t* fb_old, int pos, int n)
+            {
+            while (_stream_next <= n) _stream_next += _stream_band;
+            if ((_stream_flush) && (pos > _stream_flushed))
+                { // the DMA reads the pixels directly from fb_old: make sure they are in memory. 
+                if ((uint32_t)fb_old >= 0x20200000u) arm_dcache_flush((void*)(fb_old + _stream_flushed), 2 * (pos - _stream_flushed));
+                _stream_flushed = pos;
+                }
+            asm volatile("dsb" ::: "memory"); // instructions and pixels must be written before they are published. 
+            _posw_ready = _posw;
+            if (!_stream_started)
+                { // check that there is a non-trivial instruction (the first chunk may only contain a skip). 
+                int p = 0;
+                if (_read_encoded(p) == 0) _read_encoded(p);
+                if (_posw > p)
+                    {
+                    _stream_started = true;
+                    _stream_cb(_stream_obj);
+                    }
+                }
+            }
+
+
         void DiffBuff::computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
+            {
+            computeDiff(fb_old, fb_new, fb_new_orientation, gap, copy_new_over_old, compare_mask, nullptr, nullptr);
+            }
+
+
+        void DiffBuff::computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask, const DirtyMap* dirtymap, LineSignatures* linesigs)
             {
             elapsedMicros em; // for stats. 
             if (gap < 1) gap = 1;
             if ((fb_new_orientation < 0) || (fb_new_orientation > 3)) fb_new_orientation = 0;
+            _arenaBegin(); // select the memory to use (if shared)
             _posw = 0; // reset buffer
+            if (linesigs) linesigs->discard();
+            const int band = _stream_req; 
+            _stream_req = 0; // one shot 
+            _lossy_thr = _lossy_req;
+            _lossy_req = 0; // one shot
             if ((_sizebuf <= 0) || (fb_old == nullptr) || (fb_new == nullptr))
                 {
                 _write_encoded(TAG_END);
                 _posw = 0;
+                _lossy_thr = 0;
 //                initRead();
                 return;
                 }
-            if ((compare_mask != 0) && (compare_mask != 0xffff))
+            if (_lossy_thr)
+                { // perceptual diff: the thresholds replace the compare mask and fb_old keeps the pixels skipped. 
+                compare_mask = 0xFFFF;
+                linesigs = nullptr; // fb_old will not match the new frame.
+                }
+            if (band > 0)
+                { // streamed diff
+                _stream_band = band;
+                _stream_next = band;
+                _stream_flushed = 0;
+                _stream_flush = copy_new_over_old;
+                _stream_started = false;
+                _posw_ready = 0;
+                }
+            if ((dirtymap) && (dirtymap->count() == DirtyMap::NX * DirtyMap::NY)) dirtymap = nullptr; // everything dirty: use the full diff. 
+            if (dirtymap)
+                {
+                const bool use_mask = (((compare_mask != 0) && (compare_mask != 0xffff)) || (_lossy_thr));
+                if (use_mask)
+                    {
+                    if (copy_new_over_old)
+                        _computeDiffDirty<true, true>(fb_old, fb_new, fb_new_orientation, gap, compare_mask, dirtymap);
+                    else
+                        _computeDiffDirty<false, true>(fb_old, fb_new, fb_new_orientation, gap, compare_mask, dirtymap);
+                    }
+                else
+                    {
+                    if (copy_new_over_old)
+                        _computeDiffDirty<true, false>(fb_old, fb_new, fb_new_orientation, gap, compare_mask, dirtymap);
+                    else
+                        _computeDiffDirty<false, false>(fb_old, fb_new, fb_new_orientation, gap, compare_mask, dirtymap);
+                    }
+                }
+            else if ((linesigs) && (fb_new_orientation == PORTRAIT_240x320))
+                {
+                if ((compare_mask != 0) && (compare_mask != 0xffff))
+                    {
+                    if (copy_new_over_old)
+                        _computeDiffSig0<true, true>(fb_old, fb_new, gap, compare_mask, linesigs);
+                    else
+                        _computeDiffSig0<false, true>(fb_old, fb_new, gap, compare_mask, linesigs);
+                    }
+                else
+                    {
+                    if (copy_new_over_old)
+                        _computeDiffSig0<true, false>(fb_old, fb_new, gap, compare_mask, linesigs);
+                    else
+                        _computeDiffSig0<false, false>(fb_old, fb_new, gap, compare_mask, linesigs);
+                    }
+                }
+            else if (((compare_mask != 0) && (compare_mask != 0xffff)) || (_lossy_thr))
                 {
                 if (copy_new_over_old) 
                     _computeDiff<true, true>(fb_old, fb_new, fb_new_orientation, gap, compare_mask);
@@ -384,10 +850,28 @@ namespace ILI9341_T4
             _write_encoded(TAG_END);
             if ((unsigned int)size() >= (unsigned int)_sizebuf)
                 { // diff is full so copy from new to old may not have been completed...
-                if (copy_new_over_old) copyfb(fb_old, fb_new, fb_new_orientation); // copy again. 
+                if (copy_new_over_old)
+                    { // copy again (only the pixels written by the diff if some pixels were skipped).
+                    if (_lossy_thr) copyfbDiff(fb_old, fb_new, fb_new_orientation, this); else copyfb(fb_old, fb_new, fb_new_orientation, dirtymap);
+                    }
+                if (linesigs) linesigs->discard(); // signatures may be incomplete.  
+                }
+            if (linesigs)
+                { // if fb_old was overwritten, its signatures are now the next ones (invalid if not computed).
+                if (copy_new_over_old) linesigs->commit();
+                }
+            if (band > 0)
+                { // end of the stream: flush the remaining pixels and publish everything. 
+                const int N = DiffBuffBase::LX * DiffBuffBase::LY;
+                if ((_stream_flush) && ((uint32_t)fb_old >= 0x20200000u)) arm_dcache_flush((void*)(fb_old + _stream_flushed), 2 * (N - _stream_flushed));
+                asm volatile("dsb" ::: "memory");
+                _posw_ready = INT_MAX;
+                _stream_next = INT_MAX;
                 }
 //            initRead();
+            _lossy_thr = 0;
             // done. record stats
+            _arenaEnd(band > 0);
             _stats_size.push(size());
             if ((unsigned int)size() >= (unsigned int)_sizebuf) _stat_overflow++;
             _stats_time.push(em);
@@ -401,10 +885,13 @@ namespace ILI9341_T4
                 int nb_write, nb_skip;
                 while(1)
                     {
+                    if (_posr >= _posw_ready) return NOT_READY; // streaming: not computed yet. 
+                    const int p0 = _posr;
                     nb_write = _read_encoded(_posr);         // number of pixel to write
-                    if (nb_write == TAG_END) return -1; // done !
+                    if (nb_write == TAG_END) { _posr = p0; return -1; } // done ! (and stay on the tag so that further calls also return -1)
                     if (nb_write == TAG_WRITE_ALL)
                         { // must write everything
+                        _posr = p0; // stay on the tag: the next read will find nothing left to write. 
                         nb_write = DiffBuffBase::LX * DiffBuffBase::LY - _off;
                         nb_skip = 0;
                         if (nb_write <= 0) return -1;
@@ -464,12 +951,73 @@ namespace ILI9341_T4
             }
 
 
+        bool DiffBuff::computeDiffPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
+            {
+            elapsedMicros em; // for stats. 
+            if (gap < 1) gap = 1;
+            if ((fb8_orientation < 0) || (fb8_orientation > 3)) fb8_orientation = 0;
+            _arenaBegin(); // select the memory to use (if shared)
+            _posw = 0; // reset buffer
+            _stream_req = 0; // no streaming for palettized diffs. 
+            if ((_sizebuf <= 0) || (fb_old == nullptr) || (fb8 == nullptr) || (palette == nullptr))
+                {
+                _write_encoded(TAG_END);
+                _posw = 0;
+                return true;
+                }
+            if (compare_mask == 0) compare_mask = 0xffff;
+            _computeDiffPalette(fb_old, fb8, palette, fb8_orientation, gap, copy_new_over_old, compare_mask);
+            _write_encoded(TAG_END);
+            if ((unsigned int)size() >= (unsigned int)_sizebuf)
+                { // diff is full so copy from new to old may not have been completed...
+                if (copy_new_over_old) copyfbPalette(fb_old, fb8, palette, fb8_orientation); // copy again. 
+                }
+            // done. record stats
+            _arenaEnd(false);
+            _stats_size.push(size());
+            if ((unsigned int)size() >= (unsigned int)_sizebuf) _stat_overflow++;
+            _stats_time.push(em);
+            return true;
+            }
+
+
+        bool DiffBuff::computeDiffHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
+            {
+            elapsedMicros em; // for stats. 
+            if (gap < 1) gap = 1;
+            if ((fb_half_orientation < 0) || (fb_half_orientation > 3)) fb_half_orientation = 0;
+            _arenaBegin(); // select the memory to use (if shared)
+            _posw = 0; // reset buffer
+            _stream_req = 0; // no streaming for half resolution diffs. 
+            if ((_sizebuf <= 0) || (fb_old == nullptr) || (fb_half == nullptr))
+                {
+                _write_encoded(TAG_END);
+                _posw = 0;
+                return true;
+                }
+            if (compare_mask == 0) compare_mask = 0xffff;
+            _computeDiffHalf(fb_old, fb_half, fb_half_orientation, gap, copy_new_over_old, compare_mask);
+            _write_encoded(TAG_END);
+            if ((unsigned int)size() >= (unsigned int)_sizebuf)
+                { // diff is full so copy from new to old may not have been completed...
+                if (copy_new_over_old) copyfbHalf(fb_old, fb_half, fb_half_orientation); // copy again. 
+                }
+            // done. record stats
+            _arenaEnd(false);
+            _stats_size.push(size());
+            if ((unsigned int)size() >= (unsigned int)_sizebuf) _stat_overflow++;
+            _stats_time.push(em);
+            return true;
+            }
+
+
         void DiffBuff::computeDiff(uint16_t* fb_old, DiffBuffBase* diff_old, const uint16_t* sub_fb_new, int xmin, int xmax, int ymin, int ymax, int stride,
                 int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
             {
             elapsedMicros em; // for stats. 
             if (gap < 1) gap = 1;
             if ((fb_new_orientation < 0) || (fb_new_orientation > 3)) fb_new_orientation = 0;
+            _arenaBegin(); // select the memory to use (if shared)
             _posw = 0; // reset buffer
             if ((_sizebuf <= 0) || (fb_old == nullptr) || (sub_fb_new == nullptr))
                 {
@@ -490,6 +1038,7 @@ namespace ILI9341_T4
                 if (copy_new_over_old) copyfb(fb_old, sub_fb_new, xmin, xmax, ymin, ymax, stride, fb_new_orientation); // copy again. 
                 }
             // done. record stats
+            _arenaEnd(false);
 //            initRead();
             _stats_size.push(size());
             if ((unsigned int)size() >= (unsigned int)_sizebuf) _stat_overflow++;
@@ -497,6 +1046,84 @@ namespace ILI9341_T4
             }
 
 
+        bool DiffBuff::computeDiffAddRect(DiffBuffBase* diff_old, int xmin, int xmax, int ymin, int ymax, int gap)
+            {
+            elapsedMicros em; // for stats. 
+            if (gap < 1) gap = 1;
+            _arenaBegin(); // select the memory to use (if shared)
+            _posw = 0; // reset buffer
+            _stream_req = 0; // no streaming for these diffs. 
+            if (_sizebuf <= 0)
+                {
+                _write_encoded(TAG_END);
+                _posw = 0;
+                return true;
+                }
+            if (xmin < 0) xmin = 0;
+            if (xmax >= DiffBuffBase::LX) xmax = DiffBuffBase::LX - 1;
+            if (ymin < 0) ymin = 0;
+            if (ymax >= DiffBuffBase::LY) ymax = DiffBuffBase::LY - 1;
+            if ((xmin > xmax) || (ymin > ymax))
+                { // empty rectangle: same as the old diff
+                xmin = 0; xmax = -1; ymin = 0; ymax = 0;
+                }
+            _computeDiff(nullptr, diff_old, nullptr, xmin, xmax, ymin, ymax, 0, PORTRAIT_240x320, gap, false, 0xFFFF); // no framebuffer: every pixel of the rectangle is written
+            _write_encoded(TAG_END);
+            // done. record stats
+            _arenaEnd(false);
+            _stats_size.push(size());
+            if ((unsigned int)size() >= (unsigned int)_sizebuf) _stat_overflow++;
+            _stats_time.push(em);
+            return true;
+            }
+
+
+        bool DiffBuff::beginDiffRuns(int gap)
+            {
+            _arenaBegin(); // select the memory to use (if shared)
+            _posw = 0; // reset buffer
+            _stream_req = 0; // no streaming for these diffs. 
+            _run_prv = 0;
+            _run_end = 0;
+            _run_gap = (gap < 1) ? 1 : gap;
+            _run_full = (_sizebuf <= 0);
+            return true;
+            }
+
+
+        void DiffBuff::addDiffRun(int pos, int len)
+            {
+            if (_run_full) return;
+            if (pos < _run_end) { len -= (_run_end - pos); pos = _run_end; } // overlap with the previous run
+            if (pos + len > DiffBuffBase::LX * DiffBuffBase::LY) len = DiffBuffBase::LX * DiffBuffBase::LY - pos;
+            if (len <= 0) return;
+            const int skip = pos - _run_end;
+            if (skip >= _run_gap)
+                { // close the pending run
+                if (!_write_chunk(_run_end - _run_prv, skip)) { _run_full = true; return; }
+                _run_prv = pos;
+                }
+            _run_end = pos + len;
+            }
+
+
+        void DiffBuff::endDiffRuns()
+            {
+            if ((_sizebuf > 0) && (!_run_full) && (_run_end > _run_prv))
+                {
+                _write_chunk(_run_end - _run_prv, DiffBuffBase::LX * DiffBuffBase::LY - _run_end);
+                }
+            _run_full = true;
+            _write_encoded(TAG_END);
+            if (_sizebuf <= 0) { _posw = 0; return; }
+            // done. record stats
+            _arenaEnd(false);
+            _stats_size.push(size());
+            if ((unsigned int)size() >= (unsigned int)_sizebuf) _stat_overflow++;
+            // no compute time is recorded: the runs are produced by the caller. 
+            }
+
+
         void DiffBuff::_computeDiff(uint16_t* fb_old, DiffBuffBase* diff_old, const uint16_t* sub_fb_new, int xmin, int xmax, int ymin, int ymax, int stride,
             int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
             {
@@ -635,7 +1262,7 @@ namespace ILI9341_T4
                 const int nend = xmax + (DiffBuffBase::LX * yc);
                 for (int n = xmin + (DiffBuffBase::LX * yc); n <= nend; n++, m += mdelta)
                     {
-                    if (((fb_old[n]) ^ (sub_fb_new[m])) & compare_mask)
+                    if ((sub_fb_new == nullptr) || (((fb_old[n]) ^ (sub_fb_new[m])) & compare_mask)) // no new framebuffer means that every pixel changed
                         {
                         if (copy_new_over_old) 
                             { 
@@ -771,11 +1398,122 @@ namespace ILI9341_T4
             }
 
 
+        int DiffBuff::detectScroll(const uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, uint16_t compare_mask, int min_gain)
+            {
+            if ((fb_old == nullptr) || (fb_new == nullptr)) return 0;
+            const uint32_t mask32 = _pack32(LineSignatures::_normmask(compare_mask), LineSignatures::_normmask(compare_mask));
+            uint32_t sold[DiffBuffBase::LY], snew[DiffBuffBase::LY];
+            const bool aligned = _aligned32(fb_old);
+            for (int i = 0; i < DiffBuffBase::LY; i++) sold[i] = _lineSignature(fb_old + DiffBuffBase::LX * i, mask32, aligned);
+            switch (fb_new_orientation)
+                {
+                case PORTRAIT_240x320:
+                    {
+                    const bool al = _aligned32(fb_new);
+                    for (int i = 0; i < DiffBuffBase::LY; i++) snew[i] = _lineSignature(fb_new + DiffBuffBase::LX * i, mask32, al);
+                    break;
+                    }
+                case PORTRAIT_240x320_FLIPPED:
+                    {
+                    uint16_t line[DiffBuffBase::LX] __attribute__((aligned(4)));
+                    for (int i = 0; i < DiffBuffBase::LY; i++)
+                        {
+                        const uint16_t* p = fb_new + DiffBuffBase::LX * (DiffBuffBase::LY - i) - 1;
+                        for (int k = 0; k < DiffBuffBase::LX; k++) line[k] = *(p--);
+                        snew[i] = _lineSignature(line, mask32, true);
+                        }
+                    break;
+                    }
+                default:
+                    { // landscape: rotate by bands 
+                    uint16_t band[ROTATION_BAND * DiffBuffBase::LX] __attribute__((aligned(4)));
+                    for (int ib = 0; ib < DiffBuffBase::LY; ib += ROTATION_BAND)
+                        {
+                        _rotateBand(band, fb_new, fb_new_orientation, ib, ROTATION_BAND);
+                        for (int i = 0; i < ROTATION_BAND; i++) snew[ib + i] = _lineSignature(band + DiffBuffBase::LX * i, mask32, true);
+                        }
+                    break;
+                    }
+                }
+            // number of matching lines without shift
+            int base = 0;
+            for (int i = 0; i < DiffBuffBase::LY; i++) { if (snew[i] == sold[i]) base++; }
+            if (base + min_gain > DiffBuffBase::LY) return 0; // cannot gain enough. 
+            // find the best candidate using only one line out of 4, trying small shifts first. 
+            const int STEP = 4;
+            int best = 0, bestscore = 0;
+            for (int a = 1; a <= DiffBuffBase::LY / 2; a++)
+                {
+                for (int sgn = 0; sgn < 2; sgn++)
+                    {
+                    const int d = (sgn == 0) ? a : (DiffBuffBase::LY - a);
+                    if ((sgn == 1) && (d == a)) continue; 
+                    int score = 0;
+                    int k = d;
+                    for (int i = 0; i < DiffBuffBase::LY; i += STEP)
+                        {
+                        if (snew[i] == sold[k]) score++;
+                        k += STEP; if (k >= DiffBuffBase::LY) k -= DiffBuffBase::LY;
+                        }
+                    if (score > bestscore) { bestscore = score; best = d; }
+                    }
+                }
+            if (best == 0) return 0;
+            // check the candidate on all the lines. 
+            int score = 0;
+            for (int i = 0, k = best; i < DiffBuffBase::LY; i++)
+                {
+                if (snew[i] == sold[k]) score++;
+                if (++k >= DiffBuffBase::LY) k = 0;
+                }
+            return ((score - base >= min_gain) ? best : 0);
+            }
+
+
         void DiffBuff::statsReset()
             {
             _stat_overflow = 0;
             _stats_size.reset();
             _stats_time.reset();
+            _stats_arena.reset();
+            }
+
+
+        void DiffBuff::_arenaBegin()
+            {
+            if (_arena == nullptr) return;
+            // the partner diff may be in use: keep its bytes [pb, pb + used) and take the largest free part around it.
+            const int used = _partner->_arenaUsed();
+            const int front = (int)(_partner->_tab - _arena);
+            const int back = _arena_size - front - used;
+            const int maxsize = _arena_size - (_arena_size / 4); // keep at least a quarter of the arena for the partner.
+            if (front >= back)
+                {
+                _tab = _arena;
+                _sizebuf = ((front < maxsize) ? front : maxsize) - PADDING;
+                _arena_back = false;
+                }
+            else
+                {
+                _tab = _partner->_tab + used;
+                _sizebuf = ((back < maxsize) ? back : maxsize) - PADDING;
+                _arena_back = true;
+                }
+            }
+
+
+        void DiffBuff::_arenaEnd(bool streamed)
+            {
+            if (_arena == nullptr) return;
+            const int used = _arenaUsed();
+            if ((_arena_back) && (!streamed))
+                { // move the diff at the end of the arena: the free memory for the partner stays contiguous.
+                // (not possible for streamed diffs which may already be read.)
+                uint8_t* dst = _arena + _arena_size - used;
+                if (dst != _tab) memmove(dst, _tab, used);
+                _tab = dst;
+                }
+            _stats_arena.push(used + _partner->_arenaUsed());
             }
 
 
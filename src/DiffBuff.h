@@ -29,12 +29,17 @@
 
 #include <Arduino.h>
 #include <math.h>
+#include <limits.h>
 
 
 namespace ILI9341_T4
 {
 
 
+    class DirtyMap; // forward declaration (in DirtyMap.h)
+    class LineSignatures; // forward declaration
+
+
     /******************************************************************************************
     * Abstract base class describing the public interface of a "diff" object.
     *
@@ -53,6 +58,7 @@ namespace ILI9341_T4
     * - DiffBuff      : diff using user-supplied memory.
     * - DiffBuffStatic: diff using static memory allocation.
     * - DiffBuffDummy : diff without memory alloc holding only trivial diffs.
+    * - DiffBuffRect  : diff made of rectangles using user-supplied memory (in DiffBuffRect.h).
     * 
     *******************************************************************************************/
     class DiffBuffBase
@@ -74,6 +80,11 @@ namespace ILI9341_T4
         static const int LY = 320;                  // framebuffer height in orientation 0
         static const int MAX_WRITE_LINE = 120;      // max number of lines to be written in a single operation.
         static const int MIN_SCANLINE_SPACE = 8;    // min number of lines between the current write line and the current scanline
+        static const int NOT_READY = LY + 1;        // returned by readDiff() when the next instruction is not computed yet (streaming).
+        static const int HX = LX / 2;               // width of a half resolution framebuffer in orientation 0
+        static const int HY = LY / 2;               // height of a half resolution framebuffer in orientation 0
+
+        typedef void (*StreamCallback)(void* obj); // callback type for streamNextDiff()
 
         static_assert((LX & 3) == 0, "LX must be divisible by 4");
 
@@ -118,6 +129,19 @@ namespace ILI9341_T4
         virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) = 0;
 
 
+        /**
+        * Same as above but only the tiles marked in the dirty map are compared (all the other tiles are 
+        * assumed to be identical in both framebuffers). If dirtymap is nullptr, the whole framebuffers 
+        * are compared. 
+        * 
+        * If linesigs is not nullptr, it holds the signatures of the lines of fb_old and lines of fb_new  
+        * with the same signature are skipped without looking at fb_old (see LineSignatures below). 
+        * 
+        * The default implementation simply ignores the dirty map and discards the line signatures.
+        **/
+        virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask, const DirtyMap* dirtymap, LineSignatures* linesigs = nullptr);
+
+
         /**
         * Compute a diff between a (old) framebuffer and a region of a new framebuffer while merging the
         * result with a previous diff (if provided).
@@ -138,6 +162,23 @@ namespace ILI9341_T4
         * Copy the new framebuffer over the old one (and rotate it to put it in orientation 0 in fb_old). 
         **/
         static void copyfb(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation);
+
+
+        /**
+        * Copy only the tiles marked in the dirty map of the new framebuffer over the old one 
+        * (and rotate it to put it in orientation 0 in fb_old). Copy everything if dirtymap is nullptr.
+        **/
+        static void copyfb(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, const DirtyMap* dirtymap);
+
+
+        /**
+        * Copy only the pixels written by diff (the runs of its raw [write,skip] sequence, which 
+        * includes the gaps merged in the runs) of the new framebuffer over the old one (and rotate
+        * it to put it in orientation 0 in fb_old). After the diff is uploaded, fb_old still mirrors
+        * the screen even if some changed pixels were skipped (perceptual diffs). Copy everything 
+        * if diff is nullptr.
+        **/
+        static void copyfbDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, DiffBuffBase* diff);
             
 
         /**
@@ -151,6 +192,44 @@ namespace ILI9341_T4
         **/
         static void copyfb(uint16_t* fb_old, const uint16_t* fb_new, int xmin, int xmax, int ymin, int ymax, int src_stride, int fb_new_orientation);
 
+
+        /**
+        * Shift the lines of a framebuffer (in orientation 0) cyclically: line y receives the
+        * previous content of line (y + shift) mod LY. This mirrors the effect of changing the 
+        * hardware scroll offset of the screen by shift. 
+        **/
+        static void scrollfb(uint16_t* fb, int shift);
+
+
+        /**
+        * Write into dst the line y (LX pixels, in orientation 0) of the full resolution frame obtained
+        * by doubling each pixel of the half resolution framebuffer fb_half horizontally and vertically. 
+        * fb_half has size HX x HY (120x160) in portrait orientations and HY x HX (160x120) in landscape. 
+        **/
+        static void halfLine(uint16_t* dst, const uint16_t* fb_half, int fb_half_orientation, int y);
+
+
+        /**
+        * Copy a half resolution framebuffer over the old one, doubling its pixels (and rotating it 
+        * to put it in orientation 0 in fb_old). 
+        **/
+        static void copyfbHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation);
+
+
+        /**
+        * Write into dst the line y (LX pixels, in orientation 0) of the palettized framebuffer fb8
+        * (one byte per pixel, same layout as a RGB565 framebuffer in this orientation) expanded 
+        * with the 256 colors of palette. 
+        **/
+        static void paletteLine(uint16_t* dst, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int y);
+
+
+        /**
+        * Copy a palettized framebuffer over the old one, expanding its colors (and rotating it
+        * to put it in orientation 0 in fb_old). 
+        **/
+        static void copyfbPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation);
+
  
         /**
         * Call this method to reinitialize the diff prior to the first call
@@ -173,10 +252,126 @@ namespace ILI9341_T4
         *               will return when timing is right but len is set to 0
         * 
         * - returns a<0 : finished reading the diff. 
+        * 
+        * - returns NOT_READY : (only when streaming) the next instruction is not yet computed, 
+        *                       call the method again a bit later. 
         **/
         virtual int readDiff(int& x, int& y, int& len, int scanline) = 0;
 
 
+        /**
+        * Same as readDiff() but the instruction may describe a rectangle: the 'len' pixels must be 
+        * written row after row starting at (x,y) inside the window whose columns are [x, x + w - 1].
+        * 
+        * A rectangle is described by len > w. Otherwise (len <= w), the instruction is a plain run of 
+        * 'len' contiguous pixels which wraps around to column 0 at the end of each line. 
+        * 
+        * The default implementation calls readDiff() and sets w = len which describes exactly the 
+        * instructions of readDiff(). 
+        **/
+        virtual int readDiffRect(int& x, int& y, int& w, int& len, int scanline)
+            {
+            const int r = readDiff(x, y, len, scanline);
+            w = len;
+            return r;
+            }
+
+
+        /**
+        * Request the next call to computeDiff(fb_old, fb_new, ...) to be 'streamed': the diff is made 
+        * available for reading every 'band_lines' lines while it is still being computed and cb(obj) 
+        * is called (from inside computeDiff()) as soon as the first instruction can be read. Until the 
+        * diff is complete, readDiff() returns NOT_READY when it catches up with the part computed so far. 
+        * 
+        * Used with copy_new_over_old = true, this permits to start uploading the pixels from fb_old while 
+        * the rest of the diff is still being computed (fb_old is flushed from the cache band by band). 
+        * If the callback has not been called when computeDiff() returns, the diff is complete and can be 
+        * used as usual. 
+        * 
+        * Return false if streaming is not supported (default implementation). 
+        **/
+        virtual bool streamNextDiff(int band_lines, StreamCallback cb, void* obj) { return false; }
+
+
+        /**
+        * Request that the next computeDiff() (framebuffer version, the call is one-shot) is a 
+        * perceptual diff: a pixel is considered unchanged when the difference on each color 
+        * channel is at most thr_red, thr_green, thr_blue (on 5, 6 and 5 bits). The compare mask 
+        * is not used. The lines [exact_y, exact_y + exact_lines) (modulo LY, in orientation 0) are
+        * compared exactly so that the residual errors are cleared when the band sweeps over them.
+        * 
+        * The skipped pixels are NOT copied over fb_old (when copy_new_over_old is set) so that 
+        * fb_old still mirrors the screen: the error on screen is then always bounded by the 
+        * thresholds. When the diff is computed without copy, use copyfbDiff() afterwards.  
+        * 
+        * Return false if perceptual diffs are not supported (default implementation). In this 
+        * case the next diff is exact (up to the compare mask) as usual. 
+        **/
+        virtual bool perceptualNextDiff(int thr_red, int thr_green, int thr_blue, int exact_y, int exact_lines) { return false; }
+
+
+        /**
+        * Compute the diff between fb_old and the frame obtained by doubling the pixels of the half 
+        * resolution framebuffer fb_half (see halfLine()). 
+        * 
+        * fb_old must already contain a doubled frame: only one pixel out of four is compared so the
+        * computation is about 4 times faster than computeDiff(). 
+        *
+        * Return false if half resolution diffs are not supported (default implementation). In this 
+        * case, nothing is done (and fb_old is not modified). 
+        **/
+        virtual bool computeDiffHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) { return false; }
+
+
+        /**
+        * Compute the diff between fb_old and the palettized framebuffer fb8 expanded with the 
+        * colors of palette (see paletteLine()). Only one byte per pixel of the new frame is read 
+        * and the colors are compared after expansion, so changing the palette simply redraws the
+        * pixels whose color changed. 
+        *
+        * Return false if palettized diffs are not supported (default implementation). In this 
+        * case, nothing is done (and fb_old is not modified). 
+        **/
+        virtual bool computeDiffPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) { return false; }
+
+
+        /**
+        * Compute the diff obtained by adding the whole rectangle [xmin,xmax]x[ymin,ymax] (given in 
+        * orientation 0, as in the internal framebuffers) to diff_old (or to an empty diff if diff_old 
+        * is nullptr). No framebuffer is read: every pixel of the rectangle is written by the new diff. 
+        * This is used when the caller already knows which pixels changed (drawing primitives) and 
+        * costs time proportional to the size of diff_old plus the area of the rectangle. 
+        *
+        * Return false if the operation is not supported (default implementation). 
+        **/
+        virtual bool computeDiffAddRect(DiffBuffBase* diff_old, int xmin, int xmax, int ymin, int ymax, int gap) { return false; }
+
+
+        /**
+        * Build a diff incrementally from the runs of pixels known to have changed, without any 
+        * framebuffer: call beginDiffRuns(), then addDiffRun(pos, len) for each run of len pixels 
+        * starting at offset pos in the framebuffer (orientation 0, pos = x + LX*y) and finally 
+        * endDiffRuns(). The runs must be given in increasing order and must not overlap. Runs 
+        * separated by less than gap pixels are merged. This is used when the changes come from 
+        * a delta stream and costs time proportional to the number of runs. 
+        *
+        * beginDiffRuns() returns false if the operation is not supported (default implementation)
+        * in which case addDiffRun() and endDiffRuns() must not be called. 
+        **/
+        virtual bool beginDiffRuns(int gap) { return false; }
+        virtual void addDiffRun(int pos, int len) {}
+        virtual void endDiffRuns() {}
+
+
+        /**
+        * Return the fraction of the buffer used by the last diff computed. A value >= 1
+        * means that the buffer overflowed (and the end of the diff is a plain redraw). 
+        * 
+        * Default implementation returns 0 (the buffer never overflows).
+        **/
+        virtual float fillRatio() const { return 0.0f; }
+
+
         /**
         * Call this method to reinitialize the diff prior to the first call
         * to readRaw().
@@ -201,6 +396,78 @@ namespace ILI9341_T4
         static void rotationBox(int orientation, int xmin, int xmax, int ymin, int ymax, int & x1, int & x2, int & y1, int & y2);
 
 
+    protected:
+
+        /**
+        * Compute the position m in a framebuffer with orientation 'orientation' of the pixel (x,y) given 
+        * w.r.t. orientation 0 and the offset mdelta between the positions of pixels (x,y) and (x+1,y).
+        **/
+        static void _orientedIndex(int orientation, int x, int y, int& m, int& mdelta) __attribute__((always_inline))
+            {
+            switch (orientation)
+                {
+            case LANDSCAPE_320x240:
+                m = y + LY * (LX - 1 - x);
+                mdelta = -LY;
+                return;
+            case PORTRAIT_240x320_FLIPPED:
+                m = (LX - 1 - x) + LX * (LY - 1 - y);
+                mdelta = -1;
+                return;
+            case LANDSCAPE_320x240_FLIPPED:
+                m = (LY - 1 - y) + LY * x;
+                mdelta = LY;
+                return;
+            default: // case PORTRAIT_240x320:
+                m = x + LX * y;
+                mdelta = 1;
+                return;
+                }
+            }
+
+
+        /** same as _orientedIndex() for a half resolution framebuffer (of size HX x HY in orientation 0) */
+        static void _orientedIndexHalf(int orientation, int x, int y, int& m, int& mdelta) __attribute__((always_inline))
+            {
+            switch (orientation)
+                {
+            case LANDSCAPE_320x240:
+                m = y + HY * (HX - 1 - x);
+                mdelta = -HY;
+                return;
+            case PORTRAIT_240x320_FLIPPED:
+                m = (HX - 1 - x) + HX * (HY - 1 - y);
+                mdelta = -1;
+                return;
+            case LANDSCAPE_320x240_FLIPPED:
+                m = (HY - 1 - y) + HY * x;
+                mdelta = HY;
+                return;
+            default: // case PORTRAIT_240x320:
+                m = x + HX * y;
+                mdelta = 1;
+                return;
+                }
+            }
+
+
+        static const int ROTATION_TILE = 16;        // size of the blocks used when transposing framebuffers (landscape orientations)
+
+
+        /**
+        * Write into band (a LX x nblines buffer) the lines [y0, y0 + nblines[ of the framebuffer fb_src 
+        * (in orientation LANDSCAPE_320x240 or LANDSCAPE_320x240_FLIPPED) rotated to portrait orientation. 
+        * The transposition is done by blocks so that the source is read along its lines (cache friendly). 
+        **/
+        static void _rotateBand(uint16_t* band, const uint16_t* fb_src, int orientation, int y0, int nblines)
+            {
+            if (orientation == LANDSCAPE_320x240)
+                _copy_rotate_90(band, fb_src + y0, 0, LX - 1, 0, nblines - 1, LX, nblines, LY);
+            else
+                _copy_rotate_270(band, fb_src + (LY - y0 - nblines), 0, LX - 1, 0, nblines - 1, LX, nblines, LY);
+            }
+
+
     private:
         
         // copy and rotate a framebuffer
@@ -213,7 +480,7 @@ namespace ILI9341_T4
            
         static void _copy_rotate_270(uint16_t* fb_dest, const uint16_t* fb_src);
            
-        // copy and rotate a sub-framebuffer into a framebuffer.
+        // copy and rotate a sub-framebuffer into a framebuffer (rotations 90 and 270 are done by blocks of ROTATION_TILE x ROTATION_TILE).
         
         static void _copy_rotate_0(uint16_t* fb_dest, const uint16_t* fb_src, int x1, int x2, int y1, int y2, int w, int h, int src_stride);
 
@@ -233,6 +500,81 @@ namespace ILI9341_T4
 
 
 
+    /******************************************************************************************
+    * Cache holding a 32-bit signature for each line of a framebuffer (in orientation 0). 
+    *
+    * When given to DiffBuff::computeDiff(), the signature of each line of the new framebuffer
+    * is computed and compared to the signature of the same line in the old framebuffer: if 
+    * they match, the line is skipped without reading the old framebuffer. The new signatures 
+    * are recorded during the pass at almost no cost.
+    * 
+    * The object holds two sets of signatures: the current one (for the lines of fb_old) and 
+    * the next one (for the lines of the last fb_new). 
+    * - when the diff is computed with copy_new_over_old = true, the next signatures become 
+    *   current automatically. 
+    * - otherwise, commit() must be called once fb_new has been copied over fb_old.
+    * - invalidate() must be called whenever fb_old is modified by other means. 
+    * 
+    * Remark: lines with identical signatures but different content (hash collisions) are 
+    * not redrawn. This is extremely unlikely but it can happen.
+    *******************************************************************************************/
+    class LineSignatures
+    {
+
+    public:
+
+        /** ctor. The signatures are initially invalid */
+        LineSignatures() : _cur(0)
+            {
+            invalidate();
+            }
+
+
+        /** Mark all signatures as invalid (call when the old framebuffer is modified directly). */
+        void invalidate()
+            {
+            _valid[0] = false;
+            _valid[1] = false;
+            }
+
+
+        /** The next signatures (computed by the last diff) become the current ones. */
+        void commit()
+            {
+            _cur ^= 1;
+            _valid[_cur ^ 1] = false;
+            }
+
+
+        /** Discard the next signatures. */
+        void discard()
+            {
+            _valid[_cur ^ 1] = false;
+            }
+
+
+        /** Return true if the signatures of fb_old are available for a given compare mask. */
+        bool valid(uint16_t compare_mask) const { return (_valid[_cur] && (_mask[_cur] == _normmask(compare_mask))); }
+
+
+    private:
+
+        friend class DiffBuff;
+
+        static uint16_t _normmask(uint16_t compare_mask) { return (compare_mask == 0) ? 0xFFFF : compare_mask; }
+
+        int _cur;                                   // index of the current signatures
+        bool _valid[2];                             // true if the signatures are valid
+        uint16_t _mask[2];                          // compare mask used to compute the signatures
+        uint32_t _sig[2][DiffBuffBase::LY];         // the signatures.
+    };
+
+
+
+
+
+
+
     /******************************************************************************************
     * Class used to compute the "diff" between 2 framebuffers.
     *
@@ -242,6 +584,11 @@ namespace ILI9341_T4
     * PERFORMANCE: On teensy 4.1, for framebuffers of size 320x240. It takes around 1ms to
     * compute a diff. This means that computing the diff consumes around 5-10% of a frame period 
     * at 60FPS (but still leaves around 15ms to generate each frame).
+    *
+    * Pixels are compared 4 at a time (packed in 32-bit words) and only examined one by one 
+    * inside groups that contain a change. This requires the framebuffers to be 4-byte aligned
+    * (otherwise, the slower pixel by pixel comparison is used). The time spent computing the 
+    * diffs can be monitored with statsTime(). 
     *******************************************************************************************/
     class DiffBuff : public DiffBuffBase
     {
@@ -252,7 +599,11 @@ namespace ILI9341_T4
         * Constructor. Set the buffer (and its size).
         * sizebuf should not be too small (at least MIN_BUFFER_SIZE but say 1K to be useful).
         **/
-        DiffBuff(uint8_t* buffer, size_t sizebuf) : DiffBuffBase(), _tab(buffer), _sizebuf(sizebuf - PADDING), _posw(0), _posr(0), _posraw(0)
+        DiffBuff(uint8_t* buffer, size_t sizebuf) : DiffBuffBase(), _tab(buffer), _sizebuf(sizebuf - PADDING), _posw(0), _posr(0), _posraw(0),
+                                                    _posw_ready(INT_MAX), _stream_req(0), _stream_band(0), _stream_next(INT_MAX), _stream_cb(nullptr), _stream_obj(nullptr),
+                                                    _arena(nullptr), _arena_size(0), _arena_back(false), _partner(nullptr),
+                                                    _run_prv(0), _run_end(0), _run_gap(1), _run_full(true),
+                                                    _lossy_req(0), _lossy_thr(0), _lossy_y(0), _lossy_lines(0)
             {
             statsReset();
             _write_encoded(TAG_END);
@@ -265,6 +616,9 @@ namespace ILI9341_T4
         virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override;
 
 
+        virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask, const DirtyMap* dirtymap, LineSignatures* linesigs = nullptr) override;
+
+
         virtual void computeDiff(uint16_t* fb_old, DiffBuffBase* diff_old, const uint16_t* sub_fb_new, int xmin, int xmax, int ymin, int ymax, int stride,
                                  int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override;
 
@@ -280,6 +634,46 @@ namespace ILI9341_T4
         virtual int readDiff(int& x, int& y, int& len, int scanline) override;
 
 
+        virtual bool computeDiffHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override;
+
+
+        virtual bool computeDiffPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override;
+
+
+        virtual bool computeDiffAddRect(DiffBuffBase* diff_old, int xmin, int xmax, int ymin, int ymax, int gap) override;
+
+
+        virtual bool beginDiffRuns(int gap) override;
+
+
+        virtual void addDiffRun(int pos, int len) override;
+
+
+        virtual void endDiffRuns() override;
+
+
+        virtual bool perceptualNextDiff(int thr_red, int thr_green, int thr_blue, int exact_y, int exact_lines) override
+            {
+            thr_red = (thr_red < 0) ? 0 : ((thr_red > 31) ? 31 : thr_red);
+            thr_green = (thr_green < 0) ? 0 : ((thr_green > 63) ? 63 : thr_green);
+            thr_blue = (thr_blue < 0) ? 0 : ((thr_blue > 31) ? 31 : thr_blue);
+            _lossy_req = (thr_red | thr_green | thr_blue) ? (LOSSY_ON | (thr_red << 16) | (thr_green << 8) | thr_blue) : 0;
+            _lossy_y = ((exact_y % DiffBuffBase::LY) + DiffBuffBase::LY) % DiffBuffBase::LY;
+            _lossy_lines = exact_lines;
+            return true;
+            }
+
+
+        virtual bool streamNextDiff(int band_lines, StreamCallback cb, void* obj) override
+            {
+            if ((band_lines <= 0) || (cb == nullptr)) return false;
+            _stream_req = ((band_lines < DiffBuffBase::LY) ? band_lines : DiffBuffBase::LY) * DiffBuffBase::LX;
+            _stream_cb = cb;
+            _stream_obj = obj;
+            return true;
+            }
+
+
         virtual void initRaw()
             {
             _posraw = 0;
@@ -313,6 +707,9 @@ namespace ILI9341_T4
         int size() const { return ((_posw >= _sizebuf) ? (_sizebuf + PADDING) : _posw); }
 
 
+        virtual float fillRatio() const override { return ((float)size()) / _sizebuf; }
+
+
         /************************************************************************
         * STATISTICS.
         *
@@ -346,16 +743,25 @@ namespace ILI9341_T4
 
         /**
         * Return a StatsVar object containing statisitcs about the time
-        * it took to compute the diffs.
+        * it took to compute the diffs. Diffs built with beginDiffRuns()/endDiffRuns()
+        * are not included. 
         **/
-        ILI9341_T4::StatsVar statsTime() const { return _stats_time; }
+        const ILI9341_T4::StatsVar & statsTime() const { return _stats_time; }
 
 
         /**
         * Return a StatVar  object containing statisitcs about the size
         * of the computed buffers.
         **/
-        ILI9341_T4::StatsVar statsSize() const { return _stats_size; }
+        const ILI9341_T4::StatsVar & statsSize() const { return _stats_size; }
+
+
+        /**
+        * Return a StatVar object containing statistics about the number of bytes used 
+        * by this diff and its partner together, when the buffer is shared in a DiffBuffArena
+        * (no value is recorded otherwise). 
+        **/
+        const ILI9341_T4::StatsVar & statsArena() const { return _stats_arena; }
 
 
         /**
@@ -364,16 +770,30 @@ namespace ILI9341_T4
         void printStats(Stream* outputStream = &Serial) const;
 
 
+        /**
+        * Look for a vertical shift (in orientation 0) between fb_old and fb_new by comparing the 
+        * signatures of their lines. Return the shift (between 1 and LY-1) such that line y of fb_new 
+        * matches line (y + shift) mod LY of fb_old for at least min_gain more lines than without 
+        * shifting, or 0 if there is no such shift. When several shifts qualify, the best one is 
+        * returned (the smallest in case of ties). 
+        * 
+        * The new framebuffer can be in any orientation. Only the bits set in compare_mask are used. 
+        **/
+        static int detectScroll(const uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, uint16_t compare_mask, int min_gain);
+
+
 
     private:
 
         static const int        MIN_BUFFER_SIZE = 16;             // minimum buffer size
         static const int        PADDING = 8;                      // reserved at end of buffer (in case of overflow)
+        static const int        ROTATION_BAND = 16;               // number of lines rotated at once when computing a diff in landscape orientation
         static const uint32_t   TAG_END = (0x400000 - 1);         // tag at end of diff
         static const uint32_t   TAG_WRITE_ALL = (0x400000 - 2);   // tag to write everything remaining
+        static const uint32_t   LOSSY_ON = (1u << 24);            // flag set in the thresholds of perceptual diffs
 
-        uint8_t* const _tab;                // the buffer itself
-        const int _sizebuf;                 // and its size (with PADDING already substracted). 
+        uint8_t* _tab;                      // the buffer itself (moves inside the arena if the memory is shared)
+        int _sizebuf;                       // and its size (with PADDING already substracted). 
 
         int _posw;                          // current position in the array (for writing)
         int _posr;                          // current position in the array (for reading)
@@ -383,9 +803,84 @@ namespace ILI9341_T4
         bool _r_cont;                       // true is (_r_x, _r_y_, _r_len) contain a valid instruction (for reading). 
         int _off;                           // current offset
 
+        volatile int _posw_ready;           // instructions before this position can be read (INT_MAX when not streaming). 
+        int _stream_req;                    // number of pixels per band requested for the next diff (0 = no streaming)
+        int _stream_band;                   // number of pixels per band for the diff being streamed
+        int _stream_next;                   // offset at which the next band is published (INT_MAX when not streaming)
+        int _stream_flushed;                // pixels of fb_old before this offset are flushed from the cache
+        bool _stream_flush;                 // true if fb_old must be flushed when publishing
+        bool _stream_started;               // true once the callback was called
+        StreamCallback _stream_cb;          // callback when the first instruction is available
+        void* _stream_obj;                  // and its parameter
+
+        uint8_t* _arena;                    // memory shared with the partner diff (nullptr if the buffer is not shared)
+        int _arena_size;                    // size of the shared memory
+        bool _arena_back;                   // true if the current diff is placed after the partner one
+        DiffBuff* _partner;                 // the other diff using the arena
+
+        int _run_prv;                       // start of the pending write run (when building a diff from runs)
+        int _run_end;                       // end of the pending write run
+        int _run_gap;                       // gap used to merge the runs
+        bool _run_full;                     // true when no more run can be added (buffer overflow or diff not started)
+
+        uint32_t _lossy_req;                // thresholds requested for the next perceptual diff (0 = exact diff)
+        uint32_t _lossy_thr;                // thresholds of the diff being computed: LOSSY_ON | (red << 16) | (green << 8) | blue (0 = exact)
+        int _lossy_y;                       // first line compared exactly
+        int _lossy_lines;                   // number of lines compared exactly
+
+
+        /** thresholds used for line y (orientation 0) of a perceptual diff (0 for an exact comparison) */
+        uint32_t _lossyLine(int y) const __attribute__((always_inline))
+            {
+            if (_lossy_thr == 0) return 0;
+            int d = y - _lossy_y;
+            if (d < 0) d += DiffBuffBase::LY;
+            return (d < _lossy_lines) ? 0 : _lossy_thr;
+            }
+
+
+        /** true if pixels a and b differ: in the bits of compare_mask and, for perceptual diffs (lossy != 0), by more than a threshold on some color channel */
+        static bool _pixelDiffer(uint16_t a, uint16_t b, uint16_t compare_mask, uint32_t lossy) __attribute__((always_inline))
+            {
+            if (((a ^ b) & compare_mask) == 0) return false;
+            if (lossy == 0) return true;
+            const int dr = (int)(a >> 11) - (int)(b >> 11);
+            const int dg = (int)((a >> 5) & 63) - (int)((b >> 5) & 63);
+            const int db = (int)(a & 31) - (int)(b & 31);
+            return (((dr < 0) ? -dr : dr) > (int)((lossy >> 16) & 255)) || (((dg < 0) ? -dg : dg) > (int)((lossy >> 8) & 255)) || (((db < 0) ? -db : db) > (int)(lossy & 255));
+            }
+
         volatile uint32_t _stat_overflow;   // number of times a diff buffer overflowed
         ILI9341_T4::StatsVar _stats_size;   // statistics on buffer size
         ILI9341_T4::StatsVar _stats_time;   // statistics on compute times. 
+        ILI9341_T4::StatsVar _stats_arena;  // statistics on the number of bytes used in the arena. 
+
+        template<int SIZEBUF> friend class DiffBuffArena;
+
+
+        /** Share the memory [arena, arena + arena_size) with partner (used by DiffBuffArena). */
+        void _setArena(uint8_t* arena, int arena_size, DiffBuff* partner)
+            {
+            _arena = arena;
+            _arena_size = arena_size;
+            _partner = partner;
+            _tab = arena;
+            _sizebuf = arena_size - PADDING;
+            _posw = 0;
+            _write_encoded(TAG_END);
+            }
+
+
+        /** number of bytes of the arena reserved by this diff (an empty diff still holds its end tag). */
+        int _arenaUsed() const { return ((size() > 0) ? size() : 4); }
+
+
+        /** called before computing a diff: take the free part of the arena which is not used by the partner. */
+        void _arenaBegin();
+
+
+        /** called after computing a diff: move it at the end of the arena when possible (so that the free part remains contiguous) */
+        void _arenaEnd(bool streamed);
 
 
         /** Read a value */
@@ -453,11 +948,71 @@ namespace ILI9341_T4
             }
 
 
+        /** publish the instructions computed so far when streaming (pos = end of the pixels written in the diff, n = current offset in fb_old) */
+        void _streamPublish(const uint16_t* fb_old, int pos, int n);
+
+
+        /** 32 bit word that may alias the uint16_t framebuffers (for comparing 2 pixels at once) */
+        typedef uint32_t __attribute__((__may_alias__)) uint32_alias_t;
+
+
+        /** Load 2 consecutive pixels (p must be 4-byte aligned) */
+        static uint32_t _load32(const uint16_t* p) __attribute__((always_inline)) { return *((const uint32_alias_t*)p); }
+
+
+        /** Pack 2 pixels in a word with the same layout as _load32() */
+        static uint32_t _pack32(uint16_t lo, uint16_t hi) __attribute__((always_inline)) { return ((uint32_t)lo) | (((uint32_t)hi) << 16); }
+
+
+        /** Exchange the 2 pixels of a word (compiles to a single ror) */
+        static uint32_t _swap16(uint32_t w) __attribute__((always_inline)) { return (w >> 16) | (w << 16); }
+
+
+        /** Return true if the pointer is 4-byte aligned */
+        static bool _aligned32(const void* p) __attribute__((always_inline)) { return ((((uintptr_t)p) & 3) == 0); }
+
+
+        /** Return true if the pointer is located in EXTMEM (external PSRAM) */
+        static bool _extmem(const void* p) __attribute__((always_inline)) { return ((((uintptr_t)p) >= 0x70000000u) && (((uintptr_t)p) < 0x80000000u)); }
+
+
+        /** Hint the data cache to load [p, p + nbytes) (one hint per 32 bytes cache line) */
+        static void _prefetch(const void* p, int nbytes) __attribute__((always_inline))
+            {
+            for (int k = 0; k < nbytes; k += 32) __builtin_prefetch(((const uint8_t*)p) + k);
+            }
+
+
         /** templated version of computeDiff */
         template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
         void _computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, uint16_t compare_mask);
 
 
+        /** called when a dirty map is used (any orientation) */
+        template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
+        void _computeDiffDirty(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, uint16_t compare_mask, const DirtyMap* dirtymap);
+
+
+        /** signature of a line of LX pixels (only the bits set in mask32 are used) */
+        static uint32_t _lineSignature(const uint16_t* line, uint32_t mask32, bool aligned) __attribute__((always_inline))
+            {
+            uint32_t h0 = 0x811C9DC5, h1 = 0x9E3779B9; // two independent lanes to hide multiply latency.
+            for (int k = 0; k < DiffBuffBase::LX; k += 4)
+                {
+                const uint32_t w0 = (aligned ? _load32(line + k) : _pack32(line[k], line[k + 1])) & mask32;
+                const uint32_t w1 = (aligned ? _load32(line + k + 2) : _pack32(line[k + 2], line[k + 3])) & mask32;
+                h0 = (h0 ^ w0) * 0x01000193;
+                h1 = (h1 ^ w1) * 0x01000193;
+                }
+            return h0 ^ ((h1 << 15) | (h1 >> 17));
+            }
+
+
+        /** called when the src framebuffer is in orientation 0 and line signatures are used */
+        template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
+        void _computeDiffSig0(uint16_t* fb_old, const uint16_t* fb_new, int gap, uint16_t compare_mask, LineSignatures* linesigs);
+
+
         /** called when the src framebuffer is in orientation 0 */
         template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
         void _computeDiff0(uint16_t* fb_old, const uint16_t* fb_new, int gap, uint16_t compare_mask);
@@ -482,6 +1037,14 @@ namespace ILI9341_T4
         void _computeDiff(uint16_t* fb_old, DiffBuffBase* diff_old, const uint16_t* sub_fb_new, int xmin, int xmax, int ymin, int ymax, int stride,
                           int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask);
 
+
+        /** called by computeDiffHalf() */
+        void _computeDiffHalf(uint16_t* fb_old, const uint16_t* fb_half, int fb_half_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask);
+
+
+        /** called by computeDiffPalette() */
+        void _computeDiffPalette(uint16_t* fb_old, const uint8_t* fb8, const uint16_t* palette, int fb8_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask);
+
     };
 
 
@@ -521,6 +1084,93 @@ namespace ILI9341_T4
 
 
 
+    /******************************************************************************************
+    * Pair of diffs sharing a single memory arena of SIZEBUF bytes. 
+    * 
+    * Each diff takes, when it is computed, the part of the arena that is not used by the other
+    * one (which may still be uploading). A frame with few changes uses only a few hundred bytes
+    * so the next frame can use almost the whole arena: with the same memory as two 
+    * DiffBuffStatic<SIZEBUF/2>, the diffs overflow much less often. A diff may use at most 3/4 
+    * of the arena so that the other one is never starved. 
+    *
+    * Usage: tft.setDiffBuffers(arena.diff1(), arena.diff2()); 
+    *******************************************************************************************/
+    template<int SIZEBUF>
+    class DiffBuffArena
+    {
+
+        static_assert(SIZEBUF >= 256, "template parameter SIZEBUF too small !");
+
+    public:
+
+        /**
+        * Constructor. 
+        **/
+        DiffBuffArena() : _diff1(_statictab, SIZEBUF), _diff2(_statictab, SIZEBUF)
+            {
+            _diff1._setArena(_statictab, SIZEBUF, &_diff2);
+            _diff2._setArena(_statictab, SIZEBUF, &_diff1);
+            }
+
+
+        /** The first diff object */
+        DiffBuff* diff1() { return &_diff1; }
+
+
+        /** The second diff object */
+        DiffBuff* diff2() { return &_diff2; }
+
+
+        /** Reset the statistics of both diffs */
+        void statsReset()
+            {
+            _diff1.statsReset();
+            _diff2.statsReset();
+            }
+
+
+        /** Number of diffs computed (since the last call to statsReset()) */
+        uint32_t statsNbComputed() const { return _diff1.statsNbComputed() + _diff2.statsNbComputed(); }
+
+
+        /** Number of diffs that overflowed */
+        uint32_t statsNbOverflow() const { return _diff1.statsNbOverflow() + _diff2.statsNbOverflow(); }
+
+
+        /** Maximum size of a single diff */
+        int statsMaxDiffSize() const { const int a = _diff1.statsSize().max(), b = _diff2.statsSize().max(); return ((a > b) ? a : b); }
+
+
+        /** Maximum number of bytes used by both diffs together (i.e. the arena size actually needed, when there is no overflow) */
+        int statsMaxArenaUse() const { const int a = _diff1.statsArena().max(), b = _diff2.statsArena().max(); return ((a > b) ? a : b); }
+
+
+        /**
+        * Print the statistics into a Stream object.
+        **/
+        void printStats(Stream* outputStream = &Serial) const
+            {
+            const uint32_t nb = statsNbComputed();
+            outputStream->printf("----------------- DiffBuffArena Stats ----------------\n");
+            outputStream->printf("- arena size         : %u\n", SIZEBUF);
+            outputStream->printf("- overflow ratio     : %.1f%%  (%u out of %u computed)\n", ((nb > 0) ? (100.0f * statsNbOverflow()) / nb : 0.0f), statsNbOverflow(), nb);
+            outputStream->printf("- max. diff size     : %u\n", statsMaxDiffSize());
+            outputStream->printf("- max. arena use     : %u (both diffs)\n\n", statsMaxArenaUse());
+            }
+
+
+    private:
+
+        uint8_t _statictab[SIZEBUF];
+        DiffBuff _diff1;
+        DiffBuff _diff2;
+
+    };
+
+
+
+
+
     /******************************************************************************************
     * Class used to compute a "dummy" diff between 2 framebuffers.
     *
@@ -541,6 +1191,9 @@ namespace ILI9341_T4
             }
 
 
+        using DiffBuffBase::computeDiff;
+
+
         /** dummy diff, but copy if needed*/
         virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override
             {
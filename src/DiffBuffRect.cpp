@@ -0,0 +1,498 @@
+#include "DiffBuffRect.h"
+#include "DirtyMap.h"
+
+
+
+namespace ILI9341_T4
+{
+
+
+        DiffBuffRect::DiffBuffRect(uint8_t* buffer, size_t sizebuf) : DiffBuffBase(), _rects(_align(buffer)), _maxrects(_capacity(buffer, sizebuf))
+            {
+            statsReset();
+            _begin();
+            }
+
+
+        void DiffBuffRect::_begin()
+            {
+            _nb = 0;
+            _overflow = false;
+            _nbopen = 0;
+            initRead();
+            initRaw();
+            }
+
+
+        bool DiffBuffRect::_emit(int x1, int x2, int y0, int y1)
+            {
+            if (_nb >= _maxrects - 1) return false; // last slot is reserved for the overflow rectangle.
+            _rects[_nb++] = _pack(x1, y0, x2 - x1 + 1, y1 - y0 + 1);
+            return true;
+            }
+
+
+        bool DiffBuffRect::_addRun(int a, int b, int y, int gap)
+            {
+            // find the rectangle for which merging adds the fewest unchanged pixels
+            int best = -1;
+            int bextra = gap; // merging is worth it when it costs less than a new transaction (which is roughly worth 'gap' pixels).
+            for (int i = 0; i < _nbopen; i++)
+                {
+                const OpenRect& o = _open[i];
+                const int u1 = (a < o.x1) ? a : o.x1;
+                const int u2 = (b > o.x2) ? b : o.x2;
+                const int rows = y - o.y0; // lines of o before the current one
+                const int extra = (u2 - u1 + 1) * (rows + 1) - (o.x2 - o.x1 + 1) * (rows + ((o.last == y) ? 1 : 0)) - (b - a + 1);
+                if (extra < bextra) { bextra = extra; best = i; }
+                }
+            if (best >= 0)
+                {
+                OpenRect& o = _open[best];
+                if (a < o.x1) o.x1 = a;
+                if (b > o.x2) o.x2 = b;
+                o.last = y;
+                return true;
+                }
+            if (_nbopen < MAX_OPEN)
+                {
+                OpenRect& o = _open[_nbopen++];
+                o.x1 = a; o.x2 = b; o.y0 = y; o.last = y;
+                return true;
+                }
+            return _emit(a, b, y, y); // too many rectangles being built: single line rectangle.
+            }
+
+
+        bool DiffBuffRect::_addLine(const uint32_t* bits, int y, int gap)
+            {
+            int start = -1, last = -1;
+            for (int k = 0; k < LINE_WORDS; k++)
+                {
+                uint32_t v = bits[k];
+                while (v)
+                    { // extract the runs of set bits.
+                    const int s = __builtin_ctz(v);
+                    const uint32_t t = ~(v >> s);
+                    const int l = (t == 0) ? (32 - s) : __builtin_ctz(t);
+                    v &= ~((l == 32) ? 0xFFFFFFFF : (((1u << l) - 1) << s));
+                    const int x1 = 32 * k + s;
+                    if (start < 0) start = x1;
+                    else if (x1 - last - 1 >= gap)
+                        {
+                        if (!_addRun(start, last, y, gap)) return false;
+                        start = x1;
+                        }
+                    last = x1 + l - 1;
+                    }
+                }
+            if ((start >= 0) && (!_addRun(start, last, y, gap))) return false;
+
+            // store the rectangles that were not extended on this line
+            for (int i = 0; i < _nbopen; i++)
+                {
+                const OpenRect& o = _open[i];
+                if ((o.last != y) && (!_emit(o.x1, o.x2, o.y0, o.last))) return false;
+                }
+            int j = 0;
+            for (int i = 0; i < _nbopen; i++)
+                {
+                if (_open[i].last == y) _open[j++] = _open[i];
+                }
+            _nbopen = j;
+            return true;
+            }
+
+
+        void DiffBuffRect::_fallback(int y)
+            {
+            int y0 = y;
+            for (int i = 0; i < _nbopen; i++) { if (_open[i].y0 < y0) y0 = _open[i].y0; }
+            _nbopen = 0;
+            if (y0 < DiffBuffBase::LY) _rects[_nb++] = _pack(0, y0, DiffBuffBase::LX, DiffBuffBase::LY - y0);
+            _overflow = true;
+            }
+
+
+        void DiffBuffRect::_end(int y)
+            {
+            if (!_overflow)
+                {
+                for (int i = 0; i < _nbopen; i++)
+                    {
+                    const OpenRect& o = _open[i];
+                    if (!_emit(o.x1, o.x2, o.y0, o.last)) { _fallback(y); break; }
+                    }
+                }
+            _nbopen = 0;
+            _sort(_rects, _nb); // rectangles were stored when completed: put them back in order of their first line.
+            }
+
+
+        void DiffBuffRect::_sort(uint64_t* tab, int n)
+            { // shell sort (the list is already almost sorted).
+            for (int h = n / 2; h > 0; h /= 2)
+                {
+                for (int i = h; i < n; i++)
+                    {
+                    const uint64_t v = tab[i];
+                    int j = i;
+                    while ((j >= h) && (tab[j - h] > v)) { tab[j] = tab[j - h]; j -= h; }
+                    tab[j] = v;
+                    }
+                }
+            }
+
+
+        void DiffBuffRect::_setBits(uint32_t* bits, int a, int b)
+            {
+            while (a <= b)
+                {
+                const int k = a >> 5;
+                const int s = a & 31;
+                const int e = ((b >> 5) == k) ? (b & 31) : 31;
+                bits[k] |= ((e - s == 31) ? 0xFFFFFFFF : (((1u << (e - s + 1)) - 1) << s));
+                a += e - s + 1;
+                }
+            }
+
+
+        int DiffBuffRect::_findBit(const uint32_t* bits, int x0, bool val)
+            {
+            for (int k = (x0 >> 5); k < LINE_WORDS; k++)
+                {
+                uint32_t v = (val ? bits[k] : ~bits[k]);
+                if (k == (x0 >> 5)) v &= (0xFFFFFFFF << (x0 & 31));
+                if (v)
+                    {
+                    const int x = 32 * k + __builtin_ctz(v);
+                    return ((x < DiffBuffBase::LX) ? x : DiffBuffBase::LX);
+                    }
+                }
+            return DiffBuffBase::LX;
+            }
+
+
+        void DiffBuffRect::computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask, const DirtyMap* dirtymap, LineSignatures* linesigs)
+            {
+            elapsedMicros em; // for stats.
+            if (linesigs)
+                { // no signatures computed
+                linesigs->discard();
+                if (copy_new_over_old) linesigs->invalidate();
+                }
+            if (gap < 1) gap = 1;
+            if ((fb_new_orientation < 0) || (fb_new_orientation > 3)) fb_new_orientation = 0;
+            _begin();
+            if ((_maxrects < 2) || (fb_old == nullptr) || (fb_new == nullptr)) return;
+            if (compare_mask == 0) compare_mask = 0xFFFF;
+
+            int y = 0;
+            for (; y < DiffBuffBase::LY; y++)
+                {
+                uint32_t bits[LINE_WORDS] = { 0 };
+                uint16_t* po = fb_old + DiffBuffBase::LX * y;
+                int m, mdelta;
+                _orientedIndex(fb_new_orientation, 0, y, m, mdelta);
+                const uint32_t rm = (dirtymap) ? dirtymap->rowMask(y / DirtyMap::TILE) : 0xFFFFFFFF;
+                int x = 0;
+                while (x < DiffBuffBase::LX)
+                    { // process the dirty tiles (or the whole line) by runs
+                    int xe = DiffBuffBase::LX;
+                    if (dirtymap)
+                        {
+                        const int tx = x / DirtyMap::TILE;
+                        const uint32_t r = rm >> tx;
+                        if (r == 0) break;
+                        const int t1 = tx + __builtin_ctz(r);
+                        const uint32_t r2 = ~(rm >> t1);
+                        const int t2 = t1 + ((r2 == 0) ? (32 - t1) : __builtin_ctz(r2));
+                        x = t1 * DirtyMap::TILE;
+                        xe = t2 * DirtyMap::TILE;
+                        if (xe > DiffBuffBase::LX) xe = DiffBuffBase::LX;
+                        }
+                    const uint16_t* pn = fb_new + m + mdelta * x;
+                    for (; x < xe; x++, pn += mdelta)
+                        {
+                        const uint16_t c = *pn;
+                        if ((po[x] ^ c) & compare_mask)
+                            {
+                            bits[x >> 5] |= (1u << (x & 31));
+                            if (copy_new_over_old) po[x] = c;
+                            }
+                        }
+                    }
+                if (!_addLine(bits, y, gap))
+                    { // overflow
+                    _fallback(y);
+                    if (copy_new_over_old) copyfb(fb_old, fb_new, fb_new_orientation, dirtymap); // copy again
+                    break;
+                    }
+                }
+            _end(y);
+            _stats_size.push(_nb);
+            if (_overflow) _stat_overflow++;
+            _stats_time.push(em);
+            }
+
+
+        void DiffBuffRect::computeDiff(uint16_t* fb_old, DiffBuffBase* diff_old, const uint16_t* sub_fb_new, int xmin, int xmax, int ymin, int ymax, int stride,
+                int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask)
+            {
+            elapsedMicros em; // for stats.
+            if (gap < 1) gap = 1;
+            if ((fb_new_orientation < 0) || (fb_new_orientation > 3)) fb_new_orientation = 0;
+            _begin();
+            if ((_maxrects < 2) || (fb_old == nullptr) || (sub_fb_new == nullptr)) return;
+            if (compare_mask == 0) compare_mask = 0xFFFF;
+
+            int x1, x2, y1, y2;
+            DiffBuffBase::rotationBox(fb_new_orientation, xmin, xmax, ymin, ymax, x1, x2, y1, y2);
+
+            DiffBuffDummy dd;
+            if (diff_old)
+                {
+                diff_old->initRaw();
+                }
+            else
+                {
+                dd.setRawEmpty();
+                diff_old = &dd; // set a dummy diff if none provided.
+                }
+            int nb_write = 0, nb_skip = 0; // number of pixel to write / skip in the old diff
+            diff_old->readRaw(nb_write, nb_skip);
+
+            int y = 0;
+            for (; y < DiffBuffBase::LY; y++)
+                {
+                uint32_t bits[LINE_WORDS] = { 0 };
+                int x = 0;
+                while (x < DiffBuffBase::LX)
+                    { // pixels of the previous diff
+                    const int r = DiffBuffBase::LX - x;
+                    if (nb_write > 0)
+                        {
+                        const int l = (nb_write < r) ? nb_write : r;
+                        _setBits(bits, x, x + l - 1);
+                        x += l;
+                        nb_write -= l;
+                        }
+                    else if (nb_skip > 0)
+                        {
+                        const int l = (nb_skip < r) ? nb_skip : r;
+                        x += l;
+                        nb_skip -= l;
+                        }
+                    else diff_old->readRaw(nb_write, nb_skip);
+                    }
+                if ((y >= y1) && (y <= y2))
+                    { // pixels of the region
+                    int m = 0, mdelta = 0;
+                    switch (fb_new_orientation)
+                        {
+                    case PORTRAIT_240x320:
+                        m = stride * (y - y1);
+                        mdelta = 1;
+                        break;
+                    case LANDSCAPE_320x240:
+                        m = (y - y1) + stride * (x2 - x1);
+                        mdelta = -stride;
+                        break;
+                    case PORTRAIT_240x320_FLIPPED:
+                        m = stride * (y2 - y) + (x2 - x1);
+                        mdelta = -1;
+                        break;
+                    case LANDSCAPE_320x240_FLIPPED:
+                        m = y2 - y;
+                        mdelta = stride;
+                        break;
+                        }
+                    uint16_t* po = fb_old + DiffBuffBase::LX * y;
+                    for (int xc = x1; xc <= x2; xc++, m += mdelta)
+                        {
+                        if ((po[xc] ^ sub_fb_new[m]) & compare_mask)
+                            {
+                            bits[xc >> 5] |= (1u << (xc & 31));
+                            if (copy_new_over_old) po[xc] = sub_fb_new[m];
+                            }
+                        }
+                    }
+                if (!_addLine(bits, y, gap))
+                    { // overflow
+                    _fallback(y);
+                    if (copy_new_over_old) copyfb(fb_old, sub_fb_new, xmin, xmax, ymin, ymax, stride, fb_new_orientation); // copy again
+                    break;
+                    }
+                }
+            _end(y);
+            _stats_size.push(_nb);
+            if (_overflow) _stat_overflow++;
+            _stats_time.push(em);
+            }
+
+
+        int DiffBuffRect::_read(int& x, int& y, int& w, int& len, int scanline, bool rect)
+            {
+            // The rectangles are sent by bands of lines: a band stops at the first/last line of any
+            // rectangle so that all the rectangles crossing it cover it entirely. They are sent in 
+            // turn and the next band starts below: y (and the last line written) never goes back up.
+            int rx, ry, rw, rh;
+            while (1)
+                {
+                if (_r_h == 0)
+                    { // start a new band at or below line _r_y
+                    while (_r_first < _nb)
+                        { // skip the rectangles already sent
+                        _unpack(_rects[_r_first], rx, ry, rw, rh);
+                        if (ry + rh > _r_y) break;
+                        _r_first++;
+                        }
+                    if (_r_first >= _nb) return -1; // done
+                    int ys = -1;
+                    for (int i = _r_first; i < _nb; i++)
+                        { // first line of the band
+                        _unpack(_rects[i], rx, ry, rw, rh);
+                        if (ry + rh <= _r_y) continue;
+                        ys = ((ry > _r_y) ? ry : _r_y);
+                        x = rx;
+                        w = rw;
+                        break;
+                        }
+                    if (ys < 0) return -1; // done
+                    y = ys;
+                    if ((scanline < DiffBuffBase::LY) && (ys + MIN_SCANLINE_SPACE > scanline))
+                        { // we must wait a bit.
+                        len = 0;
+                        const int l = ys + MIN_SCANLINE_SPACE;
+                        return ((l < DiffBuffBase::LY) ? l : DiffBuffBase::LY);
+                        }
+                    int ye = ys + MAX_WRITE_LINE;
+                    if ((scanline < DiffBuffBase::LY) && (ye > scanline)) ye = scanline; // lines available now
+                    bool full = true; // true if all the rectangles of the band span whole lines
+                    for (int i = _r_first; i < _nb; i++)
+                        { // end of the band
+                        _unpack(_rects[i], rx, ry, rw, rh);
+                        if (ry > ys) { if (ry < ye) ye = ry; break; }
+                        if (ry + rh <= ys) continue;
+                        if (ry + rh < ye) ye = ry + rh;
+                        if (rw != DiffBuffBase::LX) full = false;
+                        }
+                    if ((!rect) && (!full)) ye = ys + 1; // plain instructions: line by line unless the rectangles span whole lines.
+                    _r_y = ys;
+                    _r_h = ye - ys;
+                    _r_k = _r_first;
+                    }
+                for (; _r_k < _nb; _r_k++)
+                    { // next rectangle crossing the band
+                    _unpack(_rects[_r_k], rx, ry, rw, rh);
+                    if (ry > _r_y) break;
+                    if (ry + rh > _r_y)
+                        {
+                        x = rx;
+                        y = _r_y;
+                        w = rw;
+                        if ((scanline < DiffBuffBase::LY) && (_r_y + _r_h > scanline))
+                            { // we must wait a bit (the scanline should not move up during a frame). 
+                            len = 0;
+                            const int l = _r_y + ((_r_h > MIN_SCANLINE_SPACE) ? _r_h : MIN_SCANLINE_SPACE);
+                            return ((l < DiffBuffBase::LY) ? l : DiffBuffBase::LY);
+                            }
+                        len = _r_h * rw;
+                        _r_k++;
+                        return 0;
+                        }
+                    }
+                _r_y += _r_h; // band done
+                _r_h = 0;
+                }
+            }
+
+
+        bool DiffBuffRect::_rawFind(int pos, int& s, int& e)
+            {
+            int line = pos / DiffBuffBase::LX;
+            int x = pos - line * DiffBuffBase::LX;
+            while (line < DiffBuffBase::LY)
+                {
+                if (_raw_line != line)
+                    { // union of the rectangles on this line (they are sorted by first line)
+                    for (int k = 0; k < LINE_WORDS; k++) _raw_bits[k] = 0;
+                    for (int i = 0; i < _nb; i++)
+                        {
+                        int rx, ry, rw, rh;
+                        _unpack(_rects[i], rx, ry, rw, rh);
+                        if (ry > line) break;
+                        if (ry + rh > line) _setBits(_raw_bits, rx, rx + rw - 1);
+                        }
+                    _raw_line = line;
+                    }
+                const int a = _findBit(_raw_bits, x, true);
+                if (a < DiffBuffBase::LX)
+                    {
+                    s = line * DiffBuffBase::LX + a;
+                    e = line * DiffBuffBase::LX + _findBit(_raw_bits, a, false) - 1;
+                    return true;
+                    }
+                line++;
+                x = 0;
+                }
+            return false;
+            }
+
+
+        void DiffBuffRect::readRaw(int& nbwrite, int& nbskip)
+            {
+            const int NB = DiffBuffBase::LX * DiffBuffBase::LY;
+            int s, e;
+            if ((_raw_pos >= NB) || (!_rawFind(_raw_pos, s, e)))
+                { // nothing more to write
+                nbwrite = 0;
+                nbskip = NB + 1;
+                _raw_pos = NB;
+                return;
+                }
+            if (s > _raw_pos)
+                {
+                nbwrite = 0;
+                nbskip = s - _raw_pos;
+                _raw_pos = s;
+                return;
+                }
+            nbwrite = e - _raw_pos + 1;
+            _raw_pos = e + 1;
+            if ((_raw_pos >= NB) || (!_rawFind(_raw_pos, s, e)))
+                {
+                nbskip = NB + 1;
+                _raw_pos = NB;
+                return;
+                }
+            nbskip = s - _raw_pos;
+            _raw_pos = s;
+            }
+
+
+        void DiffBuffRect::statsReset()
+            {
+            _stat_overflow = 0;
+            _stats_size.reset();
+            _stats_time.reset();
+            }
+
+
+        void DiffBuffRect::printStats(Stream* outputStream) const
+            {
+            outputStream->printf("----------------- DiffBuffRect Stats -----------------\n");
+            outputStream->printf("- max. rectangles    : %u\n", _maxrects);
+            outputStream->printf("- overflow ratio     : %.1f%%  (%u out of %u computed)\n", 100 * statsOverflowRatio(), statsNbOverflow(), statsNbComputed());
+            outputStream->printf("- rectangles / diff  : "); _stats_size.print("", "\n", outputStream);
+            outputStream->printf("- computation time   : "); _stats_time.print("us", "\n\n", outputStream);
+            }
+
+
+
+}
+
+
+
+/** end of file */
+
@@ -0,0 +1,312 @@
+/******************************************************************************
+*  ILI9341_T4 library for driving an ILI9341 screen via SPI with a Teensy 4/4.1
+*  Implements vsync and differential updates from a memory framebuffer.
+*
+*  Copyright (c) 2020 Arvind Singh.  All right reserved.
+*
+* This library is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU Lesser General Public
+*  License as published by the Free Software Foundation; either
+*  version 2.1 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*  Lesser General Public License for more details.
+*
+*  You should have received a copy of the GNU Lesser General Public
+*  License along with this library; if not, write to the Free Software
+*  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*******************************************************************************/
+#ifndef _ILI9341_T4_DIFFBUFFRECT_H_
+#define _ILI9341_T4_DIFFBUFFRECT_H_
+
+// only C++, no plain C
+#ifdef __cplusplus
+
+
+#include "DiffBuff.h"
+#include "StatsVar.h"
+
+#include <stdint.h>
+#include <Arduino.h>
+
+namespace ILI9341_T4
+{
+
+
+
+    /******************************************************************************************
+    * Class used to compute the "diff" between 2 framebuffers, stored as a list of rectangles.
+    *
+    * The runs of modified pixels on consecutive lines are merged into rectangles (a rectangle
+    * is widened when the number of unchanged pixels it adds is smaller than the gap). Each
+    * rectangle is then uploaded with a single CASET/PASET/RAMWR sequence instead of one per
+    * line which is much faster for 'widget-like' updates (moving sprites, buttons, text...).
+    *
+    * Rectangles are returned by bands of lines: a rectangle is cut at the first/last line of the
+    * other rectangles and the rectangles crossing a band are returned in turn before the next 
+    * band. Thus, as with DiffBuff, the writes only move down the screen and they are split 
+    * according to the scanline position so that vsync works the same way.
+    *
+    * The memory for holding the diff is allocated by the user and is passed to the object a
+    * construction time. Each rectangle uses 8 bytes.
+    *******************************************************************************************/
+    class DiffBuffRect : public DiffBuffBase
+    {
+
+    public:
+
+        /**
+        * Constructor. Set the buffer (and its size).
+        * sizebuf should not be too small (at least MIN_BUFFER_SIZE but say 1K to be useful).
+        **/
+        DiffBuffRect(uint8_t* buffer, size_t sizebuf);
+
+
+        virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override
+            {
+            computeDiff(fb_old, fb_new, fb_new_orientation, gap, copy_new_over_old, compare_mask, nullptr, nullptr);
+            }
+
+
+        virtual void computeDiff(uint16_t* fb_old, const uint16_t* fb_new, int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask, const DirtyMap* dirtymap, LineSignatures* linesigs = nullptr) override;
+
+
+        virtual void computeDiff(uint16_t* fb_old, DiffBuffBase* diff_old, const uint16_t* sub_fb_new, int xmin, int xmax, int ymin, int ymax, int stride,
+                                 int fb_new_orientation, int gap, bool copy_new_over_old, uint16_t compare_mask) override;
+
+
+        virtual void initRead() override
+            {
+            _r_first = 0;
+            _r_y = 0;
+            _r_h = 0;
+            _r_k = 0;
+            }
+
+
+        virtual int readDiff(int& x, int& y, int& len, int scanline) override
+            {
+            int w;
+            return _read(x, y, w, len, scanline, false);
+            }
+
+
+        virtual int readDiffRect(int& x, int& y, int& w, int& len, int scanline) override
+            {
+            return _read(x, y, w, len, scanline, true);
+            }
+
+
+        virtual void initRaw() override
+            {
+            _raw_pos = 0;
+            _raw_line = -1;
+            }
+
+
+        virtual void readRaw(int& nbwrite, int& nbskip) override;
+
+
+        virtual float fillRatio() const override { return (_overflow ? 2.0f : (((float)_nb) / _maxrects)); }
+
+
+        /**
+        * Return the number of rectangles in the diff.
+        **/
+        int nbRects() const { return _nb; }
+
+
+        /**
+        * Return the current size of the diff (in bytes).
+        * (return the total size of the buffer in case of overflow).
+        **/
+        int size() const { return (_overflow ? (8 * _maxrects) : (8 * _nb)); }
+
+
+        /************************************************************************
+        * STATISTICS.
+        *
+        * Methods used to monitor resource use and optimize the diff buffer size.
+        ************************************************************************/
+
+
+        /**
+        * Reset all statistics.
+        **/
+        void statsReset();
+
+
+        /**
+        * Return the number of diff computed (since the last call to statsReset()).
+        **/
+        uint32_t statsNbComputed() const { return _stats_size.count(); }
+
+
+        /**
+        * Return the number of diff for which the buffer overflowed.
+        **/
+        uint32_t statsNbOverflow() const { return _stat_overflow; }
+
+
+        /**
+        * Return the percentage of diff that overflowed (between 0 and 1).
+        **/
+        float statsOverflowRatio() const { return ((statsNbComputed() > 0) ? (((float)_stat_overflow) / statsNbComputed()) : 0.0f); }
+
+
+        /**
+        * Return a StatsVar object containing statisitcs about the time
+        * it took to compute the diffs.
+        **/
+        const ILI9341_T4::StatsVar & statsTime() const { return _stats_time; }
+
+
+        /**
+        * Return a StatVar  object containing statisitcs about the number
+        * of rectangles in the computed diffs.
+        **/
+        const ILI9341_T4::StatsVar & statsSize() const { return _stats_size; }
+
+
+        /**
+        * Print all the statistics into a Stream object.
+        **/
+        void printStats(Stream* outputStream = &Serial) const;
+
+
+        static const int MIN_BUFFER_SIZE = 32;      // minimum buffer size
+
+
+    private:
+
+        static const int MAX_OPEN = 32;             // max number of rectangles being built at the same time
+        static const int LINE_WORDS = (DiffBuffBase::LX + 31) / 32; // number of words in a line bitmap
+
+        /** rectangle being built */
+        struct OpenRect
+            {
+            int16_t x1, x2;                         // columns
+            int16_t y0;                             // first line
+            int16_t last;                           // last line
+            };
+
+        uint64_t* const _rects;             // the buffer (aligned)
+        const int _maxrects;                // maximum number of rectangles (including the one reserved for overflow)
+        int _nb;                            // number of rectangles in the diff
+        bool _overflow;                     // true if the last diff overflowed
+
+        int _r_first;                       // first rectangle not completely read (for reading)
+        int _r_y;                           // first line of the current band of lines (for reading)
+        int _r_h;                           // number of lines of the current band (0 if the next band must be found)
+        int _r_k;                           // next rectangle to examine in the current band
+
+        int _raw_pos;                       // current position for raw reading
+        int _raw_line;                      // line described by _raw_bits (-1 if none)
+        uint32_t _raw_bits[LINE_WORDS];     // pixels of line _raw_line covered by the rectangles
+
+        OpenRect _open[MAX_OPEN];           // rectangles being built
+        int _nbopen;                        // and their number
+
+        uint32_t _stat_overflow;            // number of times a diff buffer overflowed
+        ILI9341_T4::StatsVar _stats_size;   // statistics on the number of rectangles
+        ILI9341_T4::StatsVar _stats_time;   // statistics on compute times.
+
+
+        /** align the buffer on 8 bytes */
+        static uint64_t* _align(uint8_t* buffer) { return (uint64_t*)((((uintptr_t)buffer) + 7) & ~((uintptr_t)7)); }
+
+        /** number of rectangles that fit in the buffer */
+        static int _capacity(uint8_t* buffer, size_t sizebuf)
+            {
+            const size_t adj = (size_t)(((uint8_t*)_align(buffer)) - buffer);
+            return ((buffer == nullptr) || (sizebuf <= adj)) ? 0 : (int)((sizebuf - adj) / 8);
+            }
+
+        /** rectangles are packed in 64 bits so that sorting them also sorts by (y,x) */
+        static uint64_t _pack(int x, int y, int w, int h) { return (((uint64_t)y) << 48) | (((uint64_t)x) << 32) | (((uint64_t)w) << 16) | ((uint64_t)h); }
+
+        static void _unpack(uint64_t v, int& x, int& y, int& w, int& h)
+            {
+            h = (int)(v & 0xFFFF);
+            w = (int)((v >> 16) & 0xFFFF);
+            x = (int)((v >> 32) & 0xFFFF);
+            y = (int)(v >> 48);
+            }
+
+
+        /** read the next instruction, as a rectangle if allowed or line by line otherwise */
+        int _read(int& x, int& y, int& w, int& len, int scanline, bool rect);
+
+        /** reset the diff before computing a new one */
+        void _begin();
+
+        /** add the modified pixels of line y (given as a bitmap) to the diff. Return false on overflow */
+        bool _addLine(const uint32_t* bits, int y, int gap);
+
+        /** merge a run [a,b] on line y with a rectangle being built or start a new one. Return false on overflow */
+        bool _addRun(int a, int b, int y, int gap);
+
+        /** store a rectangle. Return false on overflow */
+        bool _emit(int x1, int x2, int y0, int y1);
+
+        /** terminate the diff: flush the rectangles still open and sort */
+        void _end(int y);
+
+        /** on overflow, replace everything after the first line not yet stored by a full redraw */
+        void _fallback(int y);
+
+        /** find the first run [s,e] of pixels covered by rectangles that ends after pos (for raw reading). Return false if none */
+        bool _rawFind(int pos, int& s, int& e);
+
+        /** set bits [a,b] of a line bitmap */
+        static void _setBits(uint32_t* bits, int a, int b);
+
+        /** return the first x >= x0 such that the bit x of a line bitmap is equal to val (or LX if none) */
+        static int _findBit(const uint32_t* bits, int x0, bool val);
+
+        /** sort the rectangles */
+        static void _sort(uint64_t* tab, int n);
+    };
+
+
+
+
+    /******************************************************************************************
+    * Class used to compute the "diff" between 2 framebuffers, stored as a list of rectangles.
+    *
+    * Memory is statically allocated. The buffer size is given as template parameter SIZEBUF.
+    *******************************************************************************************/
+    template<int SIZEBUF>
+    class DiffBuffRectStatic : public DiffBuffRect
+    {
+
+        static_assert(SIZEBUF >= DiffBuffRect::MIN_BUFFER_SIZE, "template parameter SIZEBUF too small !");
+
+    public:
+
+        /**
+        * Constructor. Assign the static array as buffer.
+        **/
+        DiffBuffRectStatic() : DiffBuffRect((uint8_t*)_statictab, 8 * ((SIZEBUF + 7) / 8))
+            {
+            }
+
+
+    private:
+
+        uint64_t _statictab[(SIZEBUF + 7) / 8];
+
+    };
+
+
+
+}
+
+#endif
+
+#endif
+
+/** end of file */
+
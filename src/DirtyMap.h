@@ -0,0 +1,192 @@
+/******************************************************************************
+*  ILI9341_T4 library for driving an ILI9341 screen via SPI with a Teensy 4/4.1
+*  Implements vsync and differential updates from a memory framebuffer.
+*
+*  Copyright (c) 2020 Arvind Singh.  All right reserved.
+*
+* This library is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU Lesser General Public
+*  License as published by the Free Software Foundation; either
+*  version 2.1 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*  Lesser General Public License for more details.
+*
+*  You should have received a copy of the GNU Lesser General Public
+*  License along with this library; if not, write to the Free Software
+*  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*******************************************************************************/
+#ifndef _ILI9341_T4_DIRTYMAP_H_
+#define _ILI9341_T4_DIRTYMAP_H_
+
+// only C++, no plain C
+#ifdef __cplusplus
+
+
+#include "DiffBuff.h"
+
+#include <stdint.h>
+#include <Arduino.h>
+
+namespace ILI9341_T4
+{
+
+
+/**
+ * Class that keeps track of the regions of a framebuffer that were modified.
+ *
+ * The framebuffer is divided in tiles of size TILE x TILE (w.r.t. orientation 0)
+ * and the object stores one bit per tile telling whether some pixels in the tile
+ * may have changed.
+ *
+ * When a dirty map is given to DiffBuff::computeDiff(), only the tiles marked as
+ * dirty are compared and all the other tiles are assumed to be unchanged. Thus,
+ * the cost of creating a diff scales with the number of dirty tiles instead of
+ * with the size of the screen.
+ *
+ * -----------------------------------------------------------------------------
+ * EVERY PIXEL THAT CHANGES MUST BE INSIDE A DIRTY TILE. Changes located in tiles
+ * not marked are simply ignored and will not be drawn on the screen.
+ * -----------------------------------------------------------------------------
+ *
+ * The coordinates given to the mark methods are w.r.t. the orientation set with
+ * setOrientation() (the ILI9341Driver object does this automatically).
+ **/
+class DirtyMap
+    {
+    public:
+
+        static const int TILE = 8;                          // size of a tile (in pixels)
+        static const int NX = DiffBuffBase::LX / TILE;      // number of tiles per line (in orientation 0)
+        static const int NY = DiffBuffBase::LY / TILE;      // number of lines of tiles (in orientation 0)
+
+        static_assert((DiffBuffBase::LX % TILE == 0) && (DiffBuffBase::LY % TILE == 0), "TILE must divide LX and LY");
+        static_assert(NX <= 32, "a line of tiles must fit in 32 bits");
+
+
+        /**
+         * ctor. All the tiles are initially marked as dirty.
+         **/
+        DirtyMap(int orientation = 0)
+            {
+            _orientation = orientation & 3;
+            markAll();
+            }
+
+
+        /**
+         * Set the orientation used for the coordinates of the mark methods.
+         **/
+        void setOrientation(int orientation)
+            {
+            _orientation = orientation & 3;
+            }
+
+
+        /**
+         * Return the orientation used for the coordinates of the mark methods.
+         **/
+        int getOrientation() const { return _orientation; }
+
+
+        /**
+         * Mark every tile as clean.
+         **/
+        void clear()
+            {
+            for (int i = 0; i < NY; i++) _rows[i] = 0;
+            }
+
+
+        /**
+         * Mark every tile as dirty.
+         **/
+        void markAll()
+            {
+            const uint32_t full = (NX == 32) ? 0xFFFFFFFF : ((1u << NX) - 1);
+            for (int i = 0; i < NY; i++) _rows[i] = full;
+            }
+
+
+        /**
+         * Mark the rectangular region [xmin, xmax] x [ymin, ymax] as dirty.
+         * The region is clipped to the framebuffer.
+         **/
+        void markRegion(int xmin, int xmax, int ymin, int ymax)
+            {
+            const int lx = (_orientation & 1) ? DiffBuffBase::LY : DiffBuffBase::LX;
+            const int ly = (_orientation & 1) ? DiffBuffBase::LX : DiffBuffBase::LY;
+            if (xmin < 0) xmin = 0;
+            if (ymin < 0) ymin = 0;
+            if (xmax >= lx) xmax = lx - 1;
+            if (ymax >= ly) ymax = ly - 1;
+            if ((xmin > xmax) || (ymin > ymax)) return;
+            int x1, x2, y1, y2;
+            DiffBuffBase::rotationBox(_orientation, xmin, xmax, ymin, ymax, x1, x2, y1, y2);
+            const int tx1 = x1 / TILE;
+            const int tx2 = x2 / TILE;
+            const uint32_t mask = ((tx2 - tx1 == 31) ? 0xFFFFFFFF : ((1u << (tx2 - tx1 + 1)) - 1)) << tx1;
+            const int ty2 = y2 / TILE;
+            for (int ty = y1 / TILE; ty <= ty2; ty++) _rows[ty] |= mask;
+            }
+
+
+        /**
+         * Mark the tile containing pixel (x,y) as dirty.
+         **/
+        void markPixel(int x, int y) { markRegion(x, x, y, y); }
+
+
+        /**
+         * Return true if no tile is marked.
+         **/
+        bool isEmpty() const
+            {
+            uint32_t r = 0;
+            for (int i = 0; i < NY; i++) r |= _rows[i];
+            return (r == 0);
+            }
+
+
+        /**
+         * Return the number of dirty tiles (out of NX*NY).
+         **/
+        int count() const
+            {
+            int c = 0;
+            for (int i = 0; i < NY; i++) c += __builtin_popcount(_rows[i]);
+            return c;
+            }
+
+
+        /**
+         * Return true if tile (tx,ty) is dirty (coordinates w.r.t. orientation 0)
+         **/
+        bool isTileDirty(int tx, int ty) const { return ((_rows[ty] >> tx) & 1); }
+
+
+        /**
+         * Return the dirty tiles of a line of tiles (bit tx set if tile (tx, ty) is dirty)
+         * (coordinates w.r.t. orientation 0)
+         **/
+        uint32_t rowMask(int ty) const __attribute__((always_inline)) { return _rows[ty]; }
+
+
+    private:
+
+        int _orientation;           // orientation for the coordinates of the mark methods.
+        uint32_t _rows[NY];         // one bit per tile.
+    };
+
+
+
+
+}
+
+#endif
+
+#endif
+
+/** end of file */
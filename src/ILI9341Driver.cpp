@@ -47,7 +47,18 @@ namespace ILI9341_T4
         _late_start_ratio = ILI9341_T4_DEFAULT_LATE_START_RATIO;
         _late_start_ratio_override = true;
         _diff_gap = ILI9341_T4_DEFAULT_DIFF_GAP;
+        _diff_gap_auto = false;
+        _autoGapReset();
         _vsync_spacing = ILI9341_T4_DEFAULT_VSYNC_SPACING;
+        _pacing_fps = 0.0f;
+        _pacingReset();
+        _idle_frames = 0;
+        _idle_mode = 31;
+        _idle_count = 0;
+        _idle_slow = false;
+        _idle_wake = false;
+        _idle_period = 0;
+        _active_period = 0;
         _diff1 = nullptr;
         _diff2 = nullptr;
         _fb1 = nullptr;
@@ -55,15 +66,50 @@ namespace ILI9341_T4
         _dummydiff1 = &_dd1;
         _dummydiff2 = &_dd2;
         _mirrorfb = nullptr;
+        _mirror_half = false;
         _ongoingDiff = nullptr;
+        _delta_state = ILI9341_T4_DELTA_IDLE;
+        _delta_nbytes = 0;
+        _delta_half = false;
+        _delta_lo = 0;
+        _delta_pos = 0;
+        _delta_count = 0;
+        _delta_diff = nullptr;
 
         _fb2full = false;
         _compare_mask = 0; 
+        _perc_r = _perc_g = _perc_b = 0;
+        _perc_frames = 16;
+        _perc_y = 0;
+        _framecomplete_cb = nullptr;
+        _framecomplete_obj = nullptr;
+        _bufferreleased_cb = nullptr;
+        _bufferreleased_obj = nullptr;
+        _frame_counter = 0;
+        _dirtymap = nullptr;
+        _stream_band_lines = 0;
+        _dma_batch = 1;
+        _stream_launched = false;
+        _scroll_detect = false;
+        _inverted = false;
+        _linesigs_on = false;
+        _scroll_offset = 0;
+        _scroll_send = false;
+        _wrap_rem = 0;
+        _staging = false;
+        _stage_ready = false;
+        _stage_idx = 0;
+        _stage_x = _stage_y = 0;
+        _stage_rem = 0;
 
         // vsync
         _period = 0;        
         _synced_em = 0;
         _synced_scanline = 0;
+        _te_pin = 255;
+        _te_count = 0;
+        _te_last = 0;
+        _te_sum = 0;
 
         // dma
         _pcb = nullptr;        
@@ -94,38 +140,41 @@ namespace ILI9341_T4
 
 
 
+    /** initialization sequence of the registers sent by begin() and _restoreRegisters() */
+    static const uint8_t ILI9341_T4_init_commands[] = {
+                                             4, 0xEF, 0x03, 0x80, 0x02,                 // undocumented commands            
+                                             4, 0xCF, 0x00, 0xC1, 0x30,                 //
+                                             5, 0xED, 0x64, 0x03, 0X12, 0X81,           //
+                                             4, 0xE8, 0x85, 0x00, 0x78,                 //
+                                             6, 0xCB, 0x39, 0x2C, 0x00, 0x34, 0x02,     //
+                                             2, 0xF7, 0x20,                             //
+                                             3, 0xEA, 0x00, 0x00,                       //
+                                             2, ILI9341_T4_PWCTR1, 0x23, // Power control 0x23 (or 0x20)
+                                             2, ILI9341_T4_PWCTR2, 0x10, // Power control
+                                             3, ILI9341_T4_VMCTR1, 0x3e, 0x28, // VCM control
+                                             2, ILI9341_T4_VMCTR2, 0x86, // VCM control2
+                                             2, ILI9341_T4_MADCTL, 0x48, // Memory Access Control
+                                             2, ILI9341_T4_PIXFMT, 0x55, 
+                                             3, ILI9341_T4_FRMCTR1, 0x00, 0x13, 
+                                             4, ILI9341_T4_DFUNCTR, 0x08, 0x82, 0x27, // Display Function Control
+                                             2, 0xF2, 0x00, // Gamma Function Disable
+                                             2, ILI9341_T4_GAMMASET, 0x01, // Gamma curve selected
+                                            16, ILI9341_T4_GMCTRP1, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08, 0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E, 0x09, 0x00, // Set Gamma
+                                            16, ILI9341_T4_GMCTRN1, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, 0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F, // Set Gamma                                                                                             
+                                             5, 0x2B, 0x00, 0x00, 0x01, 0x3f,
+                                             5, 0x2A, 0x00, 0x00, 0x00, 0xef,
+                                             0 };
 
 
     FLASHMEM bool ILI9341Driver::begin(uint32_t spi_clock, uint32_t spi_clock_read)
         {
-        static const uint8_t init_commands[] = {
-                                                 4, 0xEF, 0x03, 0x80, 0x02,                 // undocumented commands            
-                                                 4, 0xCF, 0x00, 0xC1, 0x30,                 //
-                                                 5, 0xED, 0x64, 0x03, 0X12, 0X81,           //
-                                                 4, 0xE8, 0x85, 0x00, 0x78,                 //
-                                                 6, 0xCB, 0x39, 0x2C, 0x00, 0x34, 0x02,     //
-                                                 2, 0xF7, 0x20,                             //
-                                                 3, 0xEA, 0x00, 0x00,                       //
-                                                 2, ILI9341_T4_PWCTR1, 0x23, // Power control 0x23 (or 0x20)
-                                                 2, ILI9341_T4_PWCTR2, 0x10, // Power control
-                                                 3, ILI9341_T4_VMCTR1, 0x3e, 0x28, // VCM control
-                                                 2, ILI9341_T4_VMCTR2, 0x86, // VCM control2
-                                                 2, ILI9341_T4_MADCTL, 0x48, // Memory Access Control
-                                                 2, ILI9341_T4_PIXFMT, 0x55, 
-                                                 3, ILI9341_T4_FRMCTR1, 0x00, 0x13, 
-                                                 4, ILI9341_T4_DFUNCTR, 0x08, 0x82, 0x27, // Display Function Control
-                                                 2, 0xF2, 0x00, // Gamma Function Disable
-                                                 2, ILI9341_T4_GAMMASET, 0x01, // Gamma curve selected
-                                                16, ILI9341_T4_GMCTRP1, 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08, 0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E, 0x09, 0x00, // Set Gamma
-                                                16, ILI9341_T4_GMCTRN1, 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, 0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F, // Set Gamma                                                                                             
-                                                 5, 0x2B, 0x00, 0x00, 0x01, 0x3f,
-                                                 5, 0x2A, 0x00, 0x00, 0x00, 0xef,
-                                                 0 };
-
         _print("\n\n----------------- ILI9341_T4 begin() ------------------\n\n");
         statsReset();
         resync(); // resync at first upload
         _mirrorfb = nullptr; // force full redraw.
+        _scroll_offset = 0; // the reset sets the scroll offset back to 0.
+        _inverted = false; // and the color inversion.
+        _scroll_send = false;
         _ongoingDiff = nullptr;
 
         if (_touch_cs != 255)
@@ -232,6 +281,7 @@ namespace ILI9341_T4
         _maybeUpdateTCR(_tcr_dc_not_assert | LPSPI_TCR_FRAMESZ(7)); // drive DC high now. 
 
         if (_rst < 255) _printf("- RST on pin %d\n", _rst); else _print("- RST pin not connected (set it to +3.3V).\n");
+        if (_te_pin < 255) _printf("- TE on pin %d\n", _te_pin); else _print("- TE pin not connected (vsync with scanline polling).\n");
         if (_touch_cs < 255)
             {
             _printf("\n[Touchscreen is CONNECTED]\n- TOUCH_CS on pin %d\n", _touch_cs);
@@ -274,7 +324,7 @@ namespace ILI9341_T4
             delay(150); // mandatory !
            
             _beginSPITransaction(_spi_clock / 4); // quarter speed for setup ! 
-            const uint8_t* addr = init_commands;
+            const uint8_t* addr = ILI9341_T4_init_commands;
             while (1)
                 {
                 uint8_t count = *addr++;
@@ -338,6 +388,7 @@ namespace ILI9341_T4
                 {
                 // all good, ready to warp pixels :-)
                 // ok, we can talk to the display so we set the (max) refresh rate to read its exact values
+                if (_te_pin != 255) _attachTE(); // use the TE pulses for vsync
                 setRefreshMode(0);
                 _period_mode0 = _period; // save the period for fastest mode. 
                 _print("\nOK. Screen initialization successful !\n\n");
@@ -423,6 +474,7 @@ namespace ILI9341_T4
         _beginSPITransaction(_spi_clock / 4); // quarter speed
         _writecommand_last(i ? ILI9341_T4_INVON : ILI9341_T4_INVOFF);
         _endSPITransaction();
+        _inverted = i;
         resync();
         }
 
@@ -435,6 +487,12 @@ namespace ILI9341_T4
             }
         offset = offset % 320;
         waitUpdateAsyncComplete();
+        if (_scroll_detect)
+            { // the driver keeps track of the offset: the screen must be redrawn.
+            _scroll_offset = offset;
+            _mirrorfb = nullptr;
+            _ongoingDiff = nullptr;
+            }
         _beginSPITransaction(_spi_clock);
         _writecommand_cont(ILI9341_T4_VSCRSADD);
         _writedata16_cont(offset);
@@ -445,6 +503,54 @@ namespace ILI9341_T4
 
 
 
+    void ILI9341Driver::_sendScroll()
+        {
+        if (!_scroll_send) return;
+        _scroll_send = false;
+        _beginSPITransaction(_spi_clock);
+        _writecommand_cont(ILI9341_T4_VSCRSADD);
+        _writedata16_cont(_scroll_offset);
+        _writecommand_cont(ILI9341_T4_RAMWR); // same as setScroll()
+        _writecommand_last(ILI9341_T4_NOP);
+        _endSPITransaction();
+        }
+
+
+    void ILI9341Driver::_resetScroll()
+        {
+        if (_scroll_offset == 0) return;
+        if ((_mirrorfb) && (_mirrorfb == _fb1) && (_ongoingDiff == nullptr))
+            { // the screen content moves back: move the mirror with it. 
+            DiffBuffBase::scrollfb(_fb1, -_scroll_offset);
+            }
+        else
+            {
+            _mirrorfb = nullptr; // full redraw needed.
+            }
+        _scroll_offset = 0;
+        _scroll_send = true;
+        _sendScroll();
+        _ongoingDiff = nullptr;
+        _linesigs.invalidate();
+        if (_dirtymap) _dirtymap->markAll();
+        }
+
+
+    void ILI9341Driver::_detectScroll(const uint16_t* fb)
+        {
+        const int d = DiffBuff::detectScroll(_fb1, fb, getRotation(), _compare_mask, ILI9341_T4_SCROLL_MIN_GAIN);
+        if (d == 0) return;
+        waitUpdateAsyncComplete(); // _fb1 may still be uploaded. 
+        DiffBuffBase::scrollfb(_fb1, d); // _fb1 now mirrors the screen after the scroll
+        _scroll_offset = (_scroll_offset + d) % ILI9341_T4_TFTHEIGHT;
+        _scroll_send = true;
+        _linesigs.invalidate();
+        if (_dirtymap) _dirtymap->markAll(); // every line of _fb1 moved
+        _stats_nb_scrolled++;
+        }
+
+
+
     /**********************************************************************************************************
     * Screen orientation
     ***********************************************************************************************************/
@@ -455,11 +561,17 @@ namespace ILI9341_T4
         m = _clip(m, (uint8_t)0, (uint8_t)3);
         if (m == _rotation) return;
         waitUpdateAsyncComplete();
-        _mirrorfb = nullptr; // force full redraw.
-        _ongoingDiff = nullptr;
+        _resetScroll();
+        // the internal framebuffers are kept in orientation 0, like the screen memory, so the 
+        // mirror (and any pending diff) remains valid and the next update is still differential. 
 
         statsReset();
         _rotation = m;
+        if (_dirtymap)
+            {
+            _dirtymap->setOrientation(m);
+            _dirtymap->markAll();
+            }
         switch (m)
             {
             case 0: // portrait 240x320
@@ -488,21 +600,72 @@ namespace ILI9341_T4
         {
         if ((mode < 0) || (mode > 31)) return; // invalid mode, do nothing. 
         _refreshmode = mode;
+        waitUpdateAsyncComplete();
+        _idle_slow = false; // the low-power mode is overwritten.
+        _idle_wake = false;
+        _idle_count = 0;
+        _sendRefreshMode(mode);
+        _sampleRefreshRate(); // estimate the real refreshrate
+        statsReset();
+        resync();
+        }
+
+
+    void ILI9341Driver::_sendRefreshMode(int mode)
+        {
         uint8_t diva = 0;
         if (mode >= 16) 
             {
             mode -= 16; 
             diva = 1;
             }
-        waitUpdateAsyncComplete();
         _beginSPITransaction(_spi_clock / 4); // quarter speed 
         _writecommand_cont(ILI9341_T4_FRMCTR1); // Column addr set
         _writedata8_cont(diva);
         _writedata8_last(0x10 + mode);
         _endSPITransaction();
         delayMicroseconds(50); 
-        _sampleRefreshRate(); // estimate the real refreshrate
-        statsReset();
+        }
+
+
+    void ILI9341Driver::setIdleRefreshMode(int idle_frames, int idle_mode)
+        {
+        waitUpdateAsyncComplete();
+        _idleWakeUp();
+        _idle_frames = (idle_frames > 0) ? idle_frames : 0;
+        idle_mode = ILI9341Driver::_clip<int>(idle_mode, 0, 31);
+        if (idle_mode != _idle_mode) _idle_period = 0; // must be measured again. 
+        _idle_mode = idle_mode;
+        _idle_count = 0;
+        }
+
+
+    void ILI9341Driver::_enterIdleMode()
+        {
+        waitUpdateAsyncComplete();
+        if ((_period == 0) || (_idle_mode == _refreshmode)) { _idle_count = 0; return; } // not initialized or nothing to do. 
+        _active_period = _period;
+        _sendRefreshMode(_idle_mode);
+        if (_idle_period == 0)
+            { // first time: measure the slow refresh rate. 
+            _sampleRefreshRate();
+            _idle_period = _period;
+            }
+        _period = _idle_period;
+        _idle_wake = false;
+        _idle_slow = true;
+        resync();
+        }
+
+
+    void ILI9341Driver::_leaveIdleMode()
+        {
+        waitUpdateAsyncComplete();
+        _sendRefreshMode(_refreshmode);
+        _period = _active_period;
+        _idle_slow = false;
+        _idle_wake = false;
+        _idle_count = 0;
         resync();
         }
 
@@ -525,6 +688,7 @@ namespace ILI9341_T4
     /** return the current scanline in [0, 319]. Sync with SPI only if required */
     int ILI9341Driver::_getScanLine(bool sync)
         {
+        if ((sync) && (_teActive())) sync = false; // already synced by the TE interrupt.
         if (!sync)
             {
             return ( _synced_scanline + ((((uint64_t)_synced_em)* ILI9341_T4_NB_SCANLINES) / _period) ) % ILI9341_T4_NB_SCANLINES;
@@ -554,6 +718,28 @@ namespace ILI9341_T4
 
     void ILI9341Driver::_sampleRefreshRate()
         {
+        if (_te_pin != 255)
+            { // measure directly the time between TE pulses
+            const int NB_TE_SAMPLE_FRAMES = 4;
+            noInterrupts();
+            _te_count = 0;
+            _te_sum = 0;
+            interrupts();
+            elapsedMillis em = 0;
+            while ((_te_count <= NB_TE_SAMPLE_FRAMES) && (em < 500)); // the slowest mode is above 20Hz.
+            noInterrupts(); // the TE interrupt may still fire: read both values together.
+            const uint32_t c = _te_count;
+            const uint32_t sum = _te_sum;
+            interrupts();
+            if (c > 2)
+                {
+                _period = (uint32_t)round(((float)sum) / (c - 1));
+                return;
+                }
+            _printf("\n*** WARNING: no signal on TE pin %d, using scanline polling instead ***\n\n", _te_pin);
+            _detachTE(true);
+            _te_pin = 255;
+            }
         const int NB_SAMPLE_FRAMES = 10;
         while (_getScanLine(true) != 0);  // wait to reach scanline 0
         while (_getScanLine(true) == 0);  // wait to begin scanline 1. 
@@ -568,6 +754,65 @@ namespace ILI9341_T4
         }
 
 
+    ILI9341Driver* volatile ILI9341Driver::_teObjects[4] = { nullptr, nullptr, nullptr, nullptr };
+
+
+    void ILI9341Driver::setTearingEffectPin(uint8_t te_pin)
+        {
+        waitUpdateAsyncComplete();
+        const bool initialized = (_period != 0); // begin() was already called
+        if (_te_pin != 255) _detachTE(initialized);
+        _te_pin = te_pin;
+        if ((initialized) && (_te_pin != 255))
+            {
+            _attachTE();
+            _sampleRefreshRate(); // check that the pulses are received
+            }
+        statsReset();
+        resync();
+        }
+
+
+    void ILI9341Driver::_attachTE()
+        {
+        _detachTE(false);
+        bool slotfound = false;
+        if ((_te_pin >= 0) && (_te_pin < 42)) // valid digital pin
+            {
+            pinMode(_te_pin, INPUT);
+            if ((!slotfound) && (_teObjects[0] == nullptr)) { _teObjects[0] = this; attachInterrupt(_te_pin, _te_int0, RISING); slotfound = true; }
+            if ((!slotfound) && (_teObjects[1] == nullptr)) { _teObjects[1] = this; attachInterrupt(_te_pin, _te_int1, RISING); slotfound = true; }
+            if ((!slotfound) && (_teObjects[2] == nullptr)) { _teObjects[2] = this; attachInterrupt(_te_pin, _te_int2, RISING); slotfound = true; }
+            if ((!slotfound) && (_teObjects[3] == nullptr)) { _teObjects[3] = this; attachInterrupt(_te_pin, _te_int3, RISING); slotfound = true; }
+            }
+        if (!slotfound) { _te_pin = 255; return; } // disable TE sync
+        _beginSPITransaction(_spi_clock / 4); // quarter speed
+        _writecommand_cont(ILI9341_T4_TEON);
+        _writedata8_last(0x00); // V-blanking information only 
+        _endSPITransaction();
+        }
+
+
+    void ILI9341Driver::_detachTE(bool send_cmd)
+        {
+        for (int i = 0; i < 4; i++)
+            {
+            if (_teObjects[i] == this)
+                {
+                detachInterrupt(_te_pin);
+                _teObjects[i] = nullptr;
+                }
+            }
+        _te_count = 0;
+        if (send_cmd)
+            {
+            _beginSPITransaction(_spi_clock / 4); // quarter speed
+            _writecommand_last(ILI9341_T4_TEOFF);
+            _endSPITransaction();
+            }
+        }
+
+
     float ILI9341Driver::_refreshRateForMode(int mode) const
         { 
         float freq = 1000000.0f / _period_mode0;
@@ -605,13 +850,38 @@ namespace ILI9341_T4
 
 
 
+    bool ILI9341Driver::restoreMirror()
+        {
+        waitUpdateAsyncComplete();
+        while (_fb2full); // just in case. 
+        _ongoingDiff = nullptr;
+        _linesigs.invalidate();
+        if (_dirtymap) _dirtymap->markAll();
+        _mirrorfb = nullptr;
+        if ((_fb1 == nullptr) || (_miso == 0xff)) return false;
+        const int order = _readbackOrder();
+        if (order < 0) return false; // unknown channel order: cannot decode the readback.
+        for (int y = 0; y < ILI9341_T4_TFTHEIGHT; y++)
+            { // line y of the screen is stored at _gramLine(y) in the screen memory. 
+            uint16_t* line = _fb1 + ILI9341_T4_TFTWIDTH * y;
+            if (_readPixels(0, _gramLine(y), ILI9341_T4_TFTWIDTH, line) != ILI9341_T4_TFTWIDTH) return false;
+            if (order == 1) { for (int x = 0; x < ILI9341_T4_TFTWIDTH; x++) line[x] = _swapRedBlue(line[x]); }
+            }
+        _mirrorfb = _fb1; // _fb1 mirrors the screen again.  
+        resync();
+        return true;
+        }
+
+
     void ILI9341Driver::setFramebuffers(uint16_t* fb1, uint16_t* fb2)
         {
         waitUpdateAsyncComplete();
+        _resetScroll();
         _mirrorfb = nullptr; // complete redraw needed.
         _ongoingDiff = nullptr;
 
         _fb2full = false;
+        _linesigs.invalidate();
         if (fb1)
             {
             _fb1 = fb1;
@@ -680,6 +950,8 @@ namespace ILI9341_T4
             for(int i=0; i < ILI9341_T4_NB_PIXELS; i++) _fb1[i] = color;
             _mirrorfb = _fb1;
             _ongoingDiff = nullptr;
+            _linesigs.invalidate();
+            if (_dirtymap) _dirtymap->markAll(); // fb1 may now differ everywhere from the user framebuffer
             }
         resync();
         }
@@ -688,6 +960,9 @@ namespace ILI9341_T4
     void ILI9341Driver::updateRegion(bool redrawNow, const uint16_t* fb, int xmin, int xmax, int ymin, int ymax, int stride)
         {
         if (stride < 0) stride = xmax - xmin + 1;
+        _idleWakeUp();
+        _linesigs.invalidate(); // fb1 is modified directly
+        _mirror_half = false;
         switch (bufferingMode())
             {
             case NO_BUFFERING:
@@ -804,7 +1079,449 @@ namespace ILI9341_T4
         
 
 
+    void ILI9341Driver::updateBands(BandCallback cb, void* obj, uint16_t* band, int band_lines)
+        {
+        if ((cb == nullptr) || (band == nullptr) || (band_lines <= 0)) return;
+        ILI9341_T4_TRACE_EVENT(TRACE_UPDATE, band_lines);
+        _idleWakeUp(false);
+        if (_diff_gap_auto) _autoGapUpdate(); // select the gap for this diff.
+        if (_pacing_fps > 0.0f) _pacingUpdate(); // adjust the vsync spacing.
+        if (bufferingMode() == NO_BUFFERING)
+            { // render and upload the bands one after the other (blocking upload, no vsync)
+            _mirrorfb = nullptr;
+            _ongoingDiff = nullptr;
+            _linesigs.invalidate();
+            waitUpdateAsyncComplete();
+            _startframe(false);
+            _stats_nb_uploaded_pixels = 0;
+            for (int y = 0; y < _height; y += band_lines)
+                {
+                const int ye = ((y + band_lines) < _height) ? (y + band_lines - 1) : (_height - 1);
+                _pauseUploadTime(); // rendering is not part of the upload
+                cb(obj, band, y, ye);
+                _restartUploadTime();
+                _pushRect(band, 0, _width - 1, y, ye, _width);
+                }
+            _endframe();
+            _notifyFrameDone();
+            return;
+            }
+        // with an internal framebuffer: accumulate the bands and redraw with the last one. 
+        for (int y = 0; y < _height; y += band_lines)
+            {
+            const int ye = ((y + band_lines) < _height) ? (y + band_lines - 1) : (_height - 1);
+            cb(obj, band, y, ye);
+            updateRegion((ye == _height - 1), band, 0, _width - 1, y, ye, _width);
+            }
+        if (_dirtymap) _dirtymap->markAll(); // fb1 was modified without the dirty map.
+        }
+
+
+    void ILI9341Driver::fillRegion(bool redrawNow, uint16_t color, int xmin, int xmax, int ymin, int ymax)
+        {
+        if (!_clipRegion(xmin, xmax, ymin, ymax)) return;
+        if (bufferingMode() == NO_BUFFERING)
+            { // push a single line repeated over the region (stride 0)
+            uint16_t line[ILI9341_T4_TFTHEIGHT];
+            for (int i = 0; i < ILI9341_T4_TFTHEIGHT; i++) line[i] = color;
+            _mirrorfb = nullptr;
+            _ongoingDiff = nullptr;
+            _linesigs.invalidate();
+            _updateRectNow(line, xmin, xmax, ymin, ymax, 0);
+            return;
+            }
+        DiffBuffBase* diff = _drawBegin(xmin, xmax, ymin, ymax);
+        int x1, x2, y1, y2;
+        DiffBuffBase::rotationBox(_rotation, xmin, xmax, ymin, ymax, x1, x2, y1, y2);
+        for (int j = y1; j <= y2; j++)
+            {
+            uint16_t* p = _fb1 + ILI9341_T4_TFTWIDTH * j;
+            for (int i = x1; i <= x2; i++) p[i] = color;
+            }
+        _drawEnd(diff, redrawNow);
+        }
+
+
+    void ILI9341Driver::drawSprite(bool redrawNow, const uint16_t* sprite, int x, int y, int w, int h, int transparent_color, int stride)
+        {
+        if ((sprite == nullptr) || (w <= 0) || (h <= 0)) return;
+        if (stride < 0) stride = w;
+        int xmin = x, xmax = x + w - 1, ymin = y, ymax = y + h - 1;
+        if (!_clipRegion(xmin, xmax, ymin, ymax)) return;
+        sprite += (xmin - x) + stride * (ymin - y); // skip the clipped part
+        const bool opaque = ((transparent_color < 0) || (transparent_color > 65535));
+        if (bufferingMode() == NO_BUFFERING)
+            {
+            if (!opaque) return; // cannot skip pixels without a copy of the screen.
+            _mirrorfb = nullptr;
+            _ongoingDiff = nullptr;
+            _linesigs.invalidate();
+            _updateRectNow(sprite, xmin, xmax, ymin, ymax, stride);
+            return;
+            }
+        DiffBuffBase* diff = _drawBegin(xmin, xmax, ymin, ymax);
+        for (int j = ymin; j <= ymax; j++)
+            {
+            const uint16_t* src = sprite + stride * (j - ymin);
+            for (int i = xmin; i <= xmax; i++)
+                {
+                const uint16_t c = src[i - xmin];
+                if ((opaque) || (c != transparent_color)) _fb1[_fbIndex(i, j)] = c;
+                }
+            }
+        _drawEnd(diff, redrawNow);
+        }
+
+
+    void ILI9341Driver::drawMask(bool redrawNow, const uint8_t* mask, int x, int y, int w, int h, uint16_t color, int stride)
+        {
+        if ((mask == nullptr) || (w <= 0) || (h <= 0) || (bufferingMode() == NO_BUFFERING)) return;
+        if (stride < 0) stride = (w + 7) / 8;
+        int xmin = x, xmax = x + w - 1, ymin = y, ymax = y + h - 1;
+        if (!_clipRegion(xmin, xmax, ymin, ymax)) return;
+        DiffBuffBase* diff = _drawBegin(xmin, xmax, ymin, ymax);
+        for (int j = ymin; j <= ymax; j++)
+            {
+            const uint8_t* row = mask + stride * (j - y);
+            for (int i = xmin; i <= xmax; i++)
+                {
+                const int b = i - x;
+                if ((row[b >> 3] << (b & 7)) & 0x80) _fb1[_fbIndex(i, j)] = color;
+                }
+            }
+        _drawEnd(diff, redrawNow);
+        }
+
+
+    bool ILI9341Driver::_clipRegion(int& xmin, int& xmax, int& ymin, int& ymax)
+        {
+        if (xmin < 0) xmin = 0;
+        if (xmax >= _width) xmax = _width - 1;
+        if (ymin < 0) ymin = 0;
+        if (ymax >= _height) ymax = _height - 1;
+        return ((xmin <= xmax) && (ymin <= ymax));
+        }
+
+
+    DiffBuffBase* ILI9341Driver::_drawBegin(int xmin, int xmax, int ymin, int ymax)
+        {
+        _idleWakeUp();
+        _linesigs.invalidate(); // fb1 is modified directly
+        _mirror_half = false;
+        if (_dirtymap) _dirtymap->markRegion(xmin, xmax, ymin, ymax); // fb1 changes in this region.
+        if (bufferingMode() == TRIPLE_BUFFERING)
+            { // the second internal framebuffer is not used.
+            while (_fb2full); // we wait until the _fb2 is free (hence diff 2 is also free).  
+            }
+        DiffBuffBase* diff = nullptr;
+        if ((_diff2) && ((_mirrorfb == _fb1) || (_ongoingDiff)))
+            { // merge the region with the pending changes (if any), possibly while the previous frame is uploaded. 
+            int x1, x2, y1, y2;
+            DiffBuffBase::rotationBox(_rotation, xmin, xmax, ymin, ymax, x1, x2, y1, y2);
+            if (_diff2->computeDiffAddRect(((_mirrorfb == _fb1) ? nullptr : _ongoingDiff), x1, x2, y1, y2, _diff_gap)) diff = _diff2;
+            }
+        waitUpdateAsyncComplete(); // fb1 is about to be modified.
+        return diff;
+        }
+
+
+    void ILI9341Driver::_drawEnd(DiffBuffBase* diff, bool redrawNow)
+        {
+        if (diff)
+            {
+            _swapdiff();
+            if (redrawNow)
+                {
+                _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
+                _updateAsync(_fb1, _diff1);
+                _mirrorfb = _fb1;
+                _ongoingDiff = nullptr;
+                }
+            else
+                {
+                _mirrorfb = nullptr; 
+                _ongoingDiff = _diff1;
+                }
+            return;
+            }
+        // no diff: the framebuffer does not mirror the screen anymore. 
+        _mirrorfb = nullptr;
+        _ongoingDiff = nullptr;
+        if (redrawNow)
+            { // redraw everything
+            _dummydiff1->computeDummyDiff();
+            _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
+            _updateAsync(_fb1, _dummydiff1);
+            _mirrorfb = _fb1; // now we mirror the screen !
+            }
+        }
+
+
+    bool ILI9341Driver::beginDelta()
+        {
+        if (_delta_state != ILI9341_T4_DELTA_IDLE) endDelta(false); // keep the changes of the previous stream pending.
+        if ((bufferingMode() == NO_BUFFERING) || (_fb1 == nullptr)) return false;
+        _idleWakeUp();
+        _linesigs.invalidate(); // fb1 is modified directly
+        _mirror_half = false;
+        if (bufferingMode() == TRIPLE_BUFFERING)
+            { // the second internal framebuffer is not used.
+            while (_fb2full); // we wait until the _fb2 is free (hence diff 2 is also free).  
+            }
+        waitUpdateAsyncComplete(); // fb1 is about to be modified.
+        _delta_diff = nullptr;
+        if ((_diff2) && (_mirrorfb == _fb1) && (_diff2->beginDiffRuns(_diff_gap))) _delta_diff = _diff2;
+        _delta_state = ILI9341_T4_DELTA_SKIP;
+        _delta_nbytes = 0;
+        _delta_half = false;
+        _delta_pos = 0;
+        _delta_count = 0;
+        return true;
+        }
+
+
+    bool ILI9341Driver::pushDelta(const uint8_t* data, size_t len)
+        {
+        if ((_delta_state == ILI9341_T4_DELTA_IDLE) || (_delta_state == ILI9341_T4_DELTA_ERROR)) return false;
+        const uint8_t* const end = data + len;
+        while (data < end)
+            {
+            switch (_delta_state)
+                {
+                case ILI9341_T4_DELTA_SKIP:
+                    {
+                    int val;
+                    if (!_deltaValue(*data++, val)) break;
+                    _delta_pos += val;
+                    if (_delta_pos > ILI9341_T4_NB_PIXELS) { _delta_state = ILI9341_T4_DELTA_ERROR; return false; }
+                    _delta_state = ILI9341_T4_DELTA_CODE;
+                    break;
+                    }
+                case ILI9341_T4_DELTA_CODE:
+                    {
+                    int val;
+                    if (!_deltaValue(*data++, val)) break;
+                    const int n = (val >> 1);
+                    if (_delta_pos + n > ILI9341_T4_NB_PIXELS) { _delta_state = ILI9341_T4_DELTA_ERROR; return false; }
+                    if (n == 0) { _delta_state = ILI9341_T4_DELTA_SKIP; break; }
+                    if (_delta_diff) _delta_diff->addDiffRun(_delta_pos, n);
+                    _delta_count = n;
+                    _delta_half = false;
+                    _delta_state = (val & 1) ? ILI9341_T4_DELTA_RLE : ILI9341_T4_DELTA_PIXELS;
+                    break;
+                    }
+                case ILI9341_T4_DELTA_PIXELS:
+                    {
+                    uint16_t* p = _fb1 + _delta_pos;
+                    if (_delta_half)
+                        { // complete the pixel split between 2 calls
+                        *(p++) = (uint16_t)(_delta_lo | (((uint16_t)(*data++)) << 8));
+                        _delta_half = false;
+                        _delta_pos++;
+                        _delta_count--;
+                        }
+                    int nb = (int)((end - data) >> 1);
+                    if (nb > _delta_count) nb = _delta_count;
+                    for (int i = 0; i < nb; i++) p[i] = (uint16_t)(data[2 * i] | (((uint16_t)data[2 * i + 1]) << 8));
+                    data += 2 * nb;
+                    _delta_pos += nb;
+                    _delta_count -= nb;
+                    if (_delta_count == 0) { _delta_state = ILI9341_T4_DELTA_SKIP; break; }
+                    if (data < end) { _delta_lo = *data++; _delta_half = true; } // low byte of the next pixel
+                    break;
+                    }
+                case ILI9341_T4_DELTA_RLE:
+                    {
+                    if (!_delta_half) { _delta_lo = *data++; _delta_half = true; break; }
+                    const uint16_t color = (uint16_t)(_delta_lo | (((uint16_t)(*data++)) << 8));
+                    uint16_t* p = _fb1 + _delta_pos;
+                    for (int i = 0; i < _delta_count; i++) p[i] = color;
+                    _delta_pos += _delta_count;
+                    _delta_count = 0;
+                    _delta_half = false;
+                    _delta_state = ILI9341_T4_DELTA_SKIP;
+                    break;
+                    }
+                }
+            }
+        return true;
+        }
+
+
+    bool ILI9341Driver::endDelta(bool redrawNow)
+        {
+        if (_delta_state == ILI9341_T4_DELTA_IDLE) return false;
+        ILI9341_T4_TRACE_EVENT(TRACE_UPDATE, _delta_pos);
+        // a truncated run is harmless: the pixels not received are simply uploaded unchanged. 
+        const bool ok = ((_delta_state == ILI9341_T4_DELTA_SKIP) && (_delta_nbytes == 0));
+        DiffBuffBase* diff = _delta_diff;
+        _delta_diff = nullptr;
+        _delta_state = ILI9341_T4_DELTA_IDLE;
+        if (diff) diff->endDiffRuns();
+        if (_dirtymap) _dirtymap->markAll(); // fb1 was modified without the dirty map.
+        _drawEnd(diff, redrawNow);
+        return ok;
+        }
+
+
+    void ILI9341Driver::updateHalfRes(const uint16_t* fb_half, bool force_full_redraw)
+        {
+        ILI9341_T4_TRACE_EVENT(TRACE_UPDATE, force_full_redraw);
+        if (fb_half == nullptr) return;
+        _updateExpanded(fb_half, nullptr, nullptr, force_full_redraw || (!_mirror_half));
+        }
+
+
+    void ILI9341Driver::updatePalette(const uint8_t* fb8, const uint16_t* palette, bool force_full_redraw)
+        {
+        ILI9341_T4_TRACE_EVENT(TRACE_UPDATE, force_full_redraw);
+        if ((fb8 == nullptr) || (palette == nullptr)) return;
+        _updateExpanded(nullptr, fb8, palette, force_full_redraw);
+        }
+
+
+    void ILI9341Driver::_updateExpanded(const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette, bool force_full_redraw)
+        {
+        if ((bufferingMode() == DOUBLE_BUFFERING) && (_vsync_spacing == -1) && (asyncUpdateActive())) { return; } // just drop the frame. 
+        _idleWakeUp(force_full_redraw);
+        _ongoingDiff = nullptr;
+        _linesigs.invalidate(); // no signatures for the expanded frame. 
+        if (bufferingMode() == NO_BUFFERING)
+            { // push the expanded pixels right away
+            waitUpdateAsyncComplete();
+            _mirrorfb = nullptr;
+            _startframe(false);
+            _pushExpanded(fb_half, fb8, palette);
+            _endframe();
+            _notifyFrameDone();
+            return;
+            }
+        if (bufferingMode() == TRIPLE_BUFFERING)
+            { // the second internal framebuffer is not used.
+            while (_fb2full); // we wait until the _fb2 is free (hence diff 2 is also free).  
+            }
+        if (_diff_gap_auto) _autoGapUpdate(); // select the gap for this diff.
+        if (_pacing_fps > 0.0f) _pacingUpdate(); // adjust the vsync spacing.
+        DiffBuffBase* diff = nullptr;
+        if ((_mirrorfb == _fb1) && (_diff1) && (!force_full_redraw))
+            {
+            if ((_diff2) && (asyncUpdateActive()))
+                { // create the diff while the previous frame is uploaded.
+                if (_diffExpanded(_diff2, fb_half, fb8, palette, false))
+                    {
+                    waitUpdateAsyncComplete();
+                    _copyExpanded(fb_half, fb8, palette);
+                    _swapdiff();
+                    diff = _diff1;
+                    }
+                }
+            else
+                {
+                waitUpdateAsyncComplete();
+                if (_diffExpanded(_diff1, fb_half, fb8, palette, true)) diff = _diff1; // create a diff and copy to fb1.
+                }
+            }
+        if (diff == nullptr)
+            { // complete redraw
+            waitUpdateAsyncComplete();
+            _copyExpanded(fb_half, fb8, palette);
+            _dummydiff1->computeDummyDiff();
+            diff = _dummydiff1;
+            }
+        if (_dirtymap) _dirtymap->markAll(); // fb1 was modified without the dirty map.
+        _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
+        _updateAsync(_fb1, diff); // launch update
+        _mirrorfb = _fb1; // set as mirror
+        _mirror_half = (fb_half != nullptr);
+        _idleCheck();
+        }
+
+
+    bool ILI9341Driver::_diffExpanded(DiffBuffBase* diff, const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette, bool copy_new_over_old)
+        {
+        if (fb_half) return diff->computeDiffHalf(_fb1, fb_half, _rotation, _diff_gap, copy_new_over_old, _compare_mask);
+        return diff->computeDiffPalette(_fb1, fb8, palette, _rotation, _diff_gap, copy_new_over_old, _compare_mask);
+        }
+
+
+    void ILI9341Driver::_copyExpanded(const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette)
+        {
+        if (fb_half) DiffBuffBase::copyfbHalf(_fb1, fb_half, _rotation); else DiffBuffBase::copyfbPalette(_fb1, fb8, palette, _rotation);
+        }
+
+
     void ILI9341Driver::update(const uint16_t* fb, bool force_full_redraw)
+        {
+        ILI9341_T4_TRACE_EVENT(TRACE_UPDATE, force_full_redraw);
+        if ((bufferingMode() == DOUBLE_BUFFERING) && (_vsync_spacing == -1) && (asyncUpdateActive())) { return; } // just drop the frame (and keep the dirty map). 
+        if ((_idle_frames > 0) && (!force_full_redraw) && (_dirtymap) && (_dirtymap->isEmpty()) && (bufferingMode() == DOUBLE_BUFFERING)
+         && (_mirrorfb == _fb1) && (!_mirror_half) && (_ongoingDiff == nullptr))
+            { // idle mode enabled and nothing changed since the last frame: the screen is already up to date. 
+            _idleFrame();
+            _notifyFrameDone(); // same notifications as a completed upload.
+            _idleCheck();
+            return;
+            }
+        _idleWakeUp((_dirtymap) || (force_full_redraw)); // real change: back to the normal refresh mode.
+        if (_diff_gap_auto) _autoGapUpdate(); // select the gap for this diff.
+        if (_pacing_fps > 0.0f) _pacingUpdate(); // adjust the vsync spacing.
+        _mirror_half = false;
+        _update(fb, force_full_redraw);
+        if (_dirtymap) _dirtymap->clear(); // the frame was accepted: start tracking changes for the next one. 
+        _idleCheck();
+        }
+
+
+    uint16_t* ILI9341Driver::updateAndSwap(uint16_t* fb, bool force_full_redraw)
+        {
+        if ((fb == nullptr) || (bufferingMode() != DOUBLE_BUFFERING) || (getRotation() != PORTRAIT_240x320) 
+         || ((_vsync_spacing == -1) && (asyncUpdateActive())))
+            { // no swap possible
+            update(fb, force_full_redraw);
+            return fb;
+            }
+        ILI9341_T4_TRACE_EVENT(TRACE_UPDATE, force_full_redraw);
+        _idleWakeUp();
+        if (_diff_gap_auto) _autoGapUpdate(); // select the gap for this diff.
+        if (_pacing_fps > 0.0f) _pacingUpdate(); // adjust the vsync spacing.
+        _ongoingDiff = nullptr;
+        _mirror_half = false;
+        if (_dirtymap) _dirtymap->markAll(); // the buffers are swapped so the dirty map is meaningless.
+        DiffBuffBase* diff;
+        if ((_diff1 == nullptr) || (_mirrorfb == nullptr) || (force_full_redraw))
+            { // full redraw
+            waitUpdateAsyncComplete(); 
+            _dummydiff1->computeDiff(_fb1, fb, PORTRAIT_240x320, _diff_gap, false, _compare_mask, nullptr, _sigs());
+            diff = _dummydiff1;
+            }
+        else
+            {
+            if (_scroll_detect) _detectScroll(fb); // use the hardware scroll if the content was shifted. 
+            if ((_diff2 != nullptr) && (asyncUpdateActive()))
+                { // compute the diff while the previous frame is uploaded. 
+                _diff2->computeDiff(_fb1, fb, PORTRAIT_240x320, _diff_gap, false, _compare_mask, nullptr, _sigs());
+                waitUpdateAsyncComplete();
+                _swapdiff();
+                }
+            else
+                {
+                waitUpdateAsyncComplete();
+                _diff1->computeDiff(_fb1, fb, PORTRAIT_240x320, _diff_gap, false, _compare_mask, nullptr, _sigs());
+                }
+            diff = _diff1;
+            }
+        // fb becomes the mirror of the screen
+        uint16_t* old = _fb1;
+        _fb1 = fb;
+        _linesigs.commit(); 
+        _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
+        _updateAsync(_fb1, diff);
+        _mirrorfb = _fb1;
+        return old;
+        }
+
+
+    void ILI9341Driver::_update(const uint16_t* fb, bool force_full_redraw)
         {
         _ongoingDiff = nullptr; // here we just ignore possible ongoing diff and just redraw everything if _mirrorfb == nullptr. 
                                 // We could do better but don't care since its an edge case relevant only when swapping between 
@@ -823,32 +1540,30 @@ namespace ILI9341_T4
 
             case DOUBLE_BUFFERING:
                 {                
-                if ((_vsync_spacing == -1) && (asyncUpdateActive())) { return; } // just drop the frame. 
-
                 if ((_diff1 == nullptr)|| (_mirrorfb == nullptr) || (force_full_redraw))
                     { // do not use differential update
                     waitUpdateAsyncComplete(); // wait until update is done. 
-                    _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a dummy diff and copy to fb1. 
+                    _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask, nullptr, _sigs()); // create a dummy diff and copy to fb1. 
                     _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
                     _updateAsync(_fb1, _dummydiff1); // launch update
                     _mirrorfb = _fb1; // set as mirror
                     return;
                     }
 
+                if (_scroll_detect) _detectScroll(fb); // use the hardware scroll if the content was shifted. 
+
                 if (_diff2 == nullptr)
                     { // double buffering with a single diff
                     waitUpdateAsyncComplete(); // wait until update is done. 
                     if ((_mirrorfb == nullptr) || (force_full_redraw))
                         { // complete redraw needed. 
-                        _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a dummy diff and copy to fb1. 
+                        _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask, nullptr, _sigs()); // create a dummy diff and copy to fb1. 
                         _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
                         _updateAsync(_fb1, _dummydiff1); // launch update
                         }
                     else
                         { // diff redraw 
-                        _diff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a diff and copy to fb1. 
-                        _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
-                        _updateAsync(_fb1, _diff1); // launch update
+                        _updateAsyncDiff1(fb); // create a diff, copy to fb1 and launch update
                         }
                     _mirrorfb = _fb1; // set as mirror
                     return;
@@ -857,18 +1572,21 @@ namespace ILI9341_T4
                 // double buffering with two diffs 
                 if (asyncUpdateActive())
                     { // _diff2 is available so we use it to create the diff while update is in progress. 
-                    _diff2->computeDiff(_fb1, fb, getRotation(), _diff_gap, false, _compare_mask); // create a diff without copying                    
+                    const bool perceptual = _perceptualNext(_diff2);
+                    _diff2->computeDiff(_fb1, fb, getRotation(), _diff_gap, false, _compare_mask, _dirtymap, _sigs()); // create a diff without copying                    
                     waitUpdateAsyncComplete(); // wait until update is done.                    
-                    DiffBuff::copyfb(_fb1, fb, getRotation()); // save the framebuffer in fb1               
+                    if (perceptual) 
+                        DiffBuffBase::copyfbDiff(_fb1, fb, getRotation(), _diff2); // only the pixels drawn: fb1 keeps mirroring the screen.
+                    else
+                        DiffBuff::copyfb(_fb1, fb, getRotation(), _dirtymap); // save the framebuffer in fb1               
+                    _linesigs.commit(); // fb1 now holds the frame whose signatures were just computed
                     _swapdiff();  // swap the diffs so that diff1 contain the new diff.                     
                     _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
                     _updateAsync(_fb1, _diff1); // launch update
                     }
                 else
                     {
-                    _diff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a diff and copy
-                    _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
-                    _updateAsync(_fb1, _diff1); // launch update
+                    _updateAsyncDiff1(fb); // create a diff, copy to fb1 and launch update
                     }
                 _mirrorfb = _fb1; // set as mirror
                 return;
@@ -880,15 +1598,13 @@ namespace ILI9341_T4
                     { // we can launch immediately
                     if ((_diff2 == nullptr)||(_mirrorfb == nullptr)||(force_full_redraw))
                         { // complete redraw needed. 
-                        _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a dummy diff and copy to fb1. 
+                        _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask, nullptr, _sigs()); // create a dummy diff and copy to fb1. 
                         _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
                         _updateAsync(_fb1, _dummydiff1); // launch update
                         }
                     else
                         {
-                        _diff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a diff and copy
-                        _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
-                        _updateAsync(_fb1, _diff1); // launch update
+                        _updateAsyncDiff1(fb); // create a diff, copy to fb1 and launch update
                         }
                     _mirrorfb = _fb1; // set as mirror
                     return;
@@ -905,11 +1621,19 @@ namespace ILI9341_T4
                 if (asyncUpdateActive())
                     { // update still in progress so we replace_fb2.
                     _setCB(); // remove callback to prevent upload of fb2
+                    const bool replace = _fb2full; // true if we replace a frame that was never drawn: the dirty map does not cover it then.
                     interrupts();
                     if ((_mirrorfb)&&(!force_full_redraw)&&(_diff2 != nullptr))
                         {
-                        _diff2->computeDiff(_fb1, fb, getRotation(), _diff_gap, false, _compare_mask); // create a diff without copying
-                        DiffBuff::copyfb(_fb2, fb, getRotation()); // save in fb2
+                        const bool perceptual = _perceptualNext(_diff2);
+                        _diff2->computeDiff(_fb1, fb, getRotation(), _diff_gap, false, _compare_mask, (replace ? nullptr : _dirtymap), _sigs()); // create a diff without copying
+                        if (perceptual)
+                            { // fb2 = fb1 with the pixels drawn by the diff so that it mirrors the screen after the upload. 
+                            memcpy(_fb2, _fb1, ILI9341_T4_NB_PIXELS * 2);
+                            DiffBuffBase::copyfbDiff(_fb2, fb, getRotation(), _diff2);
+                            }
+                        else
+                            DiffBuff::copyfb(_fb2, fb, getRotation()); // save in fb2
                         _flush_cache(_fb2, ILI9341_T4_NB_PIXELS * 2);
                         noInterrupts();
                         if (asyncUpdateActive())
@@ -925,6 +1649,7 @@ namespace ILI9341_T4
                             interrupts();
                             _swapdiff();
                             _swapfb();
+                            _linesigs.commit();
                             _mirrorfb = _fb1;
                             _updateAsync(_fb1, _diff1); // launch update
                             return;
@@ -932,7 +1657,7 @@ namespace ILI9341_T4
                         }
                     else
                         {
-                        _dummydiff2->computeDiff(_fb1, fb, getRotation(), _diff_gap, false, _compare_mask); // create a dummy diff without copy
+                        _dummydiff2->computeDiff(_fb1, fb, getRotation(), _diff_gap, false, _compare_mask, nullptr, _sigs()); // create a dummy diff without copy
                         DiffBuff::copyfb(_fb2, fb, getRotation()); // save in fb2
                         _flush_cache(_fb2, ILI9341_T4_NB_PIXELS * 2);
                         noInterrupts();
@@ -949,6 +1674,7 @@ namespace ILI9341_T4
                             interrupts();
                             _swapdummydiff();
                             _swapfb();
+                            _linesigs.commit(); // (signatures were discarded so this invalidates them)
                             _mirrorfb = _fb1;
                             _updateAsync(_fb1, _dummydiff1); // launch update
                             return;
@@ -957,17 +1683,16 @@ namespace ILI9341_T4
                     }
                 else
                     { // we can launch immediately
+                    interrupts();
                     if ((_mirrorfb == nullptr)||(force_full_redraw)||(_diff2 == nullptr))
                         { // complete redraw needed. 
-                        _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a dummy diff and copy to fb1. 
+                        _dummydiff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask, nullptr, _sigs()); // create a dummy diff and copy to fb1. 
                         _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
                         _updateAsync(_fb1, _dummydiff1); // launch update
                         }
                     else
                         {
-                        _diff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask); // create a diff and copy
-                        _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
-                        _updateAsync(_fb1, _diff1); // launch update
+                        _updateAsyncDiff1(fb); // create a diff, copy to fb1 and launch update
                         }
                     _mirrorfb = _fb1; // set as mirror
                     return;
@@ -977,12 +1702,35 @@ namespace ILI9341_T4
         }
 
 
+    void ILI9341Driver::_updateAsyncDiff1(const uint16_t* fb)
+        {
+        _stream_launched = false;
+        if (_stream_band_lines > 0) _diff1->streamNextDiff(_stream_band_lines, &ILI9341Driver::_streamStartCB, this);
+        _perceptualNext(_diff1);
+        _diff1->computeDiff(_fb1, fb, getRotation(), _diff_gap, true, _compare_mask, _dirtymap, _sigs()); // create a diff and copy to fb1 (streamed if possible). 
+        if (!_stream_launched)
+            { // the upload did not start while computing the diff
+            _flush_cache(_fb1, ILI9341_T4_NB_PIXELS * 2);
+            _updateAsync(_fb1, _diff1); // launch update
+            }
+        }
+
+
+    void ILI9341Driver::_streamStartCB(void* obj)
+        {
+        ILI9341Driver* p = (ILI9341Driver*)obj;
+        p->_stream_launched = true;
+        p->_updateAsync(p->_fb1, p->_diff1); // start uploading while the rest of the diff is computed. 
+        }
+
+
     void ILI9341Driver::_buffer2fullCB()
         {        
         if (_mirrorfb)
             {
             _swapdiff();
             _swapfb(); 
+            _linesigs.commit();
             _mirrorfb = _fb1;
             _fb2full = false;
             _updateAsync(_fb1, _diff1); // launch update
@@ -991,6 +1739,7 @@ namespace ILI9341_T4
             {
             _swapdummydiff();
             _swapfb();
+            _linesigs.commit();
             _mirrorfb = _fb1;
             _fb2full = false;
             _updateAsync(_fb1, _dummydiff1); // launch update
@@ -1052,6 +1801,7 @@ namespace ILI9341_T4
         diff->initRead();
         int x = 0, y = 0, len = 0;
         int sc1 = diff->readDiff(x, y, len, 0); // scanline at 0 so sc1 will contain the scanline start position. 
+        ILI9341_T4_TRACE_EVENT(TRACE_DIFF_DONE, sc1);
         if (sc1 < 0)
             { // Diff is empty
             if (_vsync_spacing > 0)
@@ -1066,6 +1816,7 @@ namespace ILI9341_T4
                 _timeframestart = tfs;
                 }
             _endframe();
+            _notifyFrameDone();
             return;
             }
         // ok we have at least one instruction
@@ -1098,6 +1849,7 @@ namespace ILI9341_T4
             _last_delta = (int)round(((double)(tfs - _timeframestart)) / (_period));
             _timeframestart = tfs;
             }
+        ILI9341_T4_TRACE_EVENT(TRACE_UPLOAD_START, (_vsync_spacing > 0) ? (int)_slinitpos : (2 * ILI9341_T4_TFTHEIGHT)); // same scanline estimate as the async upload (no SPI read).
         _beginSPITransaction(_spi_clock);
         // write full PASET/CASET now and we shall only update the start position from now on. 
         _writecommand_cont(ILI9341_T4_CASET);
@@ -1107,15 +1859,18 @@ namespace ILI9341_T4
         _writedata16_cont(y);
         _writedata16_last(ILI9341_T4_TFTHEIGHT);
         int prev_x = x;
+        int prev_xe = ILI9341_T4_TFTWIDTH;
         int prev_y = y;
         while (1)
             {
             int asl = (_vsync_spacing > 0) ? (_slinitpos + _nbScanlineDuring(_em_async)) : (2*ILI9341_T4_TFTHEIGHT);
-            int r = diff->readDiff(x, y, len, asl);            
+            int w = 0;
+            int r = diff->readDiffRect(x, y, w, len, asl);            
             if (r > 0)
                 { // we must wait                             
                 int t = _timeForScanlines(r - asl + 1);
                 if (t < ILI9341_T4_MIN_WAIT_TIME) t = ILI9341_T4_MIN_WAIT_TIME;
+                ILI9341_T4_TRACE_EVENT(TRACE_SCANLINE_WAIT, r);
                 _pauseUploadTime();
                 _delayMicro(t);
                 _restartUploadTime();
@@ -1126,15 +1881,21 @@ namespace ILI9341_T4
                 _writecommand_last(ILI9341_T4_NOP);
                 _endSPITransaction();
                 _endframe();
+                _notifyFrameDone();
                 return;
                 }
             _stats_nb_uploaded_pixels += len;
             _stats_nb_transactions++;
-            if (x != prev_x)
+            ILI9341_T4_TRACE_EVENT(TRACE_DMA_CHUNK, len);
+            int xe = _windowEnd(x, w, len);
+            if ((xe == ILI9341_T4_TFTWIDTH) && (x + len <= prev_xe + 1)) xe = prev_xe; // fits in the current window.
+            if ((x != prev_x) || (xe != prev_xe))
                 {
                 _writecommand_cont(ILI9341_T4_CASET);
                 _writedata16_cont(x);
+                if (xe != prev_xe) _writedata16_cont(xe);
                 prev_x = x;
+                prev_xe = xe;
                 }
             if (y != prev_y)
                 {
@@ -1143,12 +1904,24 @@ namespace ILI9341_T4
                 prev_y = y;
                 }
             _writecommand_cont(ILI9341_T4_RAMWR);
-            _pushpixels(fb, x, y, len);
             if (_vsync_spacing > 0)
                 {
-                int m = (ILI9341_T4_TFTWIDTH*y + x + len)/ILI9341_T4_TFTWIDTH + ILI9341_T4_TFTHEIGHT - _slinitpos - _nbScanlineDuring(_em_async);
+                int m = _lastLine(x, y, xe, len) + ILI9341_T4_TFTHEIGHT - _slinitpos - _nbScanlineDuring(_em_async);
                 if (m < _margin) _margin = m;
                 }           
+            if (xe == ILI9341_T4_TFTWIDTH)
+                {
+                _pushpixels(fb, x, y, len);
+                }
+            else
+                { // rectangle: push it line by line. 
+                for (int yy = y; len > 0; yy++)
+                    {
+                    const int l = (len < w) ? len : w;
+                    _pushpixels(fb, x, yy, l);
+                    len -= l;
+                    }
+                }
             }
         }
 
@@ -1159,20 +1932,59 @@ namespace ILI9341_T4
         {
         int x1, x2, y1, y2;
         DiffBuffBase::rotationBox(_rotation, xmin, xmax, ymin, ymax, x1, x2, y1, y2);
-        const int w = x2 - x1 + 1;
-
         if ((sub_fb == nullptr) || (x2 < x1) || (y2 < y1)) return;
         waitUpdateAsyncComplete();
         _startframe(false);
         _stats_nb_uploaded_pixels = 0;
+        _pushRect(sub_fb, xmin, xmax, ymin, ymax, stride);
+        _endframe();
+        _notifyFrameDone();
+        }
+
 
+    void ILI9341Driver::_pushExpanded(const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette)
+        {
+        uint16_t line[DiffBuffBase::LX];
+        _beginSPITransaction(_spi_clock);
+        for (int y = 0; y < ILI9341_T4_TFTHEIGHT; y++)
+            {
+            if ((y == 0) || (_gramLine(y) == 0))
+                { // position at the start (and again if the screen wraps around the end of the screen memory)
+                _writecommand_cont(ILI9341_T4_CASET);
+                _writedata16_cont(0);
+                _writedata16_cont(ILI9341_T4_TFTWIDTH - 1);
+                _writecommand_cont(ILI9341_T4_PASET);
+                _writedata16_cont(_gramLine(y));
+                _writedata16_cont(ILI9341_T4_TFTHEIGHT - 1);
+                _writecommand_cont(ILI9341_T4_RAMWR);
+                }
+            if (fb_half == nullptr) DiffBuffBase::paletteLine(line, fb8, palette, _rotation, y);
+            else if ((y & 1) == 0) DiffBuffBase::halfLine(line, fb_half, _rotation, y); // odd lines are the same
+            for (int x = 0; x < ILI9341_T4_TFTWIDTH; x++) _writedata16_cont(line[x]);
+            }
+        _writecommand_last(ILI9341_T4_NOP);
+        _endSPITransaction();
+        _stats_nb_uploaded_pixels += ILI9341_T4_NB_PIXELS;
+        _stats_nb_transactions++;
+        }
+
+
+    void ILI9341Driver::_pushRect(const uint16_t* sub_fb, int xmin, int xmax, int ymin, int ymax, int stride)
+        {
+        int x1, x2, y1, y2;
+        DiffBuffBase::rotationBox(_rotation, xmin, xmax, ymin, ymax, x1, x2, y1, y2);
+        const int w = x2 - x1 + 1;
+        if ((sub_fb == nullptr) || (x2 < x1) || (y2 < y1)) return;
+
+        const int gy1 = _gramLine(y1);
+        const int gy2 = _gramLine(y2);
         _beginSPITransaction(_spi_clock);
         _writecommand_cont(ILI9341_T4_CASET);
         _writedata16_cont(x1);
         _writedata16_cont(x2);
         _writecommand_cont(ILI9341_T4_PASET);
-        _writedata16_cont(y1);
-        _writedata16_cont(y2);
+        _writedata16_cont(gy1);
+        _writedata16_cont((gy2 >= gy1) ? gy2 : (ILI9341_T4_TFTHEIGHT - 1));
         _writecommand_cont(ILI9341_T4_RAMWR);
 
         int mdelta = 0;
@@ -1185,6 +1997,13 @@ namespace ILI9341_T4
             }
         for (int yc = y1; yc <= y2; yc++)
             {
+            if ((yc != y1) && (_gramLine(yc) == 0))
+                { // the region wraps around the end of the screen memory (scroll offset)
+                _writecommand_cont(ILI9341_T4_PASET);
+                _writedata16_cont(0);
+                _writedata16_cont(gy2);
+                _writecommand_cont(ILI9341_T4_RAMWR);
+                }
             int m = 0;
             switch (_rotation)
                 {
@@ -1197,8 +2016,8 @@ namespace ILI9341_T4
             }
         _writecommand_last(ILI9341_T4_NOP);
         _endSPITransaction();
-        _endframe();
-        return;
+        _stats_nb_uploaded_pixels += w * (y2 - y1 + 1);
+        _stats_nb_transactions++;
         }
         
 
@@ -1227,6 +2046,7 @@ namespace ILI9341_T4
         diff->initRead();
         int x = 0, y = 0, len = 0;        
         int sc1 = diff->readDiff(x, y, len, 0); // scanline at 0 so sc1 will contain the scanline start position. 
+        ILI9341_T4_TRACE_EVENT(TRACE_DIFF_DONE, sc1);
         if (sc1 < 0)
             { // Diff is empty. 
             _dmaObject[_spi_num] = nullptr;
@@ -1241,16 +2061,14 @@ namespace ILI9341_T4
                 _last_delta = (int)round(((double)(tfs - _timeframestart)) / (_period));  // number of refresh between this frame and the previous one. 
                 _timeframestart = tfs;
                 }
+            _sendScroll(); // the content may just have been shifted
             _endframe();
-            if (_touch_request_read)
-                {
-                _updateTouch2(); // touch update requested. do it now.
-                _touch_request_read = false;
-                }
             _dmaObject[_spi_num] = nullptr;
             _dma_state = ILI9341_T4_DMA_IDLE;
             if (_pcb) { (this->*_pcb)(); }
             _pcb = nullptr; // remove it afterward.     
+            _touchAfterFrame(); // requested touch read, once the next frame (if any) was launched.
+            _notifyFrameDone();
             return;
             }
 
@@ -1260,11 +2078,18 @@ namespace ILI9341_T4
         _writedata16_cont(x);
         _writedata16_cont(ILI9341_T4_TFTWIDTH);
         _writecommand_cont(ILI9341_T4_PASET);
-        _writedata16_cont(y);
+        _writedata16_cont(_gramLine(y));
         _writedata16_last(ILI9341_T4_TFTHEIGHT);
         _endSPITransaction();
         _prev_caset_x = x;
-        _prev_paset_y = y;
+        _prev_caset_xe = ILI9341_T4_TFTWIDTH;
+        _prev_paset_y = _gramLine(y);
+        _rect_rem = 0;
+        _wrap_rem = 0;
+        _stage_rem = 0;
+        _staging = (ILI9341_T4_EXTMEM_STAGING) && (_inExtMem(fb)); // DMA from EXTMEM goes through the staging buffers (if enabled). 
+        _stage_ready = false;
+        _stage_idx = 0;
         _slinitpos = sc1; // save the requested scanline initial position
 
         if (_vsync_spacing <= 0)
@@ -1333,30 +2158,31 @@ namespace ILI9341_T4
             _timeframestart = tfs;
             }
 
+        _sendScroll(); // change the scroll offset just before uploading the new content. 
+
         // read the first instruction
-        int x = 0, y = 0, len = 0;
+        int x = 0, y = 0, xe = 0, len = 0;
+        bool cont = false;
         int asl = (_vsync_spacing > 0) ? _slinitpos  : (2 * ILI9341_T4_TFTHEIGHT);
-        int r = _diff->readDiff(x, y, len, asl);
-        if ((r != 0)||(len == 0)||(x != _prev_caset_x)||(y != _prev_paset_y))
+        int r = _readRun(asl, x, y, xe, len, cont);
+        if ((r != 0)||(len == 0)||(x != _prev_caset_x)||(_gramLine(y) != _prev_paset_y))
             { // this should not happen, but try to fail gracefully.            
             _endframe();
-            if (_touch_request_read)
-                {
-                _updateTouch2(); // touch update requested. do it now.
-                _touch_request_read = false;
-                }
             _dmaObject[_spi_num] = nullptr;
             _dma_state = ILI9341_T4_DMA_IDLE;
             if (_pcb) { (this->*_pcb)(); }
             _pcb = nullptr; // remove it afterward.   
+            _touchAfterFrame(); // requested touch read, once the next frame (if any) was launched.
+            _notifyFrameDone();
             return;
             }
 
         _dma_spi_tcr_assert = (_spi_tcr_current & ~ILI9341_T4_TCR_MASK) | (_tcr_dc_assert | LPSPI_TCR_FRAMESZ(7) | LPSPI_TCR_RXMSK );
         _dma_spi_tcr_deassert = (_spi_tcr_current & ~ILI9341_T4_TCR_MASK) | (_tcr_dc_not_assert | LPSPI_TCR_FRAMESZ(15) | LPSPI_TCR_RXMSK); // bug with | LPSPI_TCR_CONT
 
-        _last_y = (ILI9341_T4_TFTWIDTH * y + x + len) / ILI9341_T4_TFTWIDTH;
+        _last_y = _lastLine(x, y, xe, len);
         _stats_nb_uploaded_pixels = len;
+        ILI9341_T4_TRACE_EVENT(TRACE_UPLOAD_START, asl);
 
         /* not used...
         _dmaRAMWR = ILI9341_T4_RAMWR;
@@ -1371,7 +2197,7 @@ namespace ILI9341_T4
         _dmasettingsDiff[1].TCD->ATTR_DST = 2;
         _dmasettingsDiff[1].replaceSettingsOnCompletion(_dmasettingsDiff[2]);
 
-        _dmasettingsDiff[2].sourceBuffer(_fb + x + (y * ILI9341_T4_TFTWIDTH), 2 * len);
+        _dmasettingsDiff[2].sourceBuffer(_dmaSource(x, y, len), 2 * len);
         _dmasettingsDiff[2].destination(_pimxrt_spi->TDR);
         _dmasettingsDiff[2].TCD->ATTR_DST = 1;
         _dmasettingsDiff[2].replaceSettingsOnCompletion(_dmasettingsDiff[1]);
@@ -1394,12 +2220,12 @@ namespace ILI9341_T4
         _pimxrt_spi->SR = 0x3f00;
         _pimxrt_spi->FCR = LPSPI_FCR_TXWATER(2);  // CHOOSING LPSPI_FCR_TXWATER(0) = 0 MAY BE MUCH SAFER (BUT SLOWER) ????
 
-        _pimxrt_spi->TCR = _dma_spi_tcr_assert;
-        _pimxrt_spi->TDR = ILI9341_T4_RAMWR;
+        _dmaWriteCommands(x, y, xe); // only RAMWR unless the first instruction is a rectangle
 
         NVIC_SET_PRIORITY(IRQ_DMA_CH0 + _dmatx.channel, ILI9341_T4_IRQ_PRIORITY);
         _dmatx.begin(false);
         _dmatx.enable(); // go !
+        if (_staging) _stagePrefetch();
         NVIC_SET_PRIORITY(IRQ_DMA_CH0 + _dmatx.channel, ILI9341_T4_IRQ_PRIORITY);
         _pauseCpuTime();
         }
@@ -1413,9 +2239,10 @@ namespace ILI9341_T4
             int m = _last_y + ILI9341_T4_TFTHEIGHT - _slinitpos - _nbScanlineDuring(_em_async);
             if (m < _margin) _margin = m;
             }
-        int x = 0, y = 0, len = 0;
+        int x = 0, y = 0, xe = 0, len = 0;
+        bool cont = false;
         int asl = (_vsync_spacing > 0) ? (_slinitpos + _nbScanlineDuring(_em_async)) : (2 * ILI9341_T4_TFTHEIGHT);
-        int r = _diff->readDiff(x, y, len, asl);
+        int r = _readRun(asl, x, y, xe, len, cont);
         if (r < 0)
             { // we are done !                    
             while (_pimxrt_spi->FSR & 0x1f);        // wait for transmit fifo to be empty
@@ -1430,16 +2257,21 @@ namespace ILI9341_T4
             */
             _endSPITransaction();
             _endframe();
-            if (_touch_request_read)
-                {
-                _updateTouch2(); // touch update requested. do it now.
-                _touch_request_read = false;
-                }
             // _flush_cache(_fb, 2 * ILI9341_T4_NB_PIXELS);   /// NOT USEFUL AFTER NO ????
             _dmaObject[_spi_num] = nullptr;
             _dma_state = ILI9341_T4_DMA_IDLE;
             if (_pcb) { (this->*_pcb)(); }
             _pcb = nullptr; // remove it afterward.    
+            _touchAfterFrame(); // requested touch read, once the next frame (if any) was launched.
+            _notifyFrameDone();
+            return;
+            }
+        else if (r == DiffBuffBase::NOT_READY)
+            { // streamed diff: the next instruction is still being computed. 
+            ILI9341_T4_TRACE_EVENT(TRACE_STREAM_WAIT, 0);
+            _pauseUploadTime();
+            _setTimerIn(ILI9341_T4_STREAM_WAIT_TIME, &ILI9341Driver::_subFrameInterruptDiff2);
+            _pauseCpuTime();
             return;
             }
         else if (r > 0)
@@ -1448,41 +2280,263 @@ namespace ILI9341_T4
             if (t < ILI9341_T4_MIN_WAIT_TIME) t = ILI9341_T4_MIN_WAIT_TIME;
             //while (_pimxrt_spi->FSR & 0x1f);        // wait for transmit fifo to be empty
             //while (_pimxrt_spi->SR & LPSPI_SR_MBF); // wait while spi bus is busy. 
+            ILI9341_T4_TRACE_EVENT(TRACE_SCANLINE_WAIT, r);
             _pauseUploadTime();
             _setTimerIn(t, &ILI9341Driver::_subFrameInterruptDiff2);
             _pauseCpuTime();
             return;
             }
         // new instruction
+        if (!cont) _dmaWriteCommands(x, y, xe); // (the next line of a rectangle simply continues the RAMWR)
+
+        _last_y = _lastLine(x, y, xe, len);
+        _stats_nb_uploaded_pixels += len;
+        ILI9341_T4_TRACE_EVENT(TRACE_DMA_CHUNK, len);
+
+        _dmasettingsDiff[2].sourceBuffer(_dmaSource(x, y, len), len * 2);
+        _dmasettingsDiff[2].destination(_pimxrt_spi->TDR);
+        _dmasettingsDiff[2].TCD->ATTR_DST = 1;
+        if ((_dma_batch > 1) && (!_staging) && (_buildDMABatch(asl) > 0))
+            { // continue with the batch without interrupt
+            _dmasettingsDiff[2].TCD->CSR &= ~(DMA_TCD_CSR_INTMAJOR | DMA_TCD_CSR_DREQ);
+            _dmasettingsDiff[2].replaceSettingsOnCompletion(_dmasettingsBatch[0]);
+            }
+        else
+            {
+            _dmasettingsDiff[2].replaceSettingsOnCompletion(_dmasettingsDiff[1]);
+            _dmasettingsDiff[2].interruptAtCompletion();
+            _dmasettingsDiff[2].disableOnCompletion();
+            }
+
+        _dmatx.enable();
+        if (_staging) _stagePrefetch();
+        return;
+        }
+
+
+    int ILI9341Driver::_buildDMABatch(int asl)
+        {
+        // Each additional instruction uses 2 dma settings: 
+        // - the commands: 32 bit words written alternately to TCR and TDR (which are contiguous: the 
+        //   destination address wraps modulo 8 bytes) i.e. [TCR assert, CASET, TCR deassert, x, ...., TCR assert, RAMWR, TCR deassert]
+        //   (omitted for the next line of a rectangle since the RAMWR continues)
+        // - the pixels, identical to _dmasettingsDiff[2]. 
+        // The last one links back to _dmasettingsDiff[1], fires the interrupt and disables the channel, just 
+        // like _dmasettingsDiff[2] does when there is no batch. 
+        int k = 0;
+        int ns = 0; // number of dma settings used
+        DMASetting* prev = nullptr;
+        uint32_t* cmd = _dma_batch_cmd;
+        while (k < _dma_batch - 1)
+            {
+            int x = 0, y = 0, xe = 0, len = 0;
+            bool cont = false;
+            const int r = _readRun(asl, x, y, xe, len, cont); // the scanline can only move forward so any instruction valid now is also valid later. 
+            if (r != 0) break; // the interrupt will take care of it. 
+            if (!cont)
+                {
+                int nw = 0;
+                if ((x != _prev_caset_x) || (xe != _prev_caset_xe))
+                    {
+                    cmd[nw++] = _dma_spi_tcr_assert;
+                    cmd[nw++] = ILI9341_T4_CASET;
+                    cmd[nw++] = _dma_spi_tcr_deassert;
+                    cmd[nw++] = x;
+                    if (xe != _prev_caset_xe)
+                        {
+                        cmd[nw++] = _dma_spi_tcr_deassert;
+                        cmd[nw++] = xe;
+                        }
+                    _prev_caset_x = x;
+                    _prev_caset_xe = xe;
+                    }
+                const int gy = _gramLine(y);
+                if (gy != _prev_paset_y)
+                    {
+                    cmd[nw++] = _dma_spi_tcr_assert;
+                    cmd[nw++] = ILI9341_T4_PASET;
+                    cmd[nw++] = _dma_spi_tcr_deassert;
+                    cmd[nw++] = gy;
+                    _prev_paset_y = gy;
+                    }
+                cmd[nw++] = _dma_spi_tcr_assert;
+                cmd[nw++] = ILI9341_T4_RAMWR;
+                cmd[nw++] = _dma_spi_tcr_deassert;
+
+                DMASetting& dc = _dmasettingsBatch[ns++];
+                dc.sourceBuffer(cmd, 4 * nw);
+                dc.destination(_pimxrt_spi->TCR);
+                dc.TCD->DOFF = 4;
+                dc.TCD->ATTR_DST = (3 << 3) | 2; // DMOD = 3 (address modulo 8 bytes: TCR, TDR, TCR...) and DSIZE = 32 bits 
+                dc.TCD->CSR &= ~(DMA_TCD_CSR_INTMAJOR | DMA_TCD_CSR_DREQ);
+                if (prev) prev->replaceSettingsOnCompletion(dc);
+                prev = &dc;
+                cmd += nw;
+                _stats_nb_transactions++;
+                }
+
+            DMASetting& dp = _dmasettingsBatch[ns++];
+            dp.sourceBuffer(_fb + x + (y * ILI9341_T4_TFTWIDTH), len * 2);
+            dp.destination(_pimxrt_spi->TDR);
+            dp.TCD->ATTR_DST = 1;
+            dp.TCD->CSR &= ~(DMA_TCD_CSR_INTMAJOR | DMA_TCD_CSR_DREQ);
+            if (prev) prev->replaceSettingsOnCompletion(dp);
+            prev = &dp;
+
+            _last_y = _lastLine(x, y, xe, len);
+            _stats_nb_uploaded_pixels += len;
+            ILI9341_T4_TRACE_EVENT(TRACE_DMA_CHUNK, len);
+            k++;
+            }
+        if (k > 0)
+            { // last instruction of the batch
+            prev->replaceSettingsOnCompletion(_dmasettingsDiff[1]);
+            prev->interruptAtCompletion();
+            prev->disableOnCompletion();
+            asm("dsb"); // make sure the descriptors are written before the DMA reads them. 
+            }
+        return k;
+        }
+
+
+    int ILI9341Driver::_readRun(int asl, int& x, int& y, int& xe, int& len, bool& cont)
+        {
+        if (_stage_rem > 0)
+            { // next part of a run split by the size of the staging buffers (the RAMWR simply continues)
+            x = _stage_x;
+            y = _stage_y;
+            xe = _prev_caset_xe;
+            len = (_stage_rem < ILI9341_T4_STAGING_PIXELS) ? _stage_rem : ILI9341_T4_STAGING_PIXELS;
+            _stage_rem -= len;
+            cont = true;
+            }
+        else
+            {
+            const int r = _readRunDiff(asl, x, y, xe, len, cont);
+            if ((r != 0) || (!_staging) || (len <= ILI9341_T4_STAGING_PIXELS)) return r;
+            _stage_rem = len - ILI9341_T4_STAGING_PIXELS;
+            len = ILI9341_T4_STAGING_PIXELS;
+            }
+        if (_stage_rem > 0)
+            { // position of the remaining part
+            const int pos = x + ILI9341_T4_TFTWIDTH * y + len;
+            _stage_x = pos % ILI9341_T4_TFTWIDTH;
+            _stage_y = pos / ILI9341_T4_TFTWIDTH;
+            }
+        return 0;
+        }
+
+
+    const uint16_t* ILI9341Driver::_dmaSource(int x, int y, int len)
+        {
+        const uint16_t* src = _fb + x + (y * ILI9341_T4_TFTWIDTH);
+#if ILI9341_T4_EXTMEM_STAGING
+        if (_staging)
+            { 
+            uint16_t* buf = _stage_buf[_stage_idx];
+            if (!_stage_ready) memcpy(buf, src, 2 * len); // not prefetched: copy it now (inside the interrupt for short runs).
+            _stage_ready = false;
+            if ((uint32_t)buf >= 0x20200000u) arm_dcache_flush(buf, 2 * len); // in case the driver object itself is not in DTCM.
+            asm("dsb");
+            return buf;
+            }
+#endif
+        return src;
+        }
+
+
+    void ILI9341Driver::_stagePrefetch()
+        {
+        _stage_idx ^= 1; // the other buffer is free since the previous transfer is complete. 
+        if (_stage_rem <= 0) return; // the next run is not known yet. 
+#if ILI9341_T4_EXTMEM_STAGING
+        const int len = (_stage_rem < ILI9341_T4_STAGING_PIXELS) ? _stage_rem : ILI9341_T4_STAGING_PIXELS;
+        memcpy(_stage_buf[_stage_idx], _fb + _stage_x + (_stage_y * ILI9341_T4_TFTWIDTH), 2 * len);
+        _stage_ready = true;
+#endif
+        }
+
+
+    int ILI9341Driver::_readRunDiff(int asl, int& x, int& y, int& xe, int& len, bool& cont)
+        {
+        if (_rect_rem > 0)
+            { // next line of the current rectangle
+            x = _rect_x;
+            y = ++_rect_y;
+            xe = _prev_caset_xe;
+            len = (_rect_rem < _rect_w) ? _rect_rem : _rect_w;
+            _rect_rem -= len;
+            cont = (_gramLine(y) != 0); // the commands are sent again when the rectangle wraps around the end of the screen memory (scroll offset)
+            return 0;
+            }
+        cont = false;
+        if (_wrap_rem > 0)
+            { // remaining part of a run split at the end of the screen memory
+            x = 0;
+            y = _wrap_y;
+            len = _wrap_rem;
+            _wrap_rem = 0;
+            xe = (len <= _prev_caset_xe + 1) ? _prev_caset_xe : ILI9341_T4_TFTWIDTH;
+            return 0;
+            }
+        int w = 0;
+        const int r = _diff->readDiffRect(x, y, w, len, asl);
+        if (r != 0) return r;
+        xe = _windowEnd(x, w, len);
+        if (xe != ILI9341_T4_TFTWIDTH)
+            { // rectangle: its lines are not contiguous in the framebuffer so they are sent one at a time.
+            _rect_x = x;
+            _rect_y = y;
+            _rect_w = w;
+            _rect_rem = len - w;
+            len = w;
+            }
+        else 
+            {
+            if (x + len <= _prev_caset_xe + 1)
+                { // fits in the current window: no need to change it.
+                xe = _prev_caset_xe;
+                }
+            if (_scroll_offset != 0)
+                { // the screen memory does not wrap around to line 0 so the run is split at its end.
+                  // (the pixels are contiguous here: rectangles that do not span whole lines took the branch above)
+                const int nblines = ILI9341_T4_TFTHEIGHT - _gramLine(y);
+                const int room = nblines * ILI9341_T4_TFTWIDTH - x;
+                if (len > room)
+                    {
+                    _wrap_y = y + nblines;
+                    _wrap_rem = len - room;
+                    len = room;
+                    }
+                }
+            }
+        return 0;
+        }
+
+
+    void ILI9341Driver::_dmaWriteCommands(int x, int y, int xe)
+        {
         _pimxrt_spi->TCR = _dma_spi_tcr_assert;
-        if (x != _prev_caset_x)
+        if ((x != _prev_caset_x) || (xe != _prev_caset_xe))
             {
             _pimxrt_spi->TDR = ILI9341_T4_CASET;
             _pimxrt_spi->TCR = _dma_spi_tcr_deassert;
             _pimxrt_spi->TDR = x;
+            if (xe != _prev_caset_xe) _pimxrt_spi->TDR = xe;
             _pimxrt_spi->TCR = _dma_spi_tcr_assert;
             _prev_caset_x = x;
+            _prev_caset_xe = xe;
             }
-        if (y != _prev_paset_y)
+        const int gy = _gramLine(y);
+        if (gy != _prev_paset_y)
             {
             _pimxrt_spi->TDR = ILI9341_T4_PASET;
             _pimxrt_spi->TCR = _dma_spi_tcr_deassert;
-            _pimxrt_spi->TDR = y;
+            _pimxrt_spi->TDR = gy;
             _pimxrt_spi->TCR = _dma_spi_tcr_assert;
-            _prev_paset_y = y;
+            _prev_paset_y = gy;
             }
         _pimxrt_spi->TDR = ILI9341_T4_RAMWR;
-
-        _last_y = (ILI9341_T4_TFTWIDTH * y + x + len) / ILI9341_T4_TFTWIDTH;
-        _stats_nb_uploaded_pixels += len;
-
-        _dmasettingsDiff[2].sourceBuffer(_fb + x + (y * ILI9341_T4_TFTWIDTH), len * 2);
-        _dmasettingsDiff[2].destination(_pimxrt_spi->TDR);
-        _dmasettingsDiff[2].TCD->ATTR_DST = 1;
-        _dmasettingsDiff[2].replaceSettingsOnCompletion(_dmasettingsDiff[1]);
-
-        _dmatx.enable();
-        return;
         }
 
 
@@ -1616,6 +2670,177 @@ namespace ILI9341_T4
 
 
 
+    int ILI9341Driver::_readPixels(int x, int y, int nb, uint16_t* dst)
+        {
+        if ((_miso == 0xff) || (nb <= 0) || (dst == nullptr)) return 0;
+        _beginSPITransaction(_spi_clock_read);
+        _writecommand_cont(ILI9341_T4_CASET);
+        _writedata16_cont(x);
+        _writedata16_cont(ILI9341_T4_TFTWIDTH - 1);
+        _writecommand_cont(ILI9341_T4_PASET);
+        _writedata16_cont(y);
+        _writedata16_last(ILI9341_T4_TFTHEIGHT - 1);
+        _endSPITransaction();
+
+        _beginSPITransaction(_spi_clock_read);
+        _pimxrt_spi->CR = LPSPI_CR_MEN | LPSPI_CR_RRF; // flush the receive fifo
+        _maybeUpdateTCR(_tcr_dc_assert | LPSPI_TCR_FRAMESZ(7) | LPSPI_TCR_CONT);
+        _pimxrt_spi->TDR = ILI9341_T4_RAMRD;
+        _maybeUpdateTCR(_tcr_dc_not_assert | LPSPI_TCR_FRAMESZ(7));
+        // we receive: 1 byte (during the command) + 1 dummy byte + 3 bytes (R,G,B on 6 bits) per pixel
+        const int nbytes = 2 + 3 * nb;
+        int nsent = 1, nrecv = 0, k = 0;
+        uint8_t rgb[3] = { 0, 0, 0 };
+        elapsedMillis ems;
+        while ((nrecv < nbytes) && (ems < 100))
+            {
+            if ((nsent < nbytes) && (nsent - nrecv < 12) && (_pimxrt_spi->SR & LPSPI_SR_TDF))
+                { // keep both fifos from overflowing
+                _pimxrt_spi->TDR = 0;
+                nsent++;
+                }
+            if ((_pimxrt_spi->RSR & LPSPI_RSR_RXEMPTY) == 0)
+                {
+                const uint8_t b = _pimxrt_spi->RDR;
+                if (nrecv >= 2)
+                    {
+                    const int c = (nrecv - 2) % 3;
+                    rgb[c] = b;
+                    if (c == 2) dst[k++] = (uint16_t)(((rgb[0] & 0xF8) << 8) | ((rgb[1] & 0xFC) << 3) | (rgb[2] >> 3));
+                    }
+                nrecv++;
+                }
+            }
+        _endSPITransaction();
+        return k;
+        }
+
+
+    bool ILI9341Driver::_checkWriteClock(int spi_clock, int pattern)
+        {
+        uint16_t buf[ILI9341_T4_PROBE_PIXELS];
+        uint32_t rnd = 0x12345678u + pattern;
+        for (int i = 0; i < ILI9341_T4_PROBE_PIXELS; i++)
+            {
+            switch (pattern % 3)
+                {
+                case 0: buf[i] = (i & 1) ? 0xFFFF : 0x0000; break; // all the lines toggle
+                case 1: buf[i] = (i & 1) ? 0xAAAA : 0x5555; break; // every bit toggles
+                default: rnd = rnd * 1664525u + 1013904223u; buf[i] = (uint16_t)(rnd >> 16); break;
+                }
+            }
+        _beginSPITransaction(spi_clock);
+        _writecommand_cont(ILI9341_T4_CASET);
+        _writedata16_cont(0);
+        _writedata16_cont(ILI9341_T4_TFTWIDTH - 1);
+        _writecommand_cont(ILI9341_T4_PASET);
+        _writedata16_cont(0);
+        _writedata16_cont(ILI9341_T4_TFTHEIGHT - 1);
+        _writecommand_cont(ILI9341_T4_RAMWR);
+        for (int i = 0; i < ILI9341_T4_PROBE_PIXELS; i++) _writedata16_cont(buf[i]);
+        _writecommand_last(ILI9341_T4_NOP);
+        _endSPITransaction();
+
+        uint16_t res[ILI9341_T4_PROBE_PIXELS];
+        if (_readPixels(0, 0, ILI9341_T4_PROBE_PIXELS, res) != ILI9341_T4_PROBE_PIXELS) return false;
+        bool ok_rgb = true, ok_bgr = true; // the red and blue channels may be swapped on readback (MADCTL BGR bit)
+        for (int i = 0; i < ILI9341_T4_PROBE_PIXELS; i++)
+            {
+            const uint16_t c = res[i];
+            if (c != buf[i]) ok_rgb = false;
+            if (_swapRedBlue(c) != buf[i]) ok_bgr = false;
+            }
+        return (ok_rgb || ok_bgr);
+        }
+
+
+    void ILI9341Driver::_writePixel(int x, int y, uint16_t color)
+        {
+        _beginSPITransaction(_spi_clock);
+        _writecommand_cont(ILI9341_T4_CASET);
+        _writedata16_cont(x);
+        _writedata16_cont(x);
+        _writecommand_cont(ILI9341_T4_PASET);
+        _writedata16_cont(y);
+        _writedata16_cont(y);
+        _writecommand_cont(ILI9341_T4_RAMWR);
+        _writedata16_cont(color);
+        _writecommand_last(ILI9341_T4_NOP);
+        _endSPITransaction();
+        }
+
+
+    int ILI9341Driver::_readbackOrder()
+        {
+        const int y = _gramLine(0);
+        uint16_t old, c;
+        if (_readPixels(0, y, 1, &old) != 1) return -1;
+        _writePixel(0, y, 0xF800); // pure red
+        if (_readPixels(0, y, 1, &c) != 1) return -1;
+        const int order = (c == 0xF800) ? 0 : ((c == 0x001F) ? 1 : -1);
+        if (order >= 0) _writePixel(0, y, (order == 1) ? _swapRedBlue(old) : old); // restore the pixel
+        return order;
+        }
+
+
+    FLASHMEM void ILI9341Driver::_restoreRegisters()
+        {
+        _beginSPITransaction(_spi_clock / 4); // quarter speed for setup ! 
+        const uint8_t* addr = ILI9341_T4_init_commands;
+        while (1)
+            {
+            uint8_t count = *addr++;
+            if (count-- == 0) break;
+            _writecommand_cont(*addr++);
+            while (count-- > 0) { _writedata8_cont(*addr++); }
+            }
+        _writecommand_cont(_inverted ? ILI9341_T4_INVON : ILI9341_T4_INVOFF);
+        _writecommand_cont(ILI9341_T4_NORON);
+        _writecommand_last(ILI9341_T4_SLPOUT); // Exit Sleep (in case SLPIN was received)
+        _endSPITransaction();
+        delay(150); // must wait for the screen to exit sleep mode. 
+        _beginSPITransaction(_spi_clock / 4);
+        _writecommand_last(ILI9341_T4_DISPON); // Display on
+        _endSPITransaction();
+        _sendRefreshMode(_idle_slow ? _idle_mode : _refreshmode);
+        if (_te_pin != 255)
+            {
+            _beginSPITransaction(_spi_clock / 4);
+            _writecommand_cont(ILI9341_T4_TEON);
+            _writedata8_last(0x00); // V-blanking information only 
+            _endSPITransaction();
+            }
+        _scroll_send = true; // the scroll offset may have been changed too
+        _sendScroll();
+        }
+
+
+    int ILI9341Driver::probeSpiClock(int min_clock, int max_clock)
+        {
+        if (_miso == 0xff) return 0;
+        waitUpdateAsyncComplete();
+        _print("\nProbing the SPI write speed...\n");
+        int best = 0;
+        for (int clock = min_clock; clock <= max_clock; clock += ILI9341_T4_PROBE_SPICLOCK_STEP)
+            {
+            bool ok = true;
+            for (int p = 0; (ok) && (p < 6); p++) ok = _checkWriteClock(clock, p);
+            _printf("- %.2fMhz : %s\n", clock / 1000000.0f, (ok ? "OK" : "FAILED"));
+            if (!ok)
+                { // a command byte may have been corrupted at this speed: set the registers again. 
+                _restoreRegisters();
+                break;
+                }
+            best = clock;
+            }
+        _printf("Highest reliable SPI write speed : %.2fMhz\n\n", best / 1000000.0f);
+        _mirrorfb = nullptr; // the test patterns were drawn on the screen: redraw everything.
+        _ongoingDiff = nullptr;
+        resync();
+        return best;
+        }
+
+
     void ILI9341Driver::_waitFifoNotFull()
         {
         uint32_t tmp __attribute__((unused));
@@ -1660,11 +2885,13 @@ namespace ILI9341_T4
         _stats_elapsed_total = 0;       
         _statsvar_cputime.reset();
         _statsvar_uploadtime.reset();
+        _statsvar_frametime.reset();
         _statsvar_uploaded_pixels.reset(); 
         _statsvar_transactions.reset();
         _statsvar_margin.reset(); 
         _statsvar_vsyncspacing.reset();
         _nbteared = 0;       
+        _stats_nb_scrolled = 0;
         }
 
 
@@ -1697,6 +2924,10 @@ namespace ILI9341_T4
             _print(" (VSYNC DISABLED).\n");
         else         
             _print(" (VSYNC ENABLED).\n");
+        if (_pacing_fps > 0.0f)
+            _printf("- frame pacing       : target %.1f FPS (late start ratio %.2f)\n", _pacing_fps, _late_start_ratio);
+        if (_idle_frames > 0)
+            _printf("- low-power refresh  : mode %i after %i idle frames (%s, %i idle frames)\n", _idle_mode, _idle_frames, _idle_slow ? "IDLE" : "ACTIVE", _idle_count);
 
         _print("- requested FPS      : ");        
         if (_vsync_spacing == -1)
@@ -1716,7 +2947,10 @@ namespace ILI9341_T4
                 {
                 _print("- diff. updates      : ENABLED - 1 diff buffer.\n");
                 }
-            _printf("- diff [gap]         : %u\n", _diff_gap);
+            if (_diff_gap_auto)
+                _printf("- diff [gap]         : %u (auto, transaction ~ %.1f pixels)\n", _diff_gap, _autogap_cost);
+            else
+                _printf("- diff [gap]         : %u\n", _diff_gap);
             if (_compare_mask == 0)
                 {
                 _print("- diff [compare_mask]: STRICT COMPARISON.");
@@ -1730,6 +2964,8 @@ namespace ILI9341_T4
                 _print(" B=");
                 for (int i = 4; i >= 0; i--) { _print(bitRead(_compare_mask, i) ? '1' : '0'); }
                 }
+            if (diffPerceptualActive())
+                _printf("\n- diff [perceptual]  : R<=%i G<=%i B<=%i (exact sweep in %i frames)", _perc_r, _perc_g, _perc_b, _perc_frames);
             }
         else
             {
@@ -1747,8 +2983,11 @@ namespace ILI9341_T4
             _printf("- upload rate        : %.1f FPS\n", 1000000.0f / _statsvar_uploadtime.avg());
         _print("- upload time / frame: "); _statsvar_uploadtime.print("us", "\n",_outputStream);
         _print("- CPU time / frame   : "); _statsvar_cputime.print("us", "\n",_outputStream);
+        _print("- time between frames: "); _statsvar_frametime.print("us", "\n",_outputStream);
         _print("- pixels / frame     : "); _statsvar_uploaded_pixels.print("", "\n",_outputStream);
         _print("- transact. / frame  : "); _statsvar_transactions.print("", "\n",_outputStream);
+        if (_scroll_detect)
+            _printf("- scrolled frames    : %u\n", _stats_nb_scrolled);
         if (_vsync_spacing > 0)
             {            
             _printf("- teared frames      : %u (%.1f%%)\n", statsNbTeared(), 100*statsRatioTeared());
@@ -1760,8 +2999,20 @@ namespace ILI9341_T4
 
 
 
+    void ILI9341Driver::_notifyFrameDone()
+        {
+        _frame_counter++;
+        FrameCallback cb = _framecomplete_cb;
+        if (cb) cb(_framecomplete_obj);
+        if (_fb2full) return; // a frame is still pending: no buffer released yet.
+        cb = _bufferreleased_cb;
+        if (cb) cb(_bufferreleased_obj);
+        }
+
+
     void ILI9341Driver::_endframe()
         {
+        ILI9341_T4_TRACE_EVENT(TRACE_FRAME_END, _stats_nb_transactions);
         _stats_nb_frame++;
 
         _stats_cputime += _stats_elapsed_cputime;
@@ -1770,16 +3021,25 @@ namespace ILI9341_T4
         _stats_uploadtime += _stats_elapsed_uploadtime;
         _statsvar_uploadtime.push(_stats_uploadtime);
 
+        if (_stats_nb_frame > 1) _statsvar_frametime.push(_stats_elapsed_frametime);
+        _stats_elapsed_frametime = 0;
+
         _statsvar_uploaded_pixels.push(_stats_nb_uploaded_pixels);
 
         _statsvar_transactions.push(_stats_nb_transactions);
 
+        if (_diff_gap_auto) _autoGapPush();
+
+        _idlePush();
+
         if (_vsync_spacing > 0)
             {
             if (_statsvar_margin.count() > 0) _statsvar_vsyncspacing.push(_last_delta);
 
             if (_margin < 0) _nbteared++;
 
+            if (_pacing_fps > 0.0f) _pacingPush();
+
             _statsvar_margin.push(_margin);
             }
         }
@@ -1791,6 +3051,140 @@ namespace ILI9341_T4
 
 
 
+    void ILI9341Driver::_autoGapPush()
+        {
+        if (_stats_nb_transactions == 0) return; // nothing uploaded: no information. 
+        // rescale to keep the sums well conditioned in single precision.
+        const float p = _stats_nb_uploaded_pixels / 1024.0f;
+        const float q = _stats_nb_transactions / 64.0f;
+        const float y = _stats_uploadtime / 1024.0f;
+        const float v[9] = { 1.0f, p, q, p * p, p * q, q * q, y, p * y, q * y };
+        for (int i = 0; i < 9; i++) _autogap_s[i] = ILI9341_T4_AUTO_DIFF_GAP_DECAY * _autogap_s[i] + v[i];
+        }
+
+
+    void ILI9341Driver::_autoGapUpdate()
+        {
+        float S[9];
+        noInterrupts();
+        for (int i = 0; i < 9; i++) S[i] = _autogap_s[i];
+        interrupts();
+
+        int target = _diff_gap;
+        if (S[0] >= 3.0f)
+            { // least square fit of the upload time with a weak prior given by the SPI clock and ILI9341_T4_TRANSACTION_DURATION.
+            const float a0 = 16.0e6f / _spi_clock;             // us per pixel (same in rescaled units)
+            const float b0 = a0 * ILI9341_T4_TRANSACTION_DURATION / 16.0f; // us per transaction (in rescaled units)
+            const float lambda = 1.0f;
+            const float m00 = S[0], m01 = S[1], m02 = S[2];
+            const float m11 = S[3] + lambda, m12 = S[4], m22 = S[5] + lambda;
+            const float r0 = S[6], r1 = S[7] + lambda * a0, r2 = S[8] + lambda * b0;
+            const float c00 = m11 * m22 - m12 * m12;
+            const float c01 = m02 * m12 - m01 * m22;
+            const float c02 = m01 * m12 - m02 * m11;
+            const float det = m00 * c00 + m01 * c01 + m02 * c02;
+            if (det > 0.0f)
+                {
+                const float a = (c01 * r0 + (m00 * m22 - m02 * m02) * r1 + (m01 * m02 - m00 * m12) * r2) / det; // us per pixel
+                const float b = (c02 * r0 + (m01 * m02 - m00 * m12) * r1 + (m00 * m11 - m01 * m01) * r2) / det * 16.0f; // us per transaction
+                if (a > 0.0f)
+                    {
+                    _autogap_cost = (b > 0.0f) ? (b / a) : 0.0f;
+                    // breaking a transaction is worth it when the run of identical pixels costs more than a new transaction.
+                    target = (_autogap_cost < ILI9341_T4_AUTO_DIFF_GAP_MAX) ? ((int)_autogap_cost + 1) : ILI9341_T4_AUTO_DIFF_GAP_MAX;
+                    }
+                }
+            }
+
+        // smaller gaps mean larger diffs: back off when the diff buffers are (almost) full.
+        float fill = 0.0f;
+        if (_diff1) fill = _diff1->fillRatio();
+        if ((_diff2) && (_diff2->fillRatio() > fill)) fill = _diff2->fillRatio();
+        if (fill >= 1.0f)
+            { // overflow: increase the gap fast. 
+            _autogap_floor = ILI9341Driver::_clip<int>(((_diff_gap > _autogap_floor) ? _diff_gap : _autogap_floor) * 3 / 2 + 1, 1, ILI9341_T4_AUTO_DIFF_GAP_MAX);
+            _autogap_calm = 0;
+            }
+        else if (fill > 0.9f)
+            { // close to overflow: do not go lower.
+            if (_autogap_floor < _diff_gap) _autogap_floor = _diff_gap;
+            _autogap_calm = 0;
+            }
+        else if ((fill < 0.7f) && (++_autogap_calm >= 30))
+            { // no overflow for a while: relax the constraint. 
+            if (_autogap_floor > 1) _autogap_floor--;
+            _autogap_calm = 0;
+            }
+        if (target < _autogap_floor) target = _autogap_floor;
+        target = ILI9341Driver::_clip<int>(target, 1, ILI9341_T4_AUTO_DIFF_GAP_MAX);
+
+        // increase immediately but decrease slowly to avoid oscillations. 
+        _diff_gap = (target >= _diff_gap) ? target : (_diff_gap - 1);
+        }
+
+
+    void ILI9341Driver::setFramePacing(float target_fps)
+        {
+        waitUpdateAsyncComplete();
+        _pacing_fps = (target_fps > 0.0f) ? target_fps : 0.0f;
+        if (_pacing_fps > 0.0f)
+            {
+            const float rr = getRefreshRate();
+            _vsync_spacing = (rr > 0.0f) ? ILI9341Driver::_clip<int>((int)roundf(rr / _pacing_fps), 1, ILI9341_T4_MAX_VSYNC_SPACING) : ILI9341_T4_DEFAULT_VSYNC_SPACING;
+            _late_start_ratio = ILI9341_T4_DEFAULT_LATE_START_RATIO;
+            }
+        _pacingReset();
+        statsReset();
+        resync();
+        }
+
+
+    void ILI9341Driver::_pacingUpdate()
+        {
+        if (_pacing_frames < ILI9341_T4_PACING_WINDOW) return; // not enough frames observed yet.
+        noInterrupts();
+        const int frames = _pacing_frames;
+        const int late = _pacing_late;
+        const int teared = _pacing_teared;
+        _pacing_frames = _pacing_late = _pacing_teared = 0;
+        interrupts();
+
+        const float rr = getRefreshRate();
+        if (rr <= 0.0f) return;
+        const int minspacing = ILI9341Driver::_clip<int>((int)roundf(rr / _pacing_fps), 1, ILI9341_T4_MAX_VSYNC_SPACING); // lowest latency
+        int spacing = (_vsync_spacing < minspacing) ? minspacing : _vsync_spacing;
+        float ratio = _late_start_ratio;
+        if (8 * teared > frames)
+            { // tearing: start less late and then, give more time to each frame. 
+            _pacing_calm = 0;
+            if (ratio > 0.15f) ratio = ILI9341Driver::_clip<float>(ratio - 0.1f, 0.1f, 0.9f);
+            else spacing++;
+            }
+        else if (4 * late > frames)
+            { // the frames are not ready in time: lower the framerate to keep it regular. 
+            _pacing_calm = 0;
+            spacing++;
+            }
+        else if ((late == 0) && (teared == 0) && (++_pacing_calm >= ILI9341_T4_PACING_CALM))
+            { // good for a while: go back towards the default late start and the target framerate. 
+            _pacing_calm = 0;
+            if (ratio < ILI9341_T4_DEFAULT_LATE_START_RATIO - 0.05f) ratio = ratio + 0.1f;
+            else if (spacing > minspacing) spacing--;
+            }
+        spacing = ILI9341Driver::_clip<int>(spacing, minspacing, ILI9341_T4_MAX_VSYNC_SPACING);
+        if ((spacing != _vsync_spacing) || (ratio != _late_start_ratio))
+            { // both values are read by the interrupt: only change them once the current upload is done. 
+            waitUpdateAsyncComplete();
+            _late_start_ratio = ratio;
+            if (spacing != _vsync_spacing)
+                {
+                _vsync_spacing = spacing;
+                resync();
+                }
+            }
+        }
+
+
     /**********************************************************************************************************
     * Touch
     ***********************************************************************************************************/
@@ -1809,6 +3203,8 @@ namespace ILI9341_T4
         _touched = true;;
         _touched_read = true;
         _touch_x = _touch_y = _touch_z = 0;
+        _touch_qhead = _touch_qtail = 0;
+        _touch_qdown = false;
 
         bool slotfound = false;
         if ((_touch_irq >= 0) && (_touch_irq < 42)) // valid digital pin
@@ -1833,6 +3229,7 @@ namespace ILI9341_T4
 
     void ILI9341Driver::_updateTouch2()
         {
+        ILI9341_T4_TRACE_EVENT(TRACE_TOUCH_READ, 0);
         int16_t data[6];
         int z;
         _pspi->beginTransaction(SPISettings(_spi_clock_read, MSBFIRST, SPI_MODE0));
@@ -1862,6 +3259,7 @@ namespace ILI9341_T4
         if (z < _touch_z_threshold)
             {
             _touch_z = 0;
+            if (_touch_qdown) _pushTouch(_touch_x, _touch_y, 0); // release
             if (z < ILI9341_T4_TOUCH_Z_THRESHOLD_INT)
                 {
                 if (_touch_irq != 255) _touched_read = false;
@@ -1876,6 +3274,7 @@ namespace ILI9341_T4
         _touch_y = y;
         _touch_z = z;
         _em_touched_read = 0; // good read completed, set wait
+        _pushTouch(x, y, z);
         }
 
 
@@ -1884,13 +3283,13 @@ namespace ILI9341_T4
         if (_em_touched_read < ILI9341_T4_TOUCH_MSEC_THRESHOLD) return; // read not so long ago
         if ((_touch_irq != 255) && (_touched_read == false)) return; // nothing to do. 
         if (asyncUpdateActive())
-            {
-            _touch_request_read = true; // request read at end of transfer
-            while ((_touch_request_read) && (asyncUpdateActive())); // wait until transfer complete or reading done. 
-            if (!_touch_request_read) return; // reading was done, nothing to do. 
-            _touch_request_read = false; // remove request. 
+            { // the bus is in use: read at the end of the transfer (from the interrupt) and keep the last value meanwhile.
+            _touch_request_read = true;
+            if (asyncUpdateActive()) return; 
+            // the transfer just completed and may have missed the request
             }
         // we can do the reading now
+        _touch_request_read = false; // remove request. 
         _updateTouch2();
         return;
         }
@@ -1902,10 +3301,39 @@ namespace ILI9341_T4
         _updateTouch();
         if (_touch_z < _touch_z_threshold) return false;
         z = _touch_z;
+        _mapTouch(_touch_x, _touch_y, x, y);
+        return true;
+        }
+
+
+    int ILI9341Driver::touchAvailable()
+        {
+        _updateTouch();
+        return (int)(_touch_qhead - _touch_qtail);
+        }
+
+
+    bool ILI9341Driver::popTouch(int& x, int& y, int& z, uint32_t& ms)
+        {
+        const uint32_t t = _touch_qtail;
+        if (t == _touch_qhead) return false; // empty
+        asm volatile("dmb" ::: "memory"); // read the sample after its publication
+        const TouchSample& ts = _touch_queue[t & (ILI9341_T4_TOUCH_QUEUE_SIZE - 1)];
+        _mapTouch(ts.x, ts.y, x, y);
+        z = ts.z;
+        ms = ts.ms;
+        asm volatile("dmb" ::: "memory"); // sample read before the slot is released
+        _touch_qtail = t + 1;
+        return true;
+        }
+
+
+    void ILI9341Driver::_mapTouch(int rx, int ry, int& x, int& y)
+        {
         if (_touch_has_calibration)
             { // coord in orientation 0. 
-            int xx  = _mapTouchX(_touch_x, _touch_calib[0], _touch_calib[1]);
-            int yy = _mapTouchY(_touch_y, _touch_calib[2], _touch_calib[3]); 
+            int xx  = _mapTouchX(rx, _touch_calib[0], _touch_calib[1]);
+            int yy = _mapTouchY(ry, _touch_calib[2], _touch_calib[3]); 
             switch (_rotation)
                 {
             case 0:
@@ -1928,10 +3356,9 @@ namespace ILI9341_T4
             }
         else
             { // raw values
-            x = _touch_x;
-            y = _touch_y;
+            x = rx;
+            y = ry;
             }
-        return true;
         }
 
 
@@ -38,6 +38,9 @@
 
 #include "StatsVar.h"
 #include "DiffBuff.h"
+#include "DirtyMap.h"
+#include "DiffBuffRect.h"
+#include "TraceBuffer.h"
 
 #include <Arduino.h>
 #include <DMAChannel.h>
@@ -60,17 +63,32 @@ namespace ILI9341_T4
 
 #define ILI9341_T4_DEFAULT_SPICLOCK 30000000         // default SPI write speed, some display can work up to 80Mhz...
 #define ILI9341_T4_DEFAULT_SPICLOCK_READ 4000000     // default SPI read speed (much slower then write speed)
+#define ILI9341_T4_PROBE_SPICLOCK_MAX 100000000     // maximum SPI write speed tested by probeSpiClock()
+#define ILI9341_T4_PROBE_SPICLOCK_STEP 5000000      // increment between the SPI write speeds tested by probeSpiClock()
+#define ILI9341_T4_PROBE_PIXELS 480                 // number of pixels written and read back for each test of probeSpiClock()
 
 #define ILI9341_T4_DEFAULT_VSYNC_SPACING 2           // vsync on with framerate = refreshrate/2 = 45FPS. 
 #define ILI9341_T4_DEFAULT_DIFF_GAP 6                // default gap for diffs (typ. between 4 and 50)
 #define ILI9341_T4_DEFAULT_LATE_START_RATIO 0.3f     // default "proportion" of the frame admissible for late frame start when using vsync. 
 
 #define ILI9341_T4_TRANSACTION_DURATION 3           // number of pixels that could be uploaded during a typical CASET/PASET/RAWR sequence. 
+#define ILI9341_T4_AUTO_DIFF_GAP 0                  // value passed to setDiffGap() to enable automatic tuning of the gap.
+#define ILI9341_T4_AUTO_DIFF_GAP_MAX 40             // maximum gap selected in automatic mode.
+#define ILI9341_T4_AUTO_DIFF_GAP_DECAY 0.95f        // forgetting factor for the transaction cost estimation (per frame).
+#define ILI9341_T4_PACING_WINDOW 16                 // number of frames observed by the frame pacing controller before each adjustment.
+#define ILI9341_T4_PACING_CALM 4                    // number of good windows before the frame pacing controller tries a lower vsync_spacing.
 #define ILI9341_T4_RETRY_INIT 5                     // number of times we try initialization in begin() before returning an error. 
 #define ILI9341_T4_TFTWIDTH 240                     // screen dimension x (in default orientation 0)
 #define ILI9341_T4_TFTHEIGHT 320                    // screen dimension y (in default orientation 0)
 #define ILI9341_T4_NB_SCANLINES ILI9341_T4_TFTHEIGHT// scanlines are mapped to the screen height
 #define ILI9341_T4_MIN_WAIT_TIME  300               // minimum waiting time (in us) before drawing again when catching up with the scanline
+#define ILI9341_T4_DMA_BATCH_MAX 8                  // maximum number of diff instructions chained in a single DMA transfer (see setDMABatch()).
+#define ILI9341_T4_EXTMEM_STAGING 0                 // set to 1 to upload framebuffers located in EXTMEM through 2 staging buffers (adds 4*ILI9341_T4_STAGING_PIXELS bytes to the object).
+#define ILI9341_T4_STAGING_PIXELS 480               // size (in pixels) of each of the 2 staging buffers used when the internal framebuffer is in EXTMEM.
+#define ILI9341_T4_SCROLL_MIN_GAIN 16              // minimum number of lines saved for using the hardware scroll (see setScrollDetection()).
+#define ILI9341_T4_TRACE 0                          // set to 1 to record a timeline of the uploads (see printTrace()). 
+#define ILI9341_T4_TRACE_SIZE 512                   // number of events kept in the trace (power of 2). 
+#define ILI9341_T4_STREAM_WAIT_TIME 20              // waiting time (in us) before reading a streamed diff again when it catches up with the diff computation
 
 #define ILI9341_T4_NB_PIXELS (ILI9341_T4_TFTWIDTH * ILI9341_T4_TFTHEIGHT)   // total number of pixels
 
@@ -81,6 +99,7 @@ namespace ILI9341_T4
 #define ILI9341_T4_TOUCH_Z_THRESHOLD     400        // for touch
 #define ILI9341_T4_TOUCH_Z_THRESHOLD_INT 75         // same as https://github.com/PaulStoffregen/XPT2046_Touchscreen/blob/master/XPT2046_Touchscreen.cpp
 #define ILI9341_T4_TOUCH_MSEC_THRESHOLD  3          //
+#define ILI9341_T4_TOUCH_QUEUE_SIZE      16         // number of touch samples kept in the touch queue (power of 2)
 
 #define ILI9341_T4_SELFDIAG_OK 0xC0                 // value returned by selfDiagStatus() if everything is OK.
 
@@ -116,6 +135,8 @@ namespace ILI9341_T4
 #define ILI9341_T4_RAMRD 0x2E
 
 #define ILI9341_T4_PTLAR 0x30
+#define ILI9341_T4_TEOFF 0x34
+#define ILI9341_T4_TEON 0x35
 #define ILI9341_T4_MADCTL 0x36
 #define ILI9341_T4_VSCRSADD 0x37
 #define ILI9341_T4_PIXFMT 0x3A
@@ -309,6 +330,27 @@ public:
     inline int  getSpiClockRead() const { return _spi_clock_read; }
 
 
+    /**
+    * Find the highest SPI write speed that works reliably with the current wiring. 
+    * 
+    * Test patterns are written at increasing speeds (from min_clock to max_clock, by steps of 
+    * ILI9341_T4_PROBE_SPICLOCK_STEP) and read back from the screen memory (at the SPI read 
+    * speed). The method stops at the first speed where the readback does not match and returns 
+    * the last speed that passed all the tests (or 0 if min_clock already fails or if MISO is not 
+    * connected). 
+    * 
+    * The write speed is not changed: call setSpiClock() with the returned value (possibly with 
+    * some margin) and save it to skip the probing on the next start. 
+    * 
+    * NOTE: The content of the screen is overwritten (the next frame is fully redrawn). A bad read 
+    *       speed makes every test fail: decrease it with setSpiClockRead() in this case. 
+    *       At a failing speed, the commands may also be received corrupted: after the first 
+    *       failure, the configuration registers are sent again at a safe speed (this takes 
+    *       about 150ms). 
+    **/
+    int probeSpiClock(int min_clock = ILI9341_T4_DEFAULT_SPICLOCK, int max_clock = ILI9341_T4_PROBE_SPICLOCK_MAX);
+
+
 
     /***************************************************************************************************
     ****************************************************************************************************
@@ -386,7 +428,9 @@ public:
     * tearing -> Use this orientation whenever possible. The second best choice is orientation 2. the
     * landscape modes 1 and 3 will perform (equally) less efficiently. 
     * 
-    * Remark: calling this method reset the statistics (provided the orientation changes). 
+    * Remark: calling this method reset the statistics (provided the orientation changes). The
+    *         internal framebuffer still mirrors the screen after the change so the next update
+    *         remains a differential update. 
     **/
     void setRotation(uint8_t r);
 
@@ -553,6 +597,7 @@ public:
         {
         waitUpdateAsyncComplete();
         _vsync_spacing = ILI9341Driver::_clip<int>((int)vsync_spacing, (int)-1, (int)ILI9341_T4_MAX_VSYNC_SPACING);
+        _pacing_fps = 0.0f; // manual setting: stop frame pacing. 
         statsReset();
         resync();
         }
@@ -581,6 +626,7 @@ public:
         {
         waitUpdateAsyncComplete(); // no need to wait for sync. 
         _late_start_ratio = ILI9341Driver::_clip<float>(ratio, 0.1f, 0.9f);
+        _pacing_fps = 0.0f; // manual setting: stop frame pacing. 
         statsReset();
         resync();
         }
@@ -603,6 +649,93 @@ public:
     float getLateStartRatio() const { return _late_start_ratio; }
 
 
+    /**
+    * Enable frame pacing with a target framerate (or disable it with target_fps = 0, the default). 
+    * 
+    * Instead of the static vsync_spacing and late start ratio parameters, the driver observes 
+    * the frames (by windows of ILI9341_T4_PACING_WINDOW frames) and adjusts them on the fly:
+    * 
+    * - vsync_spacing starts at refresh_rate / target_fps (rounded) which is the lowest value 
+    *   allowed, i.e. the lowest latency. 
+    * - When frames tear (the upload is caught by the refresh scanline), the late start ratio is 
+    *   lowered first and vsync_spacing is increased if it was already at its minimum.
+    * - When frames are late (they are not produced in time for their vsync_spacing), 
+    *   vsync_spacing is increased so that the framerate stays regular.
+    * - After ILI9341_T4_PACING_CALM windows without late nor teared frames, the late start ratio
+    *   is restored and vsync_spacing is decreased back towards the target. 
+    *   
+    * Calling setVSyncSpacing() or setLateStartRatio() disables frame pacing. 
+    * 
+    * NOTE: the new values are applied at the start of an update, after the previous upload 
+    *       completed (so an update that changes them waits for the ongoing transfer). 
+    * 
+    * Remark: calling this method reset the statistics.
+    **/
+    void setFramePacing(float target_fps = 0.0f);
+
+
+    /**
+    * Return the target framerate of the frame pacing (0 if frame pacing is disabled).
+    **/
+    float getFramePacing() const { return _pacing_fps; }
+
+
+    /**
+    * Enable the automatic low-power refresh mode (or disable it with idle_frames = 0, the default). 
+    * 
+    * A frame is idle when nothing changed on the screen: either the dirty map (if set) is empty 
+    * so update() returns immediately without comparing the framebuffers, or the diff computed 
+    * was empty. After idle_frames consecutive idle frames, the panel is switched to the (slow) 
+    * refresh mode idle_mode and the normal refresh mode is restored on the next real change. 
+    * Frames skipped with an empty dirty map still trigger the frame complete and buffer released
+    * callbacks, as if they had been uploaded. 
+    * 
+    * - With a dirty map, the normal mode is restored before the changed frame is uploaded. 
+    * - Without a dirty map, the change is only known once the diff was uploaded, so that 
+    *   this first frame is displayed at the slow refresh rate. 
+    * 
+    * NOTE: the refresh rate of idle_mode is measured the first time it is entered (which blocks
+    * for a few frames) and getRefreshRate() returns the slow refresh rate while the panel is idle.
+    * getRefreshMode() always returns the normal mode. 
+    **/
+    void setIdleRefreshMode(int idle_frames = 0, int idle_mode = 31);
+
+
+    /**
+    * Return the number of consecutive idle frames before switching to the low-power refresh 
+    * mode (0 if the low-power mode is disabled).
+    **/
+    int getIdleRefreshFrames() const { return _idle_frames; }
+
+
+    /**
+    * Return true if the panel is currently in the low-power refresh mode. 
+    **/
+    bool isIdle() const { return _idle_slow; }
+
+
+    /**
+    * Set the pin connected to the TE (tearing effect) output of the display, or 255 if the 
+    * TE output is not wired (default). 
+    *
+    * When set, the display is asked to pulse the TE line at the start of each vertical blanking 
+    * and the driver synchronizes with the refresh on this interrupt instead of reading the 
+    * scanline through SPI. This frees the bus from the RDSCANLINE transactions issued before each 
+    * vsynced frame and makes measuring the refresh rate (in begin() and setRefreshMode()) much 
+    * faster. 
+    *
+    * The method can be called before or after begin(). If no pulse is received on the pin, 
+    * the driver falls back to scanline polling. 
+    **/
+    void setTearingEffectPin(uint8_t te_pin = 255);
+
+
+    /**
+    * Return the tearing effect pin (255 if not used). 
+    **/
+    int getTearingEffectPin() const { return _te_pin; }
+
+
 
 
     /***************************************************************************************************
@@ -638,6 +771,22 @@ public:
     void setFramebuffers(uint16_t* fb1 = nullptr, uint16_t * fb2 = nullptr);
 
 
+    /**
+    * Read the screen memory back (via MISO) into the internal framebuffer so that it mirrors 
+    * the screen again. Without this, the first update after begin() or setFramebuffers() is a 
+    * full redraw.
+    * 
+    * Return false if there is no internal framebuffer, if MISO is not connected or if the 
+    * readback failed (the next update is then a full redraw, as usual). The channel order of 
+    * the readback (RGB or BGR) is detected first by writing a known color on the first pixel
+    * and reading it back (the pixel is restored afterward). 
+    * 
+    * NOTE: Reading is done at the SPI read speed and takes about 0.5 second at 4Mhz, but it
+    *       does not change anything on the screen. 
+    **/
+    bool restoreMirror();
+
+
 
     /** Buffering mode*/
     enum
@@ -748,12 +897,21 @@ public:
     * 
     * Try gap = 4 if you can afford diff buffers with large memory (up to 15K of memory). 
     *
+    * Setting gap = ILI9341_T4_AUTO_DIFF_GAP (=0) enables automatic tuning: the driver measures the 
+    * real cost of a transaction (w.r.t. the cost of a pixel) at the current SPI speed by fitting 
+    * the upload time of the last frames against their number of pixels and transactions. The gap 
+    * is then adjusted frame by frame to match this cost, which minimizes the total upload time. 
+    * The gap is also increased whenever a diff buffer overflows (or is almost full) so that the 
+    * driver does not fall back to trivial diffs. 
+    *
     * Remark: calling this method reset the statistics.
     **/
     void setDiffGap(int gap = ILI9341_T4_DEFAULT_DIFF_GAP)
         {
         waitUpdateAsyncComplete();
-        _diff_gap = ILI9341Driver::_clip<int>((int)gap,(int)1,(int)ILI9341_T4_NB_PIXELS);
+        _diff_gap_auto = (gap == ILI9341_T4_AUTO_DIFF_GAP);
+        _diff_gap = (_diff_gap_auto) ? ILI9341_T4_DEFAULT_DIFF_GAP : ILI9341Driver::_clip<int>((int)gap,(int)1,(int)ILI9341_T4_NB_PIXELS);
+        _autoGapReset();
         statsReset();
         resync();
         }
@@ -761,10 +919,130 @@ public:
 
     /**
     * Return the current gap used for creating diffs. 
+    * (in automatic mode, this is the value selected for the next diff). 
     **/
     int getDiffGap() const { return _diff_gap; }
 
 
+    /**
+    * Return true if the gap is tuned automatically (see setDiffGap()).
+    **/
+    bool diffGapAuto() const { return _diff_gap_auto; }
+
+
+    /**
+    * Return the estimated cost of a transaction, expressed as a number of pixels uploaded. 
+    * (only meaningful in automatic gap mode, return -1 if no estimate is available yet).
+    **/
+    float diffGapTransactionCost() const { return _autogap_cost; }
+
+
+    /**
+    * Enable/disable diff streaming. 
+    * 
+    * When enabled (band_lines > 0) and no upload is in progress, the diff is computed by bands of 
+    * 'band_lines' lines and the upload starts as soon as the first instruction is ready instead of 
+    * waiting for the whole diff. The DMA then pushes the pixels of a band while the next ones are 
+    * still being diffed so the latency between update() and the first pixel sent is reduced to the 
+    * time needed to diff a single band. This makes a single diff buffer almost as effective as two. 
+    * 
+    * A value around 40 lines is a good choice. Call without argument to disable streaming 
+    * (default). Only used with diff buffers of the DiffBuff class. 
+    **/
+    void setDiffStreaming(int band_lines = 0)
+        {
+        waitUpdateAsyncComplete();
+        _stream_band_lines = ILI9341Driver::_clip<int>(band_lines, 0, ILI9341_T4_TFTHEIGHT);
+        }
+
+
+    /**
+    * Return the number of lines per band when streaming diffs (0 if disabled). 
+    **/
+    int getDiffStreaming() const { return _stream_band_lines; }
+
+
+    /**
+    * Set the maximum number of diff instructions uploaded by a single DMA transfer. 
+    * 
+    * With nb = 1 (default), the DMA interrupt fires after each instruction of the diff (i.e. each 
+    * run of pixels to write) and the CPU sends the CASET/PASET/RAMWR commands for the next one. 
+    * With nb > 1, the interrupt translates up to nb instructions at once into a chain of DMA 
+    * descriptors that includes the commands so the eDMA engine runs several writes back-to-back 
+    * and the interrupt only fires once per batch (or when waiting for the scanline). This reduces 
+    * the CPU load when diffs are very fragmented. 
+    * 
+    * nb is clamped to [1, ILI9341_T4_DMA_BATCH_MAX]. 
+    **/
+    void setDMABatch(int nb = 1)
+        {
+        waitUpdateAsyncComplete();
+        _dma_batch = ILI9341Driver::_clip<int>(nb, 1, ILI9341_T4_DMA_BATCH_MAX);
+        }
+
+
+    /**
+    * Return the maximum number of diff instructions uploaded by a single DMA transfer.
+    **/
+    int getDMABatch() const { return _dma_batch; }
+
+
+    /**
+    * Enable/disable the line signatures (disabled by default). 
+    * 
+    * When enabled, the diff computation also stores a signature (hash) of each line of the 
+    * framebuffer mirroring the screen, and the lines of the next frame whose signature did not 
+    * change are skipped without comparing their pixels. This is faster for mostly static 
+    * frames (about 20%) but computing the signatures is an additional pass over the new 
+    * frame, so that it is slower when most lines change (up to 60% more CPU time per diff). 
+    * 
+    * Remark: lines with identical signatures but different content (hash collisions) are 
+    * not redrawn. This is extremely unlikely but it can happen.
+    **/
+    void setLineSignatures(bool enable)
+        {
+        waitUpdateAsyncComplete();
+        _linesigs_on = enable;
+        _linesigs.invalidate();
+        }
+
+
+    /**
+    * Return true if the line signatures are enabled.
+    **/
+    bool getLineSignatures() const { return _linesigs_on; }
+
+
+    /**
+    * Enable/disable the detection of vertical scrolling (disabled by default). 
+    * 
+    * When enabled, update() compares the signatures of the lines of the new frame with those of 
+    * the framebuffer mirroring the screen. If the content was shifted (e.g. a scrolling terminal or 
+    * list) the driver moves the screen content with the hardware scroll offset (VSCRSADD command)
+    * and only uploads the lines that differ afterward (typically the newly exposed band). 
+    * 
+    * - The hardware scroll moves the lines of the screen in its native orientation, i.e. vertical
+    *   scrolling in portrait mode and horizontal scrolling in landscape mode. 
+    * - Only used with double buffering and differential updates. 
+    * - The scroll offset changes when the upload of the frame starts: with vsync, the newly exposed 
+    *   band may show stale content during (at most) one refresh. 
+    * - The driver owns the scroll offset while this mode is enabled: setScroll() should not be used. 
+    * - Detecting the scroll costs about the same CPU time as computing a diff. 
+    **/
+    void setScrollDetection(bool enable)
+        {
+        waitUpdateAsyncComplete();
+        _resetScroll();
+        _scroll_detect = enable;
+        }
+
+
+    /**
+    * Return true if scroll detection is enabled. 
+    **/
+    bool getScrollDetection() const { return _scroll_detect; }
+
+
     /**
     * Set the mask used when creating a diff to check is a pixel is the same in both framebuffers. 
     * If the mask set is non-zero, then only the bits set in the mask are used for the comparison 
@@ -811,6 +1089,74 @@ public:
     uint16_t getCompareMask() const { return _compare_mask; }
 
 
+    /**
+    * Enable perceptual diffs (or disable them by setting all the thresholds to 0, the default). 
+    * 
+    * A pixel is not redrawn when its color differs from the one on screen by at most thr_red, 
+    * thr_green and thr_blue on each channel (on 5, 6 and 5 bits). Contrary to the compare mask, 
+    * the internal framebuffer keeps the color actually displayed for the skipped pixels so that 
+    * the error never builds up over frames: the color on screen always remains within the 
+    * thresholds of the last frame. In addition, a band of lines is compared exactly at each 
+    * frame and sweeps the screen so that every residual error is cleared within 
+    * refresh_frames frames. 
+    * 
+    * - This is useful with camera/video content where the sensor noise makes most pixels change
+    *   at every frame. 
+    * - The compare mask is not used for perceptual diffs. 
+    * - Only full frame diffs of DiffBuff objects are perceptual (updateRegion(), half resolution, 
+    *   palettized updates and updateAndSwap() remain exact). With a dirty map, the band only 
+    *   sweeps over the tiles marked. 
+    **/
+    void setDiffPerceptual(int thr_red = 0, int thr_green = 0, int thr_blue = 0, int refresh_frames = 16)
+        {
+        _perc_r = ILI9341Driver::_clip<int>(thr_red, 0, 31);
+        _perc_g = ILI9341Driver::_clip<int>(thr_green, 0, 63);
+        _perc_b = ILI9341Driver::_clip<int>(thr_blue, 0, 31);
+        _perc_frames = ILI9341Driver::_clip<int>(refresh_frames, 1, ILI9341_T4_TFTHEIGHT);
+        _perc_y = 0;
+        }
+
+
+    /**
+    * Return true if perceptual diffs are enabled. 
+    **/
+    bool diffPerceptualActive() const { return ((_perc_r | _perc_g | _perc_b) != 0); }
+
+
+    /**
+    * Set a dirty map used to speed up the creation of diffs by update(). Call without argument to remove it. 
+    * 
+    * When a dirty map is set, only the tiles marked as dirty in the map are compared when creating a
+    * diff and the map is cleared after each frame accepted by update(). So, between two calls to update(),
+    * the user must mark (with DirtyMap::markRegion()) every region of the framebuffer that was modified. 
+    * Changes located outside of the dirty tiles will NOT be drawn onto the screen. 
+    * 
+    * This is useful when only small parts of the framebuffer change between frames: the time spent 
+    * creating the diff then scales with the number of dirty tiles instead of the size of the screen. 
+    * 
+    * The orientation of the map is automatically kept in sync with the screen orientation and the
+    * map is reset to 'all dirty' when set. 
+    * 
+    * The DirtyMap object must remain valid until it is removed (or the driver destroyed).
+    **/
+    void setDirtyMap(DirtyMap* dirtymap = nullptr)
+        {
+        waitUpdateAsyncComplete();
+        _dirtymap = dirtymap;
+        if (_dirtymap)
+            {
+            _dirtymap->setOrientation(_rotation);
+            _dirtymap->markAll();
+            }
+        }
+
+
+    /**
+    * Return the dirty map currently set (or nullptr if none).
+    **/
+    DirtyMap* getDirtyMap() const { return _dirtymap; }
+
+
 
 
     /***************************************************************************************************
@@ -932,6 +1278,25 @@ public:
     void update(const uint16_t* fb, bool force_full_redraw = false);
 
 
+    /**
+    * Same as update() but without copying the framebuffer: the ownership of fb is transferred to 
+    * the driver which uses it directly as its internal framebuffer (mirroring the screen) and the 
+    * previous internal framebuffer is returned. The caller should draw the next frame in the
+    * returned buffer and must not access fb anymore after the call. 
+    * 
+    * This saves a 150KB copy per frame (and the user framebuffer can be the only 'extra' buffer:
+    * the one passed to setFramebuffers() is returned at the first call).
+    * 
+    * - The returned buffer contains an older frame (not fb) so it should be redrawn completely.
+    * - fb must be in memory accessible by DMA, just like the internal framebuffers. 
+    * - The swap is only possible with double buffering and orientation 0 (PORTRAIT_240x320). 
+    *   Otherwise, this method calls update(fb) and returns fb itself (the caller keeps it). 
+    *   The same happens if the frame is dropped (vsync_spacing = -1 and upload in progress). 
+    * - The dirty map (if any) is not used (and fully marked) and diffs are not streamed. 
+    **/
+    uint16_t* updateAndSwap(uint16_t* fb, bool force_full_redraw = false);
+
+
 
 
     /**
@@ -971,6 +1336,168 @@ public:
     void updateRegion(bool redrawNow, const uint16_t* fb, int xmin, int xmax, int ymin, int ymax, int stride = -1); 
 
 
+    typedef void (*BandCallback)(void* obj, uint16_t* band, int ymin, int ymax);  // callback type for updateBands()
+
+
+    /**
+    * Update the whole screen without a user framebuffer: the frame is rendered by horizontal 
+    * bands of 'band_lines' lines (in the current orientation) into the small buffer 'band' 
+    * (of size width() x band_lines) supplied by the user.
+    * 
+    * For each band, from top to bottom, the driver calls cb(obj, band, ymin, ymax) which
+    * must draw the lines [ymin, ymax] of the frame into 'band' (with stride width()) and then 
+    * pushes the band to the screen. 
+    *
+    * - With an internal framebuffer, each band is copied into it and the diffs of the bands 
+    *   are merged (with 2 diff buffers) so that the frame is uploaded with a single 
+    *   differential update that keeps vsync and the no-tear guarantees for the whole frame. 
+    * - Without internal framebuffer, each band is uploaded directly (CPU driven SPI, blocking) 
+    *   once it is rendered, so rendering and upload take turns: this needs only 
+    *   band_lines x width() pixels of memory but there is neither diff nor vsync, so the 
+    *   no-tear guarantee does NOT hold in this mode (the frame may tear). 
+    **/
+    void updateBands(BandCallback cb, void* obj, uint16_t* band, int band_lines);
+
+
+
+    /**
+    *                             DRAWING PRIMITIVES
+    *
+    * These methods draw directly into the internal framebuffer. Since the modified region is 
+    * known in advance, the diff is built without comparing framebuffers: the rectangle covered 
+    * by the primitive is simply merged into the pending diff, hence the cost is proportional 
+    * to the number of pixels drawn. They follow the same 'redrawNow' semantics as 
+    * updateRegion(): with redrawNow=false, the changes are accumulated and uploaded together 
+    * (with vsync) by the next call with redrawNow=true (or by the next updateRegion() call).
+    * 
+    * - Coordinates are in the current orientation and the primitives are clipped to the screen.
+    * - Two diff buffers are needed for differential updates. Otherwise (or if the internal 
+    *   framebuffer does not mirror the screen) the whole screen is redrawn when redrawNow=true. 
+    * - Without internal framebuffer, fillRegion() and opaque drawSprite() push the pixels 
+    *   directly. drawMask() and transparent sprites need the internal framebuffer and do 
+    *   nothing otherwise. 
+    * - Since the internal framebuffer is modified, a user framebuffer given to update() 
+    *   afterwards is compared against the drawn content (the dirty map, if any, is marked). 
+    **/
+
+
+    /**
+    * Fill the region [xmin, xmax] x [ymin, ymax] with a given color.
+    **/
+    void fillRegion(bool redrawNow, uint16_t color, int xmin, int xmax, int ymin, int ymax);
+
+
+    /**
+    * Draw a sprite of size w x h with its upper left corner at (x,y). The layout of sprite is 
+    * such that pixel (x + i, y + j) = sprite[i + stride*j] (stride defaults to w). If 
+    * transparent_color is in [0, 65535], pixels with this color are not drawn. 
+    **/
+    void drawSprite(bool redrawNow, const uint16_t* sprite, int x, int y, int w, int h, int transparent_color = -1, int stride = -1);
+
+
+    /**
+    * Draw a 1 bit per pixel mask of size w x h (e.g. a text glyph) with its upper left corner 
+    * at (x,y): set bits are drawn with 'color' and cleared bits are left unchanged. Each row of 
+    * the mask starts on a new byte (stride in bytes defaults to (w + 7)/8) and the most 
+    * significant bit comes first (same format as Adafruit GFX bitmaps). 
+    **/
+    void drawMask(bool redrawNow, const uint8_t* mask, int x, int y, int w, int h, uint16_t color, int stride = -1);
+
+
+    /**
+    * Update the screen with a half resolution framebuffer: each pixel of fb_half is drawn as a 
+    * 2x2 block. fb_half has size 120x160 in portrait orientations and 160x120 in landscape 
+    * orientations (it follows the current rotation, like the framebuffer given to update()).
+    * 
+    * The diff is computed directly on the small framebuffer (which is 4 times faster) and the 
+    * doubled frame is stored in the internal framebuffer from where it is uploaded via DMA, 
+    * with vsync, exactly as with update(). Without internal framebuffer, the frame is pushed 
+    * directly, without diff nor vsync (a single line of scratch memory is used to double it).
+    * 
+    * - Half resolution diffs are only available with DiffBuff objects: with other diff types,
+    *   or when the screen content was last set by another method, the whole screen is redrawn.
+    * - With triple buffering, the second internal framebuffer is not used. 
+    * - The dirty map (if any) is not used (and fully marked). 
+    **/
+    void updateHalfRes(const uint16_t* fb_half, bool force_full_redraw = false);
+
+
+    /**
+    * Update the screen with a palettized framebuffer: fb8 has one byte per pixel (same size 
+    * and layout as a framebuffer given to update() for the current rotation) and each byte is 
+    * an index in palette, an array of 256 RGB565 colors. For example, with RGB332 colors, the 
+    * palette is simply the 256 RGB332 -> RGB565 conversions.
+    *
+    * The user framebuffer is half the size of a RGB565 one (76.8KB) and the diff only reads one
+    * byte per pixel from it. The colors are expanded while diffing into the internal 
+    * framebuffer from where the frame is uploaded via DMA, with vsync, exactly as with update(). 
+    * Without internal framebuffer, the frame is pushed directly, without diff nor vsync (a 
+    * single line of scratch memory is used for expanding it).
+    *
+    * - Since the diff compares the expanded colors, the palette may change between frames 
+    *   (e.g. palette animations): only the pixels whose color actually changed are redrawn.
+    * - Palettized diffs are only available with DiffBuff objects: with other diff types, the 
+    *   whole screen is redrawn.
+    * - With triple buffering, the second internal framebuffer is not used. 
+    * - The dirty map (if any) is not used (and fully marked). 
+    **/
+    void updatePalette(const uint8_t* fb8, const uint16_t* palette, bool force_full_redraw = false);
+
+
+    /**
+    *                             DELTA STREAMS
+    *
+    * These methods apply a compact stream of changes (e.g. received from a host computer via 
+    * USB/serial) directly to the internal framebuffer while the diff is built run by run from 
+    * the stream itself: there is no intermediate frame and no framebuffer comparison. The RAM 
+    * used does not depend on the size of the frame and the bytes can be pushed as they arrive,
+    * in chunks of any size (an instruction may be split between 2 calls).
+    * 
+    * The stream is a sequence of instructions [skip, code, pixels]: 
+    * 
+    * - skip: number of pixels left unchanged before the run. 
+    * - code: (n << 1) | rle where n is the length of the run. If rle = 0, n pixels follow. 
+    *   If rle = 1, a single pixel follows which is repeated n times. 
+    * - pixels: RGB565 colors, 2 bytes each (little endian). 
+    * 
+    * skip and code use the same variable length encoding as DiffBuff: a value v < 128 takes 
+    * 1 byte (v << 1), v < 16384 takes 2 bytes ((v & 63) << 2) | 1, (v >> 6) and v < 2^22 takes 
+    * 3 bytes ((v & 63) << 2) | 3, (v >> 6) & 255, (v >> 14). The positions are in the native 
+    * orientation of the screen (offset x + 240*y in PORTRAIT_240x320) whatever the current 
+    * rotation, like the internal framebuffer: the host must rotate the frame if needed. 
+    * 
+    * - An internal framebuffer is required (beginDelta() returns false otherwise). 
+    * - Two diff buffers are needed for differential updates. Otherwise (or if the internal 
+    *   framebuffer does not mirror the screen) the whole screen is redrawn when redrawNow=true.
+    * - The previous upload must complete before the first byte is applied (beginDelta() waits 
+    *   for it) and no other update method may be called until endDelta().
+    * - The dirty map (if any) is fully marked. 
+    **/
+
+
+    /**
+    * Start a new delta stream. Return false if there is no internal framebuffer. 
+    **/
+    bool beginDelta();
+
+
+    /**
+    * Apply the next len bytes of the delta stream. Return false if the stream is invalid 
+    * (a run goes beyond the end of the screen) or if no stream was started: the remaining 
+    * bytes until endDelta() are then ignored. 
+    **/
+    bool pushDelta(const uint8_t* data, size_t len);
+
+
+    /**
+    * End the delta stream and upload the changes (with vsync) if redrawNow = true. Otherwise 
+    * the changes are kept pending and uploaded by the next update, as with updateRegion().
+    * Return false if the stream was invalid or ended in the middle of an instruction (the 
+    * pixels received are still drawn). 
+    **/
+    bool endDelta(bool redrawNow = true);
+
+
     /**
     * Wait until any currently ongoing async update completes.
     * 
@@ -988,6 +1515,56 @@ public:
     inline bool asyncUpdateActive() const { return (_dma_state != ILI9341_T4_DMA_IDLE); }
 
 
+    typedef void (*FrameCallback)(void* obj);  // callback type for frame notifications.
+
+
+    /**
+    * Set a callback called each time a frame has been completely uploaded to the screen. 
+    * 'obj' is passed back to the callback (use it e.g. for a semaphore or a task handle). 
+    * Call with no argument to remove the callback.  
+    *
+    * NOTE: The callback is usually called from the DMA/timer interrupt (but it is called 
+    *       from within update() when the frame is drawn synchronously). It must be short 
+    *       and 'interrupt safe': set a flag, give a semaphore or notify a task but do NOT 
+    *       call any method of the driver from it. 
+    **/
+    void setFrameCompleteCallback(FrameCallback cb = nullptr, void* obj = nullptr)
+        {
+        noInterrupts();
+        _framecomplete_cb = cb;
+        _framecomplete_obj = obj;
+        interrupts();
+        }
+
+
+    /**
+    * Set a callback called each time an internal framebuffer is released, i.e. when the 
+    * driver becomes ready to accept a new frame without blocking: 
+    * - with double buffering, when the ongoing upload completes. 
+    * - with triple buffering, when the pending frame has been moved to the upload buffer 
+    *   (the next call to update() will not wait, even if an upload is still ongoing). 
+    * 
+    * This lets the drawing task sleep until it can submit its next frame instead of busy 
+    * waiting with waitUpdateAsyncComplete(). Same restrictions as for the frame complete 
+    * callback above. 
+    **/
+    void setBufferReleasedCallback(FrameCallback cb = nullptr, void* obj = nullptr)
+        {
+        noInterrupts();
+        _bufferreleased_cb = cb;
+        _bufferreleased_obj = obj;
+        interrupts();
+        }
+
+
+    /**
+    * Return the number of frames completely uploaded since begin(). Incremented just before
+    * the frame complete callback is called: an event loop can compare it with a previous 
+    * value instead of polling asyncUpdateActive(). 
+    **/
+    uint32_t frameCounter() const { return _frame_counter; }
+
+
 
 
 
@@ -1030,7 +1607,7 @@ public:
     * used spend preparing and updating the screen (dma interrupt time). 
     * !!! This does NOT count the time needed to create the diffs. !!!
     **/
-    StatsVar statsCPUtimePerFrame() const { return _statsvar_cputime; }
+    const StatsVar & statsCPUtimePerFrame() const { return _statsvar_cputime; }
 
 
     /**
@@ -1038,14 +1615,22 @@ public:
     * for uploading each frame. 
     * !!! This does NOT count the time needed to create the diffs. !!!
     **/
-    StatsVar statsUploadtimePerFrame() const { return _statsvar_uploadtime; }
+    const StatsVar & statsUploadtimePerFrame() const { return _statsvar_uploadtime; }
+
+
+    /**
+    * Return an object containing statistics about the time (in us) between the 
+    * end of the upload of two consecutive frames. Use statsFrametime().percentile(0.99)
+    * to get the tail latency of the frames (the average is simply 1/framerate). 
+    **/
+    const StatsVar & statsFrametime() const { return _statsvar_frametime; }
 
 
     /**
     * Return an object containing statistics about the number of pixels
     * uploaded per frame. 
     **/
-    StatsVar statsPixelsPerFrame() const { return _statsvar_uploaded_pixels; }
+    const StatsVar & statsPixelsPerFrame() const { return _statsvar_uploaded_pixels; }
 
 
     /**
@@ -1059,7 +1644,7 @@ public:
     * Return an object containing statistics about the number of transactions
     * per frame.
     **/
-    StatsVar statsTransactionsPerFrame() const { return _statsvar_transactions; }
+    const StatsVar & statsTransactionsPerFrame() const { return _statsvar_transactions; }
 
 
     /**
@@ -1086,13 +1671,13 @@ public:
     * When this value becomes negative, it means tearing occurs. A large positive value means that 
     * there is plenty of time for redraw without tearing so the framerate may be increased.
     **/
-    StatsVar statsMarginPerFrame() const { return _statsvar_margin; }
+    const StatsVar & statsMarginPerFrame() const { return _statsvar_margin; }
 
 
     /**
     * Return an object containing the effective statistics about the vsync_spacing beween screen refresh. 
     **/
-    StatsVar statsRealVSyncSpacing() const { return _statsvar_vsyncspacing; }
+    const StatsVar & statsRealVSyncSpacing() const { return _statsvar_vsyncspacing; }
 
 
     /**
@@ -1102,6 +1687,13 @@ public:
     uint32_t statsNbTeared() const { return _nbteared; }
 
 
+    /**
+    * Return the number of frames for which the hardware scroll was used 
+    * (see setScrollDetection()).
+    **/
+    uint32_t statsNbScrolled() const { return _stats_nb_scrolled; }
+
+
     /**
     * Return the ratio of frame with vsync active for which screen tearing
     * may have occured.
@@ -1120,6 +1712,52 @@ public:
     void printStats() const;
 
 
+    /**
+    * Clear the trace of the uploads. 
+    * 
+    * The trace is only recorded when ILI9341_T4_TRACE is set to 1 (otherwise the
+    * trace methods do nothing). It holds the last ILI9341_T4_TRACE_SIZE events 
+    * (update() calls, diff done, dma transfers, scanline waits, touch reads, end of
+    * frames...) each with a timestamp from the cycle counter.
+    **/
+    void traceReset()
+        {
+#if ILI9341_T4_TRACE
+        _trace.reset();
+#endif
+        }
+
+
+    /**
+    * Copy the trace (oldest event first) into dst which must have room for 
+    * maxn entries. Return the number of entries copied. 
+    **/
+    int traceCopy(TraceEntry* dst, int maxn) const
+        {
+#if ILI9341_T4_TRACE
+        return _trace.copy(dst, maxn);
+#else
+        return 0;
+#endif
+        }
+
+
+    /**
+    * Print the trace in CSV format: time since the first event, time since the 
+    * previous event, event name, event argument. 
+    * 
+    * The infos are sent to the output stream set with the `output()` method.
+    **/
+    void printTrace() const
+        {
+#if ILI9341_T4_TRACE
+        _trace.print(_outputStream);
+#else
+        _print("Trace disabled (set ILI9341_T4_TRACE to 1 in ILI9341Driver.h).\n");
+#endif
+        }
+
+
 
 
 
@@ -1157,13 +1795,36 @@ public:
     * 
     * If the touch_irq pin is assigned, it will avoid using the spi bus whenever possible.
     *
-    * If the spi bus must be used. The method will wait until the current ongoinc async
-    * transfer completes (if any). This means that this method may stall for a few 
-    * milliseconds. 
+    * This method never blocks: if the spi bus is in use by an async transfer, a new reading
+    * is requested and the last known position is returned meanwhile. The reading is done in 
+    * the DMA interrupt at the end of the transfer, but only after the next frame (if one is 
+    * pending, e.g. with triple buffering) was launched: if that frame starts uploading right 
+    * away, the bus is busy again and the reading is postponed to the end of that frame. Thus,
+    * the touch reading never delays a frame but the position returned may be a few frames 
+    * old when frames are uploaded back to back. 
     **/
     bool readTouch(int& x, int& y, int& z);
 
 
+    /**
+    * Every touch reading (including those made from the DMA interrupt) is also pushed into
+    * a queue of ILI9341_T4_TOUCH_QUEUE_SIZE samples: a sample with z > 0 for each position 
+    * read while the screen is touched and a sample with z = 0 when the touch is released. 
+    * 
+    * Return the number of samples currently in the queue (this also requests a new reading,
+    * like readTouch(), without blocking). 
+    **/
+    int touchAvailable();
+
+
+    /**
+    * Pop the oldest sample from the touch queue. Return false if the queue is empty. 
+    * (x,y) are mapped as in readTouch() and ms is the value of millis() when the sample was 
+    * read. If the queue is full, new samples are dropped until samples are popped.
+    **/
+    bool popTouch(int& x, int& y, int& z, uint32_t& ms);
+
+
     /**
     * Set a mapping from touch coordinates to screen coordinates (or 
     * remove an existing mapping by calling with nullptr).
@@ -1242,6 +1903,7 @@ private:
 
     int16_t _width, _height;                    // Display w/h as modified by current rotation    
     int     _rotation;                          // current screen orientation
+    bool    _inverted;                          // true if the display colors are inverted (see invertDisplay()). 
     int     _refreshmode;                       // refresh mode (between 0 = fastest refresh rate and 15 = slowest refresh rate). 
     
     mutable Stream * _outputStream;                      // output stream used for debugging
@@ -1270,11 +1932,32 @@ private:
     ***********************************************************************************************************/
 
     volatile int _diff_gap;                     // gap when creating diffs.
+    bool _diff_gap_auto;                        // true if the gap is tuned automatically.
     volatile int _vsync_spacing;                // update stategy / framerate divider. 
     volatile float _late_start_ratio;          // late start parameter (by how much we can miss the first sync line and still start the frame without waiting for the next refresh).
     volatile bool _late_start_ratio_override;   // if true the next frame upload will wait for the scanline to start a next frame. 
     volatile uint16_t _compare_mask;             // the compare mask used to compare pixels when doing a diff
 
+    int _perc_r, _perc_g, _perc_b;              // thresholds of the perceptual diffs (all 0 if disabled)
+    int _perc_frames;                           // number of frames for the exact band to sweep the screen
+    int _perc_y;                                // first line of the next exact band
+
+    float _pacing_fps;                          // target framerate of the frame pacing (0 if disabled)
+    volatile int _pacing_frames;                // number of frames in the current pacing window
+    volatile int _pacing_late;                  // number of late frames (real spacing larger than vsync_spacing) in the window.
+    volatile int _pacing_teared;                // number of teared frames in the window.
+    int _pacing_calm;                           // number of consecutive windows without late nor teared frames.
+
+    int _idle_frames;                           // number of idle frames before switching to the low-power refresh mode (0 if disabled)
+    int _idle_mode;                             // refresh mode used when idle.
+    volatile int _idle_count;                   // number of consecutive idle frames.
+    volatile bool _idle_slow;                   // true if the panel is in the low-power refresh mode.
+    volatile bool _idle_wake;                   // set when a non-empty frame was uploaded in low-power mode.
+    uint32_t _idle_period;                      // refresh period in idle mode (0 if not yet measured).
+    uint32_t _active_period;                    // refresh period saved when entering the low-power mode.
+
+    DirtyMap* volatile _dirtymap;               // dirty map used to restrict the diffs (or nullptr). 
+
     DiffBuffBase* volatile  _diff1;             // first diff buffer
     DiffBuffBase* volatile  _diff2;             // second diff buffer (if non null, then _diff1 is also non zero). 
     DiffBuffDummy* volatile _dummydiff1;        // fake diff buffer used for complete refresh and when buffering is disabled. 
@@ -1285,6 +1968,7 @@ private:
     uint16_t* volatile _fb1;                    // first internal framebuffer
     uint16_t* volatile _fb2;                    // second internal framebuffer (if non null, then _fb1 is also non zero). 
     uint16_t* volatile _mirrorfb;               // framebuffer that currently mirrors the screen (or will mirror it when upload completes).
+    bool _mirror_half;                          // true if the mirror framebuffer holds a doubled frame (set by updateHalfRes())
 
     DiffBuffBase* volatile _ongoingDiff;        // should be nullptr when mirror_fb = true.
                                                 // when _mirrorfb = false, if this is not equal to nullptr, then this means that
@@ -1292,6 +1976,48 @@ private:
 
     volatile bool _fb2full;                     // true if the second framebuffer is currently full and waiting to be uploaded. 
 
+    int _stream_band_lines;                     // number of lines per band when streaming diffs (0 = disabled)
+    volatile bool _stream_launched;             // true once the upload of the diff being computed was started
+
+    LineSignatures _linesigs;                   // signatures of the lines of _fb1 (used to skip identical lines when computing diffs).
+    bool _linesigs_on;                          // true if the line signatures are used (see setLineSignatures()).
+
+    /** line signatures to pass to computeDiff() (nullptr if disabled) */
+    LineSignatures* _sigs() { return (_linesigs_on ? &_linesigs : nullptr); }
+
+    bool _scroll_detect;                        // true if scroll detection is enabled
+    int _scroll_offset;                         // current hardware scroll offset: line y of _fb1 is stored in line (y + offset) mod TFTHEIGHT of the screen memory
+    volatile bool _scroll_send;                 // true if the scroll offset must be sent at the start of the next upload
+
+
+    /** line of the screen memory where line y of the framebuffer is stored */
+    int _gramLine(int y) const __attribute__((always_inline))
+        {
+        const int g = y + _scroll_offset;
+        return (g >= ILI9341_T4_TFTHEIGHT) ? (g - ILI9341_T4_TFTHEIGHT) : g;
+        }
+
+    /** send the scroll offset to the screen if needed (no upload may be in progress). */
+    void _sendScroll();
+
+    /** set the scroll offset back to 0 (no upload may be in progress). Force a full redraw if it was not 0 already. */
+    void _resetScroll();
+
+    /** look for a vertical shift between _fb1 and fb and, if found, apply it to _fb1 and to the scroll offset. */
+    void _detectScroll(const uint16_t* fb);
+
+
+    /** compute the diff in _diff1 (copy to _fb1) and launch the upload (possibly before the diff is complete). */
+    void _updateAsyncDiff1(const uint16_t* fb);
+
+
+    /** called by _diff1 when the first instruction of a streamed diff is ready. */
+    static void _streamStartCB(void* obj);
+
+
+    /** update() without dirty map bookkeeping */
+    void _update(const uint16_t* fb, bool force_full_redraw);
+
 
     /** called when fb2 is full and must be drawn on the screen */
     void _buffer2fullCB();
@@ -1316,6 +2042,97 @@ private:
         void _updateRectNow(const uint16_t* sub_fb, int xmin, int xmax, int ymin, int ymax, int stride);
 
 
+    /**
+    * Push a rectangular region on the screen (SPI must not be in use, the frame must have been 
+    * started). Used by _updateRectNow() and updateBands().
+    **/
+    void _pushRect(const uint16_t* sub_fb, int xmin, int xmax, int ymin, int ymax, int stride);
+
+
+    /**
+    * Common part of updateHalfRes() and updatePalette(): exactly one of fb_half and fb8 is 
+    * not null and the frame is expanded into the internal framebuffer. 
+    **/
+    void _updateExpanded(const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette, bool force_full_redraw);
+
+
+    /** diff between _fb1 and the expanded frame (return false if the diff type does not support it) */
+    bool _diffExpanded(DiffBuffBase* diff, const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette, bool copy_new_over_old);
+
+
+    /** expand the frame into _fb1 */
+    void _copyExpanded(const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette);
+
+
+    /**
+    * Push the whole screen from a half resolution or palettized framebuffer (SPI must not be in 
+    * use, the frame must have been started). Used without internal framebuffer.
+    **/
+    void _pushExpanded(const uint16_t* fb_half, const uint8_t* fb8, const uint16_t* palette);
+
+
+    /**
+    * Clip the region [xmin, xmax] x [ymin, ymax] (current orientation) to the screen. Return 
+    * false if nothing remains.
+    **/
+    bool _clipRegion(int& xmin, int& xmax, int& ymin, int& ymax);
+
+
+    /**
+    * First step of the drawing primitives: build the diff that merges the region with the 
+    * pending changes (possibly while the previous frame is uploaded) and wait until _fb1 can 
+    * be written. Return nullptr if no diff could be created (full redraw needed).
+    **/
+    DiffBuffBase* _drawBegin(int xmin, int xmax, int ymin, int ymax);
+
+
+    /** Last step of the drawing primitives, once _fb1 has been written. */
+    void _drawEnd(DiffBuffBase* diff, bool redrawNow);
+
+
+    enum
+        {
+        ILI9341_T4_DELTA_IDLE = 0,      // no delta stream started
+        ILI9341_T4_DELTA_SKIP = 1,      // reading the skip value
+        ILI9341_T4_DELTA_CODE = 2,      // reading the code of the run
+        ILI9341_T4_DELTA_PIXELS = 3,    // reading the pixels of the run
+        ILI9341_T4_DELTA_RLE = 4,       // reading the repeated pixel
+        ILI9341_T4_DELTA_ERROR = 5      // invalid stream
+        };
+
+    uint8_t _delta_state;                       // state of the delta stream decoder
+    uint8_t _delta_nbytes;                      // number of bytes of the current value read so far
+    uint8_t _delta_bytes[3];                    // bytes of the current value
+    bool _delta_half;                           // true if the low byte of a pixel was read
+    uint8_t _delta_lo;                          // and its value
+    int _delta_pos;                             // current position in _fb1
+    int _delta_count;                           // number of pixels remaining in the current run
+    DiffBuffBase* _delta_diff;                  // the diff built from the runs (nullptr for a full redraw)
+
+
+    /** read the next byte of a variable length value of the delta stream. Return true (and set val) when complete. */
+    bool _deltaValue(uint8_t b, int& val)
+        {
+        _delta_bytes[_delta_nbytes++] = b;
+        const int need = ((_delta_bytes[0] & 1) == 0) ? 1 : (((_delta_bytes[0] & 3) == 1) ? 2 : 3);
+        if (_delta_nbytes < need) return false;
+        _delta_nbytes = 0;
+        if (need == 1) { val = (_delta_bytes[0] >> 1); return true; }
+        val = (_delta_bytes[0] >> 2) + (((int)_delta_bytes[1]) << 6);
+        if (need == 3) val += (((int)_delta_bytes[2]) << 14);
+        return true;
+        }
+
+
+    /** index in _fb1 of pixel (x,y) (current orientation) */
+    int _fbIndex(int x, int y) const
+        {
+        int x1, x2, y1, y2;
+        DiffBuffBase::rotationBox(_rotation, x, x, y, y, x1, x2, y1, y2);
+        return x1 + ILI9341_T4_TFTWIDTH * y1;
+        }
+
+
 
     void _pushpixels(const uint16_t* fb, int x, int y, int len)  __attribute__((always_inline))
         {
@@ -1378,6 +2195,12 @@ private:
 
     volatile methodCB_t _pcb;                   // function callback (nullptr if none) 
 
+    volatile FrameCallback _framecomplete_cb;   // user callback at the end of each frame (nullptr if none)
+    void* volatile _framecomplete_obj;          // and its parameter
+    volatile FrameCallback _bufferreleased_cb;  // user callback when a framebuffer is released (nullptr if none)
+    void* volatile _bufferreleased_obj;         // and its parameter
+    volatile uint32_t _frame_counter;           // number of frames uploaded since begin()
+
     const uint16_t* volatile _fb;               // the framebuffer to push
 
     DiffBuffBase* volatile _diff;               // and corresponding diff buffer
@@ -1405,13 +2228,36 @@ private:
     DMAChannel _dmatx;                          // the dma channel object. 
 
     DMASetting          _dmasettingsDiff[3];    // dma settings chain
+
+    int                 _dma_batch;                                         // max number of instructions per DMA transfer
+    DMASetting          _dmasettingsBatch[2 * ILI9341_T4_DMA_BATCH_MAX];    // dma settings for the additional instructions of a batch (commands, pixels)
+    uint32_t            _dma_batch_cmd[13 * ILI9341_T4_DMA_BATCH_MAX];      // TCR/TDR words for the commands of the batch
   
     uint32_t            _dma_spi_tcr_deassert;  // TCR value for deasserting DC
     uint32_t            _dma_spi_tcr_assert;    // TCR value for asserting DC
 
     int                 _prev_caset_x;          // previous position set with the caset command
+    int                 _prev_caset_xe;         // previous end column set with the caset command
     int                 _prev_paset_y;          // previous position set with the paset command
 
+    int                 _rect_x, _rect_y;       // position of the last line sent for the current rectangle
+    int                 _rect_w;                // width of the current rectangle
+    int                 _rect_rem;              // number of pixels of the current rectangle not yet sent
+
+    int                 _wrap_y;                // first line of the remaining part of a run split at the end of the screen memory (scroll offset)
+    int                 _wrap_rem;              // number of pixels of this remaining part
+
+    static_assert(ILI9341_T4_STAGING_PIXELS >= ILI9341_T4_TFTWIDTH, "ILI9341_T4_STAGING_PIXELS must be at least one line");
+
+#if ILI9341_T4_EXTMEM_STAGING
+    uint16_t            _stage_buf[2][ILI9341_T4_STAGING_PIXELS] __attribute__((aligned(32))); // staging buffers for uploading from EXTMEM
+#endif
+    bool                _staging;               // true if the frame is uploaded through the staging buffers
+    bool                _stage_ready;           // true if the next part of the run was already copied in _stage_buf[_stage_idx]
+    int                 _stage_idx;             // staging buffer used for the next transfer
+    int                 _stage_x, _stage_y;     // position of the remaining part of a run split by the staging buffer size
+    int                 _stage_rem;             // number of pixels of this remaining part
+
     static void _dmaInterruptSPI0Diff() { if (_dmaObject[0]) { _dmaObject[0]->_dmaInterruptDiff(); } } // called when using spi 0
     static void _dmaInterruptSPI1Diff() { if (_dmaObject[1]) { _dmaObject[1]->_dmaInterruptDiff(); } } // called when using spi 1
     static void _dmaInterruptSPI2Diff() { if (_dmaObject[2]) { _dmaObject[2]->_dmaInterruptDiff(); } } // called when using spi 2
@@ -1422,18 +2268,26 @@ private:
     /** set/remove  the callback at end of transfer */
     void _setCB(methodCB_t pcb = nullptr) { _pcb = pcb; }
 
+    void _notifyFrameDone();                    // call the user callbacks at the end of a frame.
+
 
     /**
      * flush the cache if the array is located in DMAMEM.
      * This can take a while (100us) so don't abuse it !
+     * With ILI9341_T4_EXTMEM_STAGING, framebuffers in EXTMEM are not flushed: the DMA never reads 
+     * them directly (the pixels are copied by the CPU into the staging buffers, see _dmaSource()).
      **/
     void _flush_cache(const void* ptr, size_t len) __attribute__((always_inline))
         {
-        if ((uint32_t)ptr >= 0x20200000u) arm_dcache_flush((void*)ptr, len);
+        if (((uint32_t)ptr >= 0x20200000u) && ((!ILI9341_T4_EXTMEM_STAGING) || (!_inExtMem(ptr)))) arm_dcache_flush((void*)ptr, len);
         asm("dsb");
         }
 
 
+    /** true if the array is located in EXTMEM (external PSRAM) */
+    static bool _inExtMem(const void* ptr) { return ((((uint32_t)ptr) >= 0x70000000u) && (((uint32_t)ptr) < 0x80000000u)); }
+
+
     void _subFrameTimerStartcb();    // called at start of subframe
 
     void _subFrameTimerStartcb2();   // called at start of subframe
@@ -1442,6 +2296,34 @@ private:
 
     void _subFrameInterruptDiff2();  // called by after a pause for synchronization
 
+    int _buildDMABatch(int asl);     // chain the next instructions of the diff after the current one (return the number of instructions added). 
+
+    int _readRun(int asl, int& x, int& y, int& xe, int& len, bool& cont); // read the next run of contiguous pixels of the diff (splitting rectangles in lines and long runs when staging).
+
+    int _readRunDiff(int asl, int& x, int& y, int& xe, int& len, bool& cont); // read the next run of contiguous pixels of the diff (splitting rectangles in lines).
+
+    const uint16_t* _dmaSource(int x, int y, int len); // source of the pixels for the next transfer (a staging buffer when the framebuffer is in EXTMEM).
+
+    void _stagePrefetch(); // copy the next part of a split run in the free staging buffer while the current transfer is ongoing.
+
+    void _dmaWriteCommands(int x, int y, int xe); // write the CASET/PASET/RAMWR commands directly in the spi fifo (only those needed)
+
+
+    /** end column to set with CASET for an instruction given by readDiffRect(). Return ILI9341_T4_TFTWIDTH 
+     *  when the pixels are contiguous in the framebuffer: a plain run or a rectangle spanning whole lines. */
+    static int _windowEnd(int x, int w, int len) __attribute__((always_inline))
+        {
+        return ((len > w) && ((x > 0) || (w < ILI9341_T4_TFTWIDTH))) ? (x + w - 1) : ILI9341_T4_TFTWIDTH;
+        }
+
+
+    /** line below the last pixel written by an instruction (for computing the margin) */
+    static int _lastLine(int x, int y, int xe, int len) __attribute__((always_inline))
+        {
+        if (xe == ILI9341_T4_TFTWIDTH) return (ILI9341_T4_TFTWIDTH * y + x + len) / ILI9341_T4_TFTWIDTH;
+        return y + (len + (xe - x)) / (xe - x + 1);
+        }
+
 
 
 
@@ -1454,6 +2336,43 @@ private:
     uint32_t _period;                           // number of microsceonds between screen refresh. 
     elapsedMicros _synced_em;                   // number of microseconds sinces the last scanline synchronization
     uint32_t _synced_scanline;                  // scanline at the time of the last synchronization
+
+    uint8_t _te_pin;                            // tearing effect pin (255 if not used)
+    volatile uint32_t _te_count;                // number of TE pulses received since the last reset
+    volatile uint32_t _te_last;                 // micros() at the last TE pulse
+    volatile uint32_t _te_sum;                  // sum of the periods between TE pulses since the last reset
+
+    static ILI9341Driver* volatile _teObjects[4];   // point back to this->
+
+    static void _te_int0() { if (_teObjects[0]) { _teObjects[0]->_te_int(); } }  // forward to the TE interrupt method cb
+    static void _te_int1() { if (_teObjects[1]) { _teObjects[1]->_te_int(); } }  // forward to the TE interrupt method cb
+    static void _te_int2() { if (_teObjects[2]) { _teObjects[2]->_te_int(); } }  // forward to the TE interrupt method cb
+    static void _te_int3() { if (_teObjects[3]) { _teObjects[3]->_te_int(); } }  // forward to the TE interrupt method cb
+
+    /** the TE interrupt: a new refresh starts (scanline 0) */
+    void _te_int()
+        {
+        const uint32_t t = micros();
+        if (_te_count > 0) _te_sum += (t - _te_last);
+        _te_last = t;
+        _te_count++;
+        _synced_em = 0;
+        _synced_scanline = 0;
+        }
+
+
+    /** true if TE pulses are currently received */
+    bool _teActive() const
+        {
+        return ((_te_pin != 255) && (_te_count > 1) && (_period > 0) && ((uint32_t)(micros() - _te_last) < 2 * _period));
+        }
+
+
+    /** attach the TE interrupt and enable the TE output of the display */
+    void _attachTE();
+
+    /** detach the TE interrupt and disable the TE output of the display if send_cmd = true */
+    void _detachTE(bool send_cmd);
     
 
 
@@ -1642,6 +2561,9 @@ private:
     uint32_t        _stats_uploadtime;          // cpu time spend in a frame
     StatsVar        _statsvar_uploadtime;       // statistics about the cpu time usage. 
 
+    elapsedMicros   _stats_elapsed_frametime;   // timer since the end of the last frame
+    StatsVar        _statsvar_frametime;        // statistics about the time between two frames.
+
     uint32_t        _stats_nb_uploaded_pixels;  // number of pixel upload during a frame. 
     StatsVar        _statsvar_uploaded_pixels;  // statistics about the number of pixels uploaded per frame.
 
@@ -1654,6 +2576,20 @@ private:
 
     uint32_t        _nbteared;                  // number of frame for which screen tearing may have occured. 
 
+    uint32_t        _stats_nb_scrolled;         // number of frames which used the hardware scroll
+
+    float           _autogap_s[9];              // decayed sums for the fit: upload time = c + a*pixels + b*transactions
+    float           _autogap_cost;              // estimated transaction cost (in pixels) or -1 if unknown.
+    int             _autogap_floor;             // minimum gap imposed after diff buffer overflows.
+    int             _autogap_calm;              // number of frames since the last (near) overflow.
+
+#if ILI9341_T4_TRACE
+    TraceBuffer<ILI9341_T4_TRACE_SIZE> _trace;  // timeline of the uploads
+#define ILI9341_T4_TRACE_EVENT(ev, arg) _trace.push((ev), (arg))
+#else
+#define ILI9341_T4_TRACE_EVENT(ev, arg) ((void)0)
+#endif
+
 
     void _startframe(bool vsynonc)
     {
@@ -1693,6 +2629,103 @@ private:
     void _endframe();
 
 
+    /** reset the automatic gap estimator */
+    void _autoGapReset()
+        {
+        for (int i = 0; i < 9; i++) _autogap_s[i] = 0.0f;
+        _autogap_cost = -1.0f;
+        _autogap_floor = 1;
+        _autogap_calm = 0;
+        }
+
+
+    /** reset the frame pacing window */
+    void _pacingReset()
+        {
+        _pacing_frames = 0;
+        _pacing_late = 0;
+        _pacing_teared = 0;
+        _pacing_calm = 0;
+        }
+
+
+    /** record the last frame in the pacing window (called from _endframe()) */
+    void _pacingPush()
+        {
+        if (_stats_nb_frame <= 1) return; // no meaningful spacing for the first frame. 
+        _pacing_frames++;
+        if (_last_delta > _vsync_spacing) _pacing_late++;
+        if (_margin < 0) _pacing_teared++;
+        }
+
+
+    /** adjust vsync_spacing and the late start ratio (called before an update) */
+    void _pacingUpdate();
+
+
+    /** request a perceptual diff for the next computeDiff() of diff (if enabled). Return true if the diff will be perceptual */
+    bool _perceptualNext(DiffBuffBase* diff)
+        {
+        if (!diffPerceptualActive()) return false;
+        const int lines = (ILI9341_T4_TFTHEIGHT + _perc_frames - 1) / _perc_frames;
+        if (!diff->perceptualNextDiff(_perc_r, _perc_g, _perc_b, _perc_y, lines)) return false;
+        _perc_y = (_perc_y + lines) % ILI9341_T4_TFTHEIGHT;
+        return true;
+        }
+
+
+    /** record an idle frame, i.e. nothing changed on screen (called from the main thread) */
+    void _idleFrame()
+        {
+        noInterrupts();
+        _idle_count++;
+        interrupts();
+        }
+
+
+    /** record the last uploaded frame for the idle detection (called from _endframe()) */
+    void _idlePush()
+        {
+        if (_stats_nb_uploaded_pixels == 0) { _idle_count++; return; }
+        _idle_count = 0;
+        if (_idle_slow) _idle_wake = true;
+        }
+
+
+    /** switch to the low-power refresh mode if enough idle frames were observed */
+    void _idleCheck()
+        {
+        if ((_idle_frames > 0) && (!_idle_slow) && (_idle_count >= _idle_frames)) _enterIdleMode();
+        }
+
+
+    /** restore the normal refresh mode if the next frame is known to change or if a change was uploaded in low-power mode */
+    void _idleWakeUp(bool changed = true)
+        {
+        if ((_idle_slow) && ((changed) || (_idle_wake))) _leaveIdleMode();
+        }
+
+
+    /** send the FRMCTR1 command for a given mode (without measuring the refresh rate) */
+    void _sendRefreshMode(int mode);
+
+
+    /** switch the panel to the low-power refresh mode */
+    void _enterIdleMode();
+
+
+    /** restore the normal refresh mode */
+    void _leaveIdleMode();
+
+
+    /** record the last frame in the automatic gap estimator (called from _endframe()) */
+    void _autoGapPush();
+
+
+    /** select the gap for the next diff (called before the diff is computed) */
+    void _autoGapUpdate();
+
+
 
 
 
@@ -1747,6 +2780,18 @@ private:
 
     uint8_t _readcommand8(uint8_t reg, uint8_t index = 0, int timeout_ms = 10);
 
+    int _readPixels(int x, int y, int nb, uint16_t* dst);   // read nb pixels from the screen memory, starting at (x,y) in orientation 0. 
+
+    bool _checkWriteClock(int spi_clock, int pattern);     // write a test pattern at a given speed and check it by reading it back. 
+
+    void _restoreRegisters();                              // send the configuration registers again (after commands were possibly corrupted by probeSpiClock()). 
+
+    int _readbackOrder();                                  // find the channel order of _readPixels(): 0 = RGB, 1 = BGR and -1 if unknown. 
+
+    void _writePixel(int x, int y, uint16_t color);        // write a single pixel in the screen memory at (x,y) in orientation 0. 
+
+    static uint16_t _swapRedBlue(uint16_t c) { return (uint16_t)(((c & 0x1F) << 11) | (c & 0x7E0) | (c >> 11)); } // RGB565 <-> BGR565
+
 
     void _writecommand_cont(uint8_t c) __attribute__((always_inline))
         {
@@ -1849,6 +2894,19 @@ private:
     volatile bool _touch_has_calibration;       // true if touch calibration is enabled
     volatile int _touch_calib[4];               // touch calibration value
 
+    struct TouchSample
+        {
+        int16_t x, y, z;
+        uint32_t ms;
+        };
+
+    static_assert((ILI9341_T4_TOUCH_QUEUE_SIZE & (ILI9341_T4_TOUCH_QUEUE_SIZE - 1)) == 0, "ILI9341_T4_TOUCH_QUEUE_SIZE must be a power of 2");
+
+    TouchSample _touch_queue[ILI9341_T4_TOUCH_QUEUE_SIZE]; // single producer (the touch reading, in main code or in the DMA interrupt)
+    volatile uint32_t _touch_qhead;             // single consumer (popTouch()) queue of touch samples. 
+    volatile uint32_t _touch_qtail;             // (the counters only increase, indices are modulo ILI9341_T4_TOUCH_QUEUE_SIZE)
+    bool _touch_qdown;                          // true if the last sample pushed was a touch (not a release)
+
     static ILI9341Driver* volatile _touchObjects[4];   // point back to this->
 
     static void _touch_int0() { if (_touchObjects[0]) { _touchObjects[0]->_touch_int(); } }  // forward to the touch interrupt method cb
@@ -1875,6 +2933,33 @@ private:
     /** update the touch position via spi read (if needed), may be called at dma completion */
     void _updateTouch2();
 
+    /** perform the touch reading requested during the transfer, unless the bus is in use again (called at dma completion, after the next frame was launched) */
+    void _touchAfterFrame()
+        {
+        if ((_touch_request_read) && (!asyncUpdateActive()))
+            {
+            _updateTouch2();
+            _touch_request_read = false;
+            }
+        }
+
+    /** push a sample in the touch queue (drop it if the queue is full) */
+    void _pushTouch(int x, int y, int z)
+        {
+        const uint32_t h = _touch_qhead;
+        if (h - _touch_qtail >= ILI9341_T4_TOUCH_QUEUE_SIZE) return; // queue full
+        TouchSample& ts = _touch_queue[h & (ILI9341_T4_TOUCH_QUEUE_SIZE - 1)];
+        ts.x = x; ts.y = y; ts.z = z; ts.ms = millis();
+        asm volatile("dmb" ::: "memory"); // sample written before it is published
+        _touch_qhead = h + 1;
+        _touch_qdown = (z > 0);
+        }
+
+
+    /** map raw touch values to screen coordinates (if calibration is set) */
+    void _mapTouch(int rx, int ry, int& x, int& y);
+
+
     /** poor man's noise filtering */
     static int16_t _besttwoavg(int16_t x, int16_t y, int16_t z);
 
@@ -25,6 +25,7 @@
 
 // forward to the real header. 
 #include "ILI9341Driver.h"
+#include "MultiDisplay.h"
 
 
 #endif
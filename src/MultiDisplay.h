@@ -0,0 +1,289 @@
+/******************************************************************************
+*  ILI9341_T4 library for driving an ILI9341 screen via SPI with a Teensy 4/4.1
+*  Implements vsync and differential updates from a memory framebuffer.
+*
+*  Copyright (c) 2020 Arvind Singh.  All right reserved.
+*
+* This library is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU Lesser General Public
+*  License as published by the Free Software Foundation; either
+*  version 2.1 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*  Lesser General Public License for more details.
+*
+*  You should have received a copy of the GNU Lesser General Public
+*  License along with this library; if not, write to the Free Software
+*  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*******************************************************************************/
+#ifndef _ILI9341_T4_MULTIDISPLAY_H_
+#define _ILI9341_T4_MULTIDISPLAY_H_
+
+// only C++, no plain C
+#ifdef __cplusplus
+
+
+#include "ILI9341Driver.h"
+
+#include <stdint.h>
+#include <Arduino.h>
+
+namespace ILI9341_T4
+{
+
+
+/**
+ * Class that drives several screens (each on its own SPI bus, hence at most 3) as a single 
+ * logical surface described by one framebuffer.
+ *
+ * Each display is placed on the surface with add() and shows the rectangle of the surface
+ * starting at the given position (with the width and height of the display in its current
+ * orientation). For example, two screens in landscape mode placed at (0,0) and (320,0) 
+ * make a 640x240 surface. 
+ *
+ * update() pushes the frame to every display: displays whose previous upload is complete are
+ * served first (so their DMA starts immediately) and the diffs for the other ones are then 
+ * computed while their own upload completes. This way, each diff computation overlaps the 
+ * transfers of the other displays instead of waiting for them.
+ *
+ * Each driver must be configured as usual (begin(), framebuffers, diff buffers...) before 
+ * being added. Two diff buffers per driver are required to overlap the diffs with the uploads.
+ **/
+class MultiDisplay
+    {
+    public:
+
+        static const int MAX_DISPLAYS = 3;  // one per SPI bus.
+
+
+        /**
+         * ctor. No display.
+         **/
+        MultiDisplay() : _nb(0), _seq(0)
+            {
+            }
+
+
+        /**
+         * Add a display whose top left corner is at position (x,y) on the surface. 
+         * Return false if there are already MAX_DISPLAYS displays. 
+         **/
+        bool add(ILI9341Driver* tft, int x, int y)
+            {
+            if ((tft == nullptr) || (_nb >= MAX_DISPLAYS) || (x < 0) || (y < 0)) return false;
+            _tft[_nb] = tft;
+            _x[_nb] = x;
+            _y[_nb] = y;
+            _launch[_nb] = 0;
+            _nb++;
+            return true;
+            }
+
+
+        /**
+         * Number of displays. 
+         **/
+        int nbDisplays() const { return _nb; }
+
+
+        /**
+         * Return a given display (nullptr if it does not exist).
+         **/
+        ILI9341Driver* display(int index) const { return ((index < 0) || (index >= _nb)) ? nullptr : _tft[index]; }
+
+
+        /**
+         * Width of the surface (in pixels). 
+         **/
+        int width() const
+            {
+            int w = 0;
+            for (int i = 0; i < _nb; i++) { const int e = _x[i] + _tft[i]->width(); if (e > w) w = e; }
+            return w;
+            }
+
+
+        /**
+         * Height of the surface (in pixels).
+         **/
+        int height() const
+            {
+            int h = 0;
+            for (int i = 0; i < _nb; i++) { const int e = _y[i] + _tft[i]->height(); if (e > h) h = e; }
+            return h;
+            }
+
+
+        /**
+         * Push a new frame to all the displays. The layout of the framebuffer is
+         * Pixel(x,y) = fb[x + stride*y] (with stride = width() by default). 
+         **/
+        void update(const uint16_t* fb, int stride = -1)
+            {
+            if (fb == nullptr) return;
+            if (stride < 0) stride = width();
+            bool done[MAX_DISPLAYS] = { false, false, false };
+            for (int k = 0; k < _nb; k++)
+                {
+                int j = -1;
+                for (int i = 0; i < _nb; i++)
+                    { // first, a display that is ready to upload right away
+                    if ((!done[i]) && (!_tft[i]->asyncUpdateActive())) { j = i; break; }
+                    }
+                if (j < 0)
+                    { // otherwise, the one whose upload started first (it should complete first)
+                    for (int i = 0; i < _nb; i++)
+                        {
+                        if ((!done[i]) && ((j < 0) || ((int32_t)(_launch[i] - _launch[j]) < 0))) j = i;
+                        }
+                    }
+                done[j] = true;
+                ILI9341Driver* tft = _tft[j];
+                tft->updateRegion(true, fb + _x[j] + (stride * _y[j]), 0, tft->width() - 1, 0, tft->height() - 1, stride);
+                _launch[j] = ++_seq;
+                }
+            }
+
+
+        /**
+         * Wait until the uploads on all the displays are complete. 
+         **/
+        void waitUpdateAsyncComplete()
+            {
+            for (int i = 0; i < _nb; i++) _tft[i]->waitUpdateAsyncComplete();
+            }
+
+
+        /**
+         * Return true if an upload is ongoing on any of the displays. 
+         **/
+        bool asyncUpdateActive() const
+            {
+            for (int i = 0; i < _nb; i++) { if (_tft[i]->asyncUpdateActive()) return true; }
+            return false;
+            }
+
+
+        /**
+         * Set the same vsync spacing for all the displays.
+         **/
+        void setVSyncSpacing(int vsync_spacing)
+            {
+            for (int i = 0; i < _nb; i++) _tft[i]->setVSyncSpacing(vsync_spacing);
+            }
+
+
+        /**
+         * Set the refresh rate of all the displays. The mode reached by each screen depends 
+         * on its own oscillator so the rate of the slowest screen is then applied to the 
+         * other ones so that their framerates match as closely as possible.
+         **/
+        void setRefreshRate(float refreshrate_hz)
+            {
+            if (_nb == 0) return;
+            float r = refreshrate_hz;
+            for (int i = 0; i < _nb; i++)
+                {
+                _tft[i]->setRefreshRate(refreshrate_hz);
+                const float ri = _tft[i]->getRefreshRate();
+                if (ri < r) r = ri;
+                }
+            for (int i = 0; i < _nb; i++) _tft[i]->setRefreshRate(r);
+            }
+
+
+        /**
+         * Reset the statistics of all the displays.
+         **/
+        void statsReset()
+            {
+            for (int i = 0; i < _nb; i++) _tft[i]->statsReset();
+            }
+
+
+        /**
+         * Framerate of the surface: the framerate of the slowest display.
+         **/
+        float statsFramerate() const
+            {
+            float r = 0.0f;
+            for (int i = 0; i < _nb; i++) { const float ri = _tft[i]->statsFramerate(); if ((i == 0) || (ri < r)) r = ri; }
+            return r;
+            }
+
+
+        /**
+         * Total CPU time per frame (in microseconds, average over all the displays). 
+         **/
+        float statsCPUtimePerFrame() const
+            {
+            float s = 0.0f;
+            for (int i = 0; i < _nb; i++) s += _tft[i]->statsCPUtimePerFrame().avg();
+            return s;
+            }
+
+
+        /**
+         * Total number of pixels uploaded per frame (average, summed over all the displays).
+         **/
+        float statsPixelsPerFrame() const
+            {
+            float s = 0.0f;
+            for (int i = 0; i < _nb; i++) s += _tft[i]->statsPixelsPerFrame().avg();
+            return s;
+            }
+
+
+        /**
+         * Total number of teared frames (summed over all the displays).
+         **/
+        uint32_t statsNbTeared() const
+            {
+            uint32_t s = 0;
+            for (int i = 0; i < _nb; i++) s += _tft[i]->statsNbTeared();
+            return s;
+            }
+
+
+        /**
+         * Print the combined statistics on a stream, followed by the statistics of each 
+         * display (sent to the output stream of each driver) if details = true. 
+         **/
+        void printStats(Stream* outputStream = &Serial, bool details = false) const
+            {
+            if (outputStream == nullptr) return;
+            outputStream->printf("----------------- MultiDisplay Stats ------------------\n");
+            outputStream->printf("- surface            : %d x %d with %d displays\n", width(), height(), _nb);
+            outputStream->printf("- framerate          : %.1f FPS (slowest display)\n", statsFramerate());
+            for (int i = 0; i < _nb; i++) outputStream->printf("    display %d        : %.1f FPS\n", i, _tft[i]->statsFramerate());
+            outputStream->printf("- CPU time / frame   : %.0fus (all displays)\n", statsCPUtimePerFrame());
+            outputStream->printf("- pixels / frame     : %.0f (all displays)\n", statsPixelsPerFrame());
+            outputStream->printf("- teared frames      : %u\n\n", (unsigned int)statsNbTeared());
+            if (details)
+                {
+                for (int i = 0; i < _nb; i++) _tft[i]->printStats();
+                }
+            }
+
+
+    private:
+
+        int _nb;                                    // number of displays
+        uint32_t _seq;                              // counter for the uploads
+        ILI9341Driver* _tft[MAX_DISPLAYS];          // the displays
+        int _x[MAX_DISPLAYS], _y[MAX_DISPLAYS];     // position of the displays on the surface
+        uint32_t _launch[MAX_DISPLAYS];             // sequence number of the last upload launched on each display
+    };
+
+
+
+
+}
+
+#endif
+
+#endif
+
+/** end of file */
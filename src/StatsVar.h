@@ -26,12 +26,135 @@
 
 
 #include <stdint.h>
+#include <string.h>
 #include <Arduino.h>
 
 namespace ILI9341_T4
 {
 
 
+#define ILI9341_T4_STATS_HISTOGRAM 1        // set to 0 to remove the histogram (480 bytes) from each StatsVar object. percentile() then returns 0. 
+
+
+/**
+ * Class that stores an histogram of a sequence of int32 values with
+ * logarithmic buckets: values 0,1,2,3 have their own bucket and each
+ * interval [2^k, 2^(k+1)[ for k >= 2 is split in 4 buckets of equal
+ * width. Thus, the relative precision is always better than 25%.
+ *
+ * Negative values are all counted in the first bucket.
+ *
+ * push() is O(1) (and can be called from an interrupt) while
+ * percentile() runs through all the buckets.
+ **/
+ class StatsHistogram
+    {
+    public:
+
+        static const int NB_BUCKETS = 120;  // enough to cover all positive int32 values.
+
+
+        /** ctor. */
+        StatsHistogram()
+            {
+            reset();
+            }
+
+
+        /**
+         * Clear the histogram.
+         **/
+        void reset()
+            {
+            _count = 0;
+            memset(_buckets, 0, sizeof(_buckets));
+            }
+
+
+        /**
+         * Add a new value.
+         **/
+        void push(int32_t val)  __attribute__((always_inline))
+            {
+            _count++;
+            _buckets[_bucket(val)]++;
+            }
+
+
+        /**
+         * Return the current number of record pushed (since the last reset);
+         **/
+        uint32_t count() const { return _count; }
+
+
+        /**
+         * Return the number of values in a given bucket.
+         **/
+        uint32_t bucketCount(int index) const { return (((index < 0) || (index >= NB_BUCKETS)) ? 0 : _buckets[index]); }
+
+
+        /**
+         * Return the smallest value that belongs to a given bucket.
+         **/
+        static int32_t bucketLow(int index)
+            {
+            if (index < 4) return index;
+            const int e = (index - 4) >> 2;
+            return (int32_t)((4 + ((index - 4) & 3)) << e);
+            }
+
+
+        /**
+         * Return the number of values that map to a given bucket.
+         **/
+        static int32_t bucketWidth(int index)
+            {
+            return ((index < 4) ? 1 : (1 << ((index - 4) >> 2)));
+            }
+
+
+        /**
+         * Return an estimate of the p-th quantile of the sequence
+         * (p between 0 and 1, e.g. 0.99 for the 99th percentile).
+         * The value is interpolated linearly inside the bucket.
+         * Return 0 if the histogram is empty.
+         **/
+        float percentile(float p) const
+            {
+            if (_count == 0) return 0.0f;
+            if (p < 0.0f) p = 0.0f; else if (p > 1.0f) p = 1.0f;
+            const float rank = p * _count;
+            uint32_t cum = 0;
+            for (int i = 0; i < NB_BUCKETS; i++)
+                {
+                const uint32_t n = _buckets[i];
+                if ((n > 0) && (cum + n >= rank))
+                    {
+                    return bucketLow(i) + bucketWidth(i) * ((rank - cum) / n);
+                    }
+                cum += n;
+                }
+            return (float)bucketLow(NB_BUCKETS - 1);
+            }
+
+
+    private:
+
+        /** index of the bucket containing val */
+        static int _bucket(int32_t val) __attribute__((always_inline))
+            {
+            if (val < 4) return ((val < 0) ? 0 : val);
+            const int e = 31 - __builtin_clz((uint32_t)val); // e >= 2
+            return 4 + ((e - 2) << 2) + ((val >> (e - 2)) & 3);
+            }
+
+        uint32_t _count;
+        uint32_t _buckets[NB_BUCKETS];
+    };
+
+
+
+
 /**
  * Class that stores some statistics about a sequence of int32 values.
  * It keeps track of:
@@ -40,6 +163,7 @@ namespace ILI9341_T4
  * - the max value of the sequence
  * - the average value of the sequence. 
  * - the standard deviation around the average.  
+ * - an histogram of the values (used to compute percentiles), unless ILI9341_T4_STATS_HISTOGRAM is 0.
  * 
  **/
  class StatsVar
@@ -63,6 +187,9 @@ namespace ILI9341_T4
             _max = INT32_MIN;
             _sum = 0;
             _sumsqr = 0;
+#if ILI9341_T4_STATS_HISTOGRAM
+            _hist.reset();
+#endif
             }
 
 
@@ -76,6 +203,9 @@ namespace ILI9341_T4
             _sumsqr += (val * val);
             if (val < _min) _min = val; 
             if (val > _max) _max = val;
+#if ILI9341_T4_STATS_HISTOGRAM
+            _hist.push(val);
+#endif
             }
 
 
@@ -86,10 +216,17 @@ namespace ILI9341_T4
             {
             if (outputStream)
                 {
+#if ILI9341_T4_STATS_HISTOGRAM
+                if (with_precision)
+                    outputStream->printf("avg=%.2f%s [min=%d%s , max=%d%s] std=%.2f%s p95=%.2f%s p99=%.2f%s%s", avg(), unit, min(), unit, max(), unit, std(), unit, percentile(0.95f), unit, percentile(0.99f), unit, endl);
+                else
+                    outputStream->printf("avg=%.0f%s [min=%d%s , max=%d%s] std=%.0f%s p95=%.0f%s p99=%.0f%s%s", avg(), unit, min(), unit, max(), unit, std(), unit, percentile(0.95f), unit, percentile(0.99f), unit, endl);
+#else
                 if (with_precision)
                     outputStream->printf("avg=%.2f%s [min=%d%s , max=%d%s] std=%.2f%s%s", avg(), unit, min(), unit, max(), unit, std(), unit, endl);
                 else
                     outputStream->printf("avg=%.0f%s [min=%d%s , max=%d%s] std=%.0f%s%s", avg(), unit, min(), unit, max(), unit, std(), unit, endl);
+#endif
                 }
             }
 
@@ -131,6 +268,33 @@ namespace ILI9341_T4
             }
 
 
+        /**
+         * Return an estimate of the p-th quantile of all records (since the last reset),
+         * e.g. percentile(0.5) for the median or percentile(0.99) for the 99th percentile.
+         * The estimate is computed from the histogram and then clamped to [min, max] so 
+         * it is exact at both ends but has only a relative precision of 25% in between.
+         * Always return 0 when ILI9341_T4_STATS_HISTOGRAM is 0. 
+         **/
+        float percentile(float p) const
+            {
+#if ILI9341_T4_STATS_HISTOGRAM
+            if (_count == 0) return 0.0f;
+            const float v = _hist.percentile(p);
+            return ((v < _min) ? _min : ((v > _max) ? _max : v));
+#else
+            return 0.0f;
+#endif
+            }
+
+
+#if ILI9341_T4_STATS_HISTOGRAM
+        /**
+         * Return the histogram of all records (since the last reset).
+         **/
+        const StatsHistogram & histogram() const { return _hist; }
+#endif
+
+
         private:
 
             uint32_t _count; 
@@ -138,6 +302,9 @@ namespace ILI9341_T4
             int32_t _max;
             int64_t _sum;
             int64_t _sumsqr;
+#if ILI9341_T4_STATS_HISTOGRAM
+            StatsHistogram _hist;
+#endif
     };
 
 
@@ -0,0 +1,203 @@
+/******************************************************************************
+*  ILI9341_T4 library for driving an ILI9341 screen via SPI with a Teensy 4/4.1
+*  Implements vsync and differential updates from a memory framebuffer.
+*
+*  Copyright (c) 2020 Arvind Singh.  All right reserved.
+*
+* This library is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU Lesser General Public
+*  License as published by the Free Software Foundation; either
+*  version 2.1 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+*  Lesser General Public License for more details.
+*
+*  You should have received a copy of the GNU Lesser General Public
+*  License along with this library; if not, write to the Free Software
+*  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*******************************************************************************/
+#ifndef _ILI9341_T4_TRACEBUFFER_H_
+#define _ILI9341_T4_TRACEBUFFER_H_
+
+// only C++, no plain C
+#ifdef __cplusplus
+
+
+#include <stdint.h>
+#include <Arduino.h>
+
+namespace ILI9341_T4
+{
+
+
+    /** types of events recorded by the driver */
+    enum TraceEvent
+        {
+        TRACE_UPDATE = 0,       // update() called (arg = 1 if a full redraw is forced)
+        TRACE_DIFF_DONE,        // diff computed (or streamed diff started) and upload scheduled (arg = first scanline)
+        TRACE_UPLOAD_START,     // first DMA transfer of the frame started (arg = estimated scanline, 640 without vsync)
+        TRACE_DMA_CHUNK,        // new DMA transfer started (arg = number of pixels)
+        TRACE_SCANLINE_WAIT,    // waiting for the scanline to move on (arg = scanline waited for)
+        TRACE_STREAM_WAIT,      // waiting for a streamed diff to be computed 
+        TRACE_TOUCH_READ,       // touchscreen read
+        TRACE_FRAME_END         // end of the frame (arg = number of transactions)
+        };
+
+
+    /**
+    * Return the name of an event.
+    **/
+    inline const char* traceEventName(int event)
+        {
+        switch (event)
+            {
+            case TRACE_UPDATE:          return "update";
+            case TRACE_DIFF_DONE:       return "diff done";
+            case TRACE_UPLOAD_START:    return "upload start";
+            case TRACE_DMA_CHUNK:       return "dma chunk";
+            case TRACE_SCANLINE_WAIT:   return "scanline wait";
+            case TRACE_STREAM_WAIT:     return "stream wait";
+            case TRACE_TOUCH_READ:      return "touch read";
+            case TRACE_FRAME_END:       return "frame end";
+            }
+        return "?";
+        }
+
+
+    /**
+    * One record of a TraceBuffer.
+    **/
+    struct TraceEntry
+        {
+        uint32_t cycles;    // value of the cycle counter (ARM_DWT_CYCCNT) when the event occured
+        uint16_t event;     // type of event (one of the TraceEvent constants)
+        int16_t  arg;       // event dependent argument
+        };
+
+
+
+    /**
+    * Ring buffer of timestamped events used to trace the timeline of the 
+    * driver's upload state machine (see ILI9341Driver::printTrace()).
+    * 
+    * Timestamps are read from the cycle counter so push() costs only a 
+    * few cycles and can be called from interrupts. When the buffer is full, 
+    * the oldest records are overwritten. 
+    * 
+    * NSIZE must be a power of 2.
+    **/
+    template<int NSIZE> class TraceBuffer
+    {
+
+        static_assert((NSIZE > 0) && ((NSIZE & (NSIZE - 1)) == 0), "TraceBuffer size must be a power of 2");
+
+    public:
+
+        /** ctor. */
+        TraceBuffer()
+            {
+            reset();
+            }
+
+
+        /**
+        * Remove all records.
+        **/
+        void reset()
+            {
+            _head = 0;
+            }
+
+
+        /**
+        * Record an event (safe to call from an interrupt).
+        **/
+        void push(int event, int arg = 0) __attribute__((always_inline))
+            {
+            const uint32_t primask = _irqSave();
+            TraceEntry& e = _tab[(_head++) & (NSIZE - 1)];
+            e.cycles = ARM_DWT_CYCCNT;
+            e.event = (uint16_t)event;
+            e.arg = (int16_t)arg;
+            _irqRestore(primask);
+            }
+
+
+        /**
+        * Return the number of records available (at most NSIZE).
+        **/
+        int size() const { return ((_head < (uint32_t)NSIZE) ? (int)_head : NSIZE); }
+
+
+        /**
+        * Copy the records (oldest first) into dst which must have room for maxn 
+        * entries. Return the number of entries copied. 
+        **/
+        int copy(TraceEntry* dst, int maxn) const
+            {
+            const uint32_t primask = _irqSave();
+            const uint32_t head = _head;
+            int n = ((head < (uint32_t)NSIZE) ? (int)head : NSIZE);
+            if (n > maxn) n = maxn;
+            for (int i = 0; i < n; i++) dst[i] = _tab[(head - n + i) & (NSIZE - 1)];
+            _irqRestore(primask);
+            return n;
+            }
+
+
+        /**
+        * Print the records (oldest first) into a stream, one per line with the 
+        * time (in us) since the first record and since the previous one.
+        **/
+        void print(Stream* outputStream) const
+            {
+            if (outputStream == nullptr) return;
+            TraceEntry e, prev, first;
+            uint32_t primask = _irqSave();
+            const uint32_t head = _head;
+            _irqRestore(primask);
+            const int n = ((head < (uint32_t)NSIZE) ? (int)head : NSIZE);
+            const float cpus = F_CPU_ACTUAL / 1000000.0f; // cycles per microsecond
+            outputStream->printf("time_us,delta_us,event,arg\n");
+            for (int i = 0; i < n; i++)
+                {
+                primask = _irqSave();
+                e = _tab[(head - n + i) & (NSIZE - 1)]; // (may have been overwritten meanwhile if tracing is still active)
+                _irqRestore(primask);
+                if (i == 0) { first = e; prev = e; }
+                outputStream->printf("%.1f,%.1f,%s,%d\n", (e.cycles - first.cycles) / cpus, (e.cycles - prev.cycles) / cpus, traceEventName(e.event), e.arg);
+                prev = e;
+                }
+            }
+
+
+    private:
+
+        /** disable the interrupts and return the previous PRIMASK (so that it can be called with interrupts already disabled) */
+        static uint32_t _irqSave() __attribute__((always_inline))
+            {
+            uint32_t primask;
+            __asm__ volatile("mrs %0, primask" : "=r" (primask));
+            __disable_irq();
+            return primask;
+            }
+
+        /** restore the interrupt state saved by _irqSave() */
+        static void _irqRestore(uint32_t primask) __attribute__((always_inline)) { if (!primask) __enable_irq(); }
+
+        volatile uint32_t _head;    // total number of records pushed (index of the next one modulo NSIZE)
+        TraceEntry _tab[NSIZE];     // the records
+    };
+
+
+
+}
+
+#endif
+
+#endif
+
+/** end of file */
+